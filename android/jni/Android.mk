@@ -4,7 +4,7 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE    := sfml-example
 
-LOCAL_SRC_FILES := main.cpp Display.cpp Chip8.cpp  
+LOCAL_SRC_FILES := main.cpp Display.cpp EmulationThread.cpp PostProcess.cpp SquareWave.cpp Chip8.cpp Movie.cpp Rewind.cpp Rom.cpp Trace.cpp X86Emitter.cpp  
 LOCAL_SHARED_LIBRARIES := sfml-system
 LOCAL_SHARED_LIBRARIES += sfml-window
 LOCAL_SHARED_LIBRARIES += sfml-graphics
@@ -0,0 +1 @@
+../../src/EmulationThread.cpp
\ No newline at end of file
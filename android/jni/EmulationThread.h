@@ -0,0 +1 @@
+../../src/EmulationThread.h
\ No newline at end of file
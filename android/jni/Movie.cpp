@@ -0,0 +1 @@
+../../src/Movie.cpp
\ No newline at end of file
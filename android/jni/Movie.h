@@ -0,0 +1 @@
+../../src/Movie.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/PostProcess.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/PostProcess.h
\ No newline at end of file
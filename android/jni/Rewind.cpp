@@ -0,0 +1 @@
+../../src/Rewind.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/Rewind.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/RingBuffer.h
\ No newline at end of file
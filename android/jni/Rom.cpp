@@ -0,0 +1 @@
+../../src/Rom.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/Rom.h
\ No newline at end of file
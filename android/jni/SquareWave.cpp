@@ -0,0 +1 @@
+../../src/SquareWave.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/SquareWave.h
\ No newline at end of file
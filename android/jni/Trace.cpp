@@ -0,0 +1 @@
+../../src/Trace.cpp
\ No newline at end of file
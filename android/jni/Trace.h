@@ -0,0 +1 @@
+../../src/Trace.h
\ No newline at end of file
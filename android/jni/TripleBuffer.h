@@ -0,0 +1 @@
+../../src/TripleBuffer.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/X86Emitter.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/X86Emitter.h
\ No newline at end of file
@@ -2,8 +2,12 @@
 
 #include "Display.h"
 #include "Chip8.h"
+#include "EmulationThread.h"
+#include "Rom.h"
+#include "SquareWave.h"
 
 #include <deque>
+#include <vector>
 #include <iostream>
 
 #include <SFML/System.hpp>
@@ -75,78 +79,65 @@ int main(void)
    std::cout << "Starting Chip-8 emulator" << std::endl;
    Display display;
    Chip8 chip8;
-   chip8.setCpuRate(0);
-   chip8.loadGame([](Register* offset){
-      sf::FileInputStream gameFile;
-      if (not gameFile.open("PONG2"))
-      {
-         throw std::invalid_argument("Cannot open game");
-      }
-      gameFile.read(offset, gameFile.getSize());
+   // The game is an asset, not a file that can be mapped
+   sf::FileInputStream gameFile;
+   if (not gameFile.open("PONG2"))
+   {
+      throw std::invalid_argument("Cannot open game");
+   }
+   std::vector<uint8_t> game(gameFile.getSize());
+   gameFile.read(game.data(), game.size());
+   chip8.loadGame(*Rom::view(game.data(), game.size()));
+   // The Chip8 runs on its own thread, the display only presents its frames
+   EmulationThread emulation(chip8);
+   SquareWave sound;
+   emulation.setSound([&sound](bool toneOn)
+   {
+      sound.queueFrame(toneOn);
    });
-   auto cycleCallback = [&]
+
+   auto frameCallback = [&]
    {
-      chip8.emulateCycle();
-      return std::make_pair(chip8.drawNeeded(), chip8.beepNeeded());
+      return emulation.newFrame();
    };
    
    auto drawCallback = [&]
    {
-      for (size_t y = 0; y < ScreenYLimit; y++)
-      {
-         size_t y_offset = y * ScreenXLimit;
-         for (size_t x = 0; x < ScreenXLimit; x++)
-         {
-            auto bits = std::bitset<8>(chip8.getGraphics().at(y_offset + x));
-            for (size_t i = 0; i < 8; ++i)
-            {
-               if (bits[i])
-               {
-                  display.drawPixel(x, y);
-               }
-            }
-         }
-      }
+      display.drawGraphics(emulation.getGraphics());
    };
    
    Display::KeyboardCallbacks keyboard;
    Display::TouchpadCallbacks touchpad;
 
    keyboard.keyPressed = 
-   [&](sf::Keyboard::Key key)
+   [&](sf::Keyboard::Key)
    {
-      std::cout << "Key pressed" << std::endl;
    };
    
    keyboard.keyReleased =
-   [&](sf::Keyboard::Key key)
+   [&](sf::Keyboard::Key)
    {
-      std::cout << "Key released" << std::endl;
    };
    
    touchpad.touchBegan = 
    [&](const sf::Event::TouchEvent& touch)
    {
-      std::cout << "Touch began: " << touch.x << ", " << touch.y << std::endl;
       for (const auto& areaAndKey : pongTouchAreaToKey)
       {
          if (areaAndKey.first.contains(touch.x, touch.y))
          {
-            chip8.pressKey(areaAndKey.second);
-            std::cout << "Pressing key: " << areaAndKey.second << std::endl;
+            emulation.pressKey(areaAndKey.second);
          }
       }
    };
    touchpad.touchEnded = 
    [&](const sf::Event::TouchEvent& touch)
    {
-      std::cout << "Touch ended: " << touch.x << ", " << touch.y << std::endl;
       for (const auto& areaAndKey : pongTouchAreaToKey)
       {
          if (areaAndKey.first.contains(touch.x, touch.y))
          {
-            chip8.releaseKey(areaAndKey.second);
-            std::cout << "Releasing key: " << areaAndKey.second << std::endl;
+            emulation.releaseKey(areaAndKey.second);
          }
       }
    };
@@ -156,10 +147,14 @@ int main(void)
   
    };
 
+   emulation.start();
+   sound.play();
    display.loop(
-         cycleCallback, 
+         frameCallback, 
          drawCallback, 
          keyboard, 
          touchpad);
+   emulation.stop();
+   sound.stop();
    return 0;   
 }
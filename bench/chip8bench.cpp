@@ -0,0 +1,422 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include "Chip8.h"
+#include "Rom.h"
+
+// Interpreter throughput benchmarks.
+//
+// Every ROM given in the command line is run headless a frame at a time, through
+// Chip8::emulateFrame as headless jobs do, and every opcode handler is run in
+// a loop of a synthetic program. The engine is the interpreter unless the
+// recompiler is asked for. The results are written as JSON and, when a
+// baseline produced by a previous run is given, compared against it.
+
+struct Options
+{
+   uint64_t cycles = 2000000;
+   uint32_t cpu_rate = DefaultCpuRate;
+   uint32_t repetitions = 3;
+   double tolerance = 0.25;
+   Engine engine = Engine::Interpreter;
+   std::string output_file;
+   std::string baseline_file;
+   std::vector<std::string> rom_files;
+};
+
+struct Result
+{
+   uint64_t cycles = 0;
+   double nsPerInstruction = 0;
+   std::string error;
+};
+
+using Results = std::map<std::string, Result>;
+
+// A synthetic program: the prologue runs once, then the body is unrolled
+// and looped with a jump back to its beginning.
+struct Microbenchmark
+{
+   std::string name;
+   std::vector<Opcode> prologue;
+   std::vector<Opcode> body;
+};
+
+const size_t Unroll = 32;
+
+void printUsage()
+{
+   std::cout << "Usage: chip8bench [--cycles|-n 'cycles'] [--cpu-rate|-c 'rate'] "
+                "[--repetitions|-R 'times'] "
+                "[--output|-o 'json'] [--baseline|-b 'json'] [--tolerance|-t 'ratio'] "
+                "[--engine|-e interpreter|recompiler] ROM..." << std::endl;
+   exit(EXIT_FAILURE);
+}
+
+Engine parseEngine(const std::string& name)
+{
+   if (name == "interpreter")
+   {
+      return Engine::Interpreter;
+   }
+   if (name == "recompiler")
+   {
+      return Engine::Recompiler;
+   }
+   throw std::invalid_argument(std::string("Unknown engine ") + name);
+}
+
+Options loadOptions(int argc, char** argv)
+{
+   Options options;
+   int opt = 0;
+
+   static struct option long_options[] =
+   {
+      {"cycles",      required_argument,  0, 'n'},
+      {"cpu-rate",    required_argument,  0, 'c'},
+      {"repetitions", required_argument,  0, 'R'},
+      {"output",      required_argument,  0, 'o'},
+      {"baseline",    required_argument,  0, 'b'},
+      {"tolerance",   required_argument,  0, 't'},
+      {"engine",      required_argument,  0, 'e'},
+      {"help",        no_argument,        0, 'h'},
+      {0, 0, 0, 0}
+   };
+
+   int option_index = 0;
+   while ((opt = getopt_long (argc, argv, "n:c:R:o:b:t:e:h", long_options, &option_index)) != -1)
+   {
+      switch (opt)
+      {
+         case 'n':
+            options.cycles = std::stoull(optarg);
+            break;
+         case 'c':
+            options.cpu_rate = std::stoul(optarg);
+            if (options.cpu_rate < FrameRate)
+            {
+               throw std::invalid_argument("The cpu rate has to be at least one opcode per frame");
+            }
+            break;
+         case 'R':
+            options.repetitions = std::max(1, std::stoi(optarg));
+            break;
+         case 'o':
+            options.output_file = optarg;
+            break;
+         case 'b':
+            options.baseline_file = optarg;
+            break;
+         case 't':
+            options.tolerance = std::stod(optarg);
+            break;
+         case 'e':
+            options.engine = parseEngine(optarg);
+            break;
+         case 'h':
+            printUsage();
+            break;
+         default:
+            throw std::invalid_argument(std::string(1, static_cast<char>(opt)));
+      }
+   }
+
+   for (int i = optind; i < argc; ++i)
+   {
+      options.rom_files.push_back(argv[i]);
+   }
+   return options;
+}
+
+std::vector<Microbenchmark> microbenchmarks()
+{
+   // I points to a scratch area far from the program for the memory opcodes
+   const Opcode scratch = 0xAE00;
+   return std::vector<Microbenchmark>
+   {
+      {"00E0", {}, {0x00E0}},
+      {"1nnn", {}, {}},
+      {"2nnn/00EE", {}, {}},
+      {"3xkk", {}, {0x3001}},
+      {"4xkk", {}, {0x4000}},
+      {"5xy0", {0x6101}, {0x5010}},
+      {"6xkk", {}, {0x6012}},
+      {"7xkk", {}, {0x7001}},
+      {"8xy0", {}, {0x8010}},
+      {"8xy1", {}, {0x8011}},
+      {"8xy2", {}, {0x8012}},
+      {"8xy3", {}, {0x8013}},
+      {"8xy4", {}, {0x8014}},
+      {"8xy5", {}, {0x8015}},
+      {"8xy6", {}, {0x8016}},
+      {"8xy7", {}, {0x8017}},
+      {"8xyE", {}, {0x801E}},
+      {"9xy0", {}, {0x9010}},
+      {"Annn", {}, {0xA123}},
+      {"Bnnn", {}, {}},
+      {"Cxkk", {}, {0xC0FF}},
+      {"Dxyn", {0xA000}, {0xD015}},
+      {"Ex9E", {}, {0xE09E}},
+      {"ExA1", {0x6001}, {0xE0A1}},
+      {"Fx07", {}, {0xF007}},
+      {"Fx15", {}, {0xF015}},
+      {"Fx18", {}, {0xF018}},
+      {"Fx1E", {}, {0xF01E}},
+      {"Fx29", {}, {0xF029}},
+      {"Fx33", {scratch}, {0xF033}},
+      {"Fx55", {scratch}, {0xFF55}},
+      {"Fx65", {scratch}, {0xFF65}},
+   };
+}
+
+// Lays out the program and returns it as big endian bytes
+std::vector<Register> assemble(const Microbenchmark& benchmark)
+{
+   std::vector<Opcode> program(benchmark.prologue);
+   Address loop = ProgramStart + program.size() * 2;
+   for (size_t i = 0; i < Unroll; ++i)
+   {
+      Address next = loop + (i + 1) * 2;
+      if (benchmark.name == "1nnn")
+      {
+         program.push_back(0x1000 | next);
+      }
+      else if (benchmark.name == "Bnnn")
+      {
+         // V0 is 0, so it jumps to the next one
+         program.push_back(0xB000 | next);
+      }
+      else if (benchmark.name == "2nnn/00EE")
+      {
+         // The subroutine is placed right after the jump back
+         program.push_back(0x2000 | (loop + (Unroll + 1) * 2));
+      }
+      else
+      {
+         program.insert(program.end(), benchmark.body.begin(), benchmark.body.end());
+      }
+   }
+   program.push_back(0x1000 | loop);
+   program.push_back(0x00EE);
+
+   std::vector<Register> bytes;
+   for (auto opcode : program)
+   {
+      bytes.push_back(opcode >> 8);
+      bytes.push_back(opcode & 0xFF);
+   }
+   return bytes;
+}
+
+Result measure(const std::function<void(Chip8&)>& loader, const Options& options)
+{
+   Result best;
+   for (uint32_t repetition = 0; repetition < options.repetitions; ++repetition)
+   {
+      Chip8 chip8;
+      chip8.setCpuRate(options.cpu_rate);
+      chip8.setEngine(options.engine);
+      loader(chip8);
+
+      Result result;
+      auto start = std::chrono::steady_clock::now();
+      try
+      {
+         while (result.cycles < options.cycles)
+         {
+            chip8.emulateFrame();
+            result.cycles += chip8.getCyclesPerFrame();
+         }
+      }
+      catch (const std::exception& e)
+      {
+         result.error = e.what();
+      }
+      auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      result.nsPerInstruction = result.cycles > 0 ? elapsed / result.cycles : 0;
+
+      if (repetition == 0 or result.nsPerInstruction < best.nsPerInstruction)
+      {
+         best = result;
+      }
+   }
+   return best;
+}
+
+void writeSection(std::ostream& out, const std::string& name, const Results& results)
+{
+   out << "  \"" << name << "\": {" << std::endl;
+   size_t i = 0;
+   for (const auto& result : results)
+   {
+      out << "    \"" << result.first << "\": {"
+          << "\"ns_per_instruction\": " << std::fixed << std::setprecision(3) << result.second.nsPerInstruction
+          << ", \"instructions_per_second\": " << std::setprecision(0)
+          << (result.second.nsPerInstruction > 0 ? 1e9 / result.second.nsPerInstruction : 0.0)
+          << ", \"instructions\": " << result.second.cycles;
+      if (not result.second.error.empty())
+      {
+         out << ", \"error\": \"" << result.second.error << "\"";
+      }
+      out << "}" << (++i < results.size() ? "," : "") << std::endl;
+   }
+   out << "  }";
+}
+
+void writeJson(std::ostream& out, const Results& roms, const Results& opcodes)
+{
+   out << "{" << std::endl;
+   writeSection(out, "roms", roms);
+   out << "," << std::endl;
+   writeSection(out, "opcodes", opcodes);
+   out << std::endl << "}" << std::endl;
+}
+
+// Reads back the JSON written by writeJson, one result per line
+std::map<std::string, Results> readJson(const std::string& name)
+{
+   std::ifstream file(name);
+   if (not file.is_open())
+   {
+      throw std::invalid_argument(std::string("Cannot open baseline ") + name);
+   }
+
+   std::map<std::string, Results> sections;
+   std::string section;
+   std::string line;
+   while (std::getline(file, line))
+   {
+      auto begin = line.find('"');
+      auto end = line.find('"', begin + 1);
+      if (begin == std::string::npos or end == std::string::npos)
+      {
+         continue;
+      }
+      auto key = line.substr(begin + 1, end - begin - 1);
+      const std::string field = "\"ns_per_instruction\": ";
+      auto value = line.find(field);
+      if (value == std::string::npos)
+      {
+         section = key;
+         continue;
+      }
+      sections[section][key].nsPerInstruction = std::stod(line.substr(value + field.size()));
+   }
+   return sections;
+}
+
+size_t compare(const std::string& name, const Results& results, const Results& baseline, double tolerance)
+{
+   size_t regressions = 0;
+   for (const auto& result : results)
+   {
+      auto reference = baseline.find(result.first);
+      if (reference == baseline.end() or reference->second.nsPerInstruction <= 0)
+      {
+         continue;
+      }
+      auto ratio = result.second.nsPerInstruction / reference->second.nsPerInstruction;
+      if (ratio > 1 + tolerance)
+      {
+         ++regressions;
+         std::cout << "REGRESSION " << name << " " << result.first << ": "
+                   << std::fixed << std::setprecision(2)
+                   << reference->second.nsPerInstruction << " -> "
+                   << result.second.nsPerInstruction << " ns/instruction ("
+                   << std::setprecision(0) << (ratio - 1) * 100 << "% slower)" << std::endl;
+      }
+   }
+   return regressions;
+}
+
+void printResults(const std::string& title, const Results& results)
+{
+   std::cout << std::left << std::setw(24) << title << std::right
+             << std::setw(14) << "ns/instr" << std::setw(14) << "Minstr/s" << std::endl;
+   for (const auto& result : results)
+   {
+      std::cout << std::left << std::setw(24) << result.first << std::right
+                << std::fixed << std::setprecision(2)
+                << std::setw(14) << result.second.nsPerInstruction
+                << std::setw(14) << (result.second.nsPerInstruction > 0 ? 1e3 / result.second.nsPerInstruction : 0.0);
+      if (not result.second.error.empty())
+      {
+         std::cout << "  error: " << result.second.error;
+      }
+      std::cout << std::endl;
+   }
+}
+
+int main(int argc, char **argv)
+{
+   Options options;
+   try
+   {
+      options = loadOptions(argc, argv);
+   }
+   catch (const std::exception& e)
+   {
+      std::cerr << "Invalid argument " << e.what() << std::endl;
+      printUsage();
+   }
+
+   Results roms;
+   Results opcodes;
+
+   for (const auto& rom_file : options.rom_files)
+   {
+      try
+      {
+         auto rom = Rom::map(rom_file);
+         roms[rom_file] = measure([&](Chip8& chip8) { chip8.loadGame(*rom); }, options);
+      }
+      catch (const std::exception& e)
+      {
+         roms[rom_file].error = e.what();
+      }
+   }
+   for (const auto& benchmark : microbenchmarks())
+   {
+      auto program = assemble(benchmark);
+      auto rom = Rom::view(program.data(), program.size());
+      opcodes[benchmark.name] = measure([&](Chip8& chip8) { chip8.loadGame(*rom); }, options);
+   }
+
+   printResults("rom", roms);
+   printResults("opcode", opcodes);
+
+   if (not options.output_file.empty())
+   {
+      std::ofstream output(options.output_file);
+      writeJson(output, roms, opcodes);
+   }
+   else
+   {
+      writeJson(std::cout, roms, opcodes);
+   }
+
+   if (not options.baseline_file.empty())
+   {
+      auto baseline = readJson(options.baseline_file);
+      auto regressions = compare("rom", roms, baseline["roms"], options.tolerance)
+                       + compare("opcode", opcodes, baseline["opcodes"], options.tolerance);
+      if (regressions > 0)
+      {
+         std::cout << regressions << " regressions against " << options.baseline_file << std::endl;
+         return EXIT_FAILURE;
+      }
+      std::cout << "No regressions against " << options.baseline_file << std::endl;
+   }
+   return EXIT_SUCCESS;
+}
@@ -1,57 +1,50 @@
 #include "Chip8.h"
 
-#include <cstdio>
+#include <algorithm>
+#include <iomanip>
 #include <random>
-#include <unistd.h>
-#include <termios.h>
+#include <cstring>
+#include <type_traits>
 
 #include <iostream>
-#include <fstream>
+#include <sstream>
 #include <string>
 #include <array>
+#include <bitset>
+#include <functional>
 #include <unordered_map>
+#include <vector>
 
 #include "Chip8Types.h"
+#include "Rom.h"
+#include "X86Emitter.h"
 
-#ifdef DEBUG 
-#define D(runner) debugRunner(runner, #runner)
+#if defined(DEBUG) or defined(CHIP8_STATS)
+#define D(runner) Decoder(runner, #runner)
 #else
 #define D(runner) runner
 #endif 
 
+// The counters compile away unless built with CHIP8_STATS
+#ifdef CHIP8_STATS
+#define STATS(statement) statement
+#else
+#define STATS(statement)
+#endif
+
 namespace
 {
-   
-   std::array<unsigned char, 80> chip8_fontset ={
-   { 
-      0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-      0x20, 0x60, 0x20, 0x20, 0x70, // 1
-      0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-      0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-      0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-      0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-      0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-      0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-      0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-      0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-      0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-      0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-      0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-      0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-      0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-      0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-   }};
-
    class Machine
    {
     public:
       Machine()
-      :sp(0)
+      :random(randomSeed())
+      ,sp(0)
       ,I(0xFFFF)
       ,delayTimer(0)
       ,soundTimer(0)
       // At the old systems the emulator is at the beginning
-      ,pc(0x200)
+      ,pc(ProgramStart)
       {
          
          clear(stack);
@@ -65,7 +58,12 @@ namespace
       
       Opcode fetchOpcode()
       {
-         return memory[pc] << 8 | memory[pc + 1];
+         return fetchOpcode(pc);
+      }
+
+      Opcode fetchOpcode(Address address) const
+      {
+         return memory[address] << 8 | memory[address + 1];
       }
       
       Memory::pointer getMemory()
@@ -111,7 +109,7 @@ namespace
          pc = counter;       
       }
       
-      Counter getProgramCounter()
+      Counter getProgramCounter() const
       {
          return pc;
       }
@@ -120,15 +118,30 @@ namespace
       {
          pc += 2;
       }
-      std::random_device rd;
-      Stack::size_type sp;
+
+      // splitmix64, a whole 64 bits state so a seed is all it needs
+      Register nextRandom()
+      {
+         auto z = (random += 0x9E3779B97F4A7C15ULL);
+         z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+         z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+         return static_cast<Register>((z ^ (z >> 31)) >> 56);
+      }
+
+      void setSeed(uint64_t seed)
+      {
+         random = seed;
+      }
+      // Widest first so there is no padding, save states are these bytes
+      Graphics graphics;
+      uint64_t random;
       Stack stack;
+      Keypad keypad;
       Registers V;
+      Counter sp;
       Counter I;
       Timer delayTimer;
       Timer soundTimer;
-      Graphics graphics;
-      Keypad keypad;
    private:
  
       Memory memory;
@@ -143,26 +156,27 @@ namespace
          }
       }
 
+      static uint64_t randomSeed()
+      {
+         std::random_device device;
+         return static_cast<uint64_t>(device()) << 32 | device();
+      }
+
       void loadFonset()
       {
-         for (size_t i = 0; i < chip8_fontset.size(); ++i)
+         for (size_t i = 0; i < Fontset.size(); ++i)
          {
-            memory[i] = chip8_fontset[i]; 
+            memory[i] = Fontset[i]; 
          }
       }
 
    };
    
+   
    enum class OpcodeRunnerResult { SkippNeeded, SkippNotNeeded };
 
-   // We are going to capture with the lambda so we need a std::function
-   using OpcodeRunner      = std::function<OpcodeRunnerResult(Opcode)>;
-   using OpcodeExtractor   = std::function<Opcode(Opcode)>;
-   using Extractor         = std::function<Register()>;
-   template<size_t S>
-   using Opcodes           = std::array<OpcodeRunner, S>;
-   using Mapping           = std::unordered_map<Register, OpcodeRunner>;
-   
+   using Flow = OpcodeFlow;
+
    Register lsb(Register value)
    {
       auto mask = ~(std::numeric_limits<Register>::max() - 1);
@@ -175,166 +189,493 @@ namespace
       return value >> bits;
    }
 
-   Opcode nnn(Opcode opcode)
+   // The operand extractors are empty types, the runners are instantiated
+   // with them so the operands are decoded inline without any closure.
+   struct Nnn
    {
-      return opcode & 0x0FFF;
-   }
-   Opcode kk(Opcode opcode)
+      static Opcode get(Machine&, Opcode opcode)
+      {
+         return opcode & 0x0FFF;
+      }
+   };
+
+   struct Kk
    {
-      return opcode & 0x00FF;
-   }
-    
-   Opcode n(Opcode opcode)
+      static Opcode get(Machine&, Opcode opcode)
+      {
+         return opcode & 0x00FF;
+      }
+   };
+
+   struct N
    {
-      return opcode & 0x000F;
-   }
+      static Opcode get(Machine&, Opcode opcode)
+      {
+         return opcode & 0x000F;
+      }
+   };
 
-   Opcode x(Opcode opcode)
+   struct X
    {
-      return (opcode & 0x0F00) >> 8;
-   }
+      static Opcode get(Machine&, Opcode opcode)
+      {
+         return (opcode & 0x0F00) >> 8;
+      }
+   };
 
-   Opcode y(Opcode opcode)
+   struct Y
    {
-      return (opcode & 0x00F0) >> 4;
-   }
+      static Opcode get(Machine&, Opcode opcode)
+      {
+         return (opcode & 0x00F0) >> 4;
+      }
+   };
+
+   template<typename Index>
+   struct FromV
+   {
+      static Register get(Machine& machine, Opcode opcode)
+      {
+         return machine.V[Index::get(machine, opcode)];
+      }
+   };
+
+   template<size_t index>
+   struct FromFixedV
+   {
+      static Register get(Machine& machine, Opcode)
+      {
+         return machine.V[index];
+      }
+   };
+
+   template<typename T, T Machine::*attribute>
+   struct From
+   {
+      static T get(Machine& machine, Opcode)
+      {
+         return machine.*attribute;
+      }
+
+      static T& ref(Machine& machine)
+      {
+         return machine.*attribute;
+      }
+   };
    
-   // Wait for a key to be pressed and return the value
-   Register keyPressed()
-   {
-      std::cout << "TODO: keyPressed" << std::endl;
-      Register buf = 0;
-      /*
-      struct termios old = {0};
-      if (tcgetattr(0, &old) < 0)
-         perror("tcsetattr()");
-      old.c_lflag &= ~ICANON;
-      old.c_lflag &= ~ECHO;
-      old.c_cc[VMIN] = 1;
-      old.c_cc[VTIME] = 0;
-      if (tcsetattr(0, TCSANOW, &old) < 0)
-         perror("tcsetattr ICANON");
-      if (read(0, &buf, 1) < 0)
-         perror ("read()");
-      old.c_lflag |= ICANON;
-      old.c_lflag |= ECHO;
-      if (tcsetattr(0, TCSADRAIN, &old) < 0)
-         perror ("tcsetattr ~ICANON");
-      */
-      return (buf);
+   /*   
+   Set Vx = random byte AND kk.
+
+   The interpreter generates a random number from 0 to 255, which is then ANDed with the value kk. The results are stored in Vx. See instruction 8xy2 for more information on AND.
+   */
+   template<typename Rhs>
+   struct RandomAnd
+   {
+      static Register get(Machine& machine, Opcode opcode)
+      {
+         auto rhs = Rhs::get(machine, opcode);
+         return machine.nextRandom() & rhs;
+      }
+   };
+
+   template<typename Rhs>
+   RandomAnd<Rhs> randomAnd(Rhs)
+   {
+      return RandomAnd<Rhs>();
    }
+   
+   constexpr Nnn nnn{};
+   constexpr Kk kk{};
+   constexpr N n{};
+   constexpr X x{};
+   constexpr Y y{};
+   constexpr FromV<X> Vx{};
+   constexpr FromV<Y> Vy{};
+   constexpr FromFixedV<0> V0{};
+   constexpr From<Counter, &Machine::I> I{};
+   constexpr From<Timer, &Machine::delayTimer> delayTimer{};
+   constexpr From<Timer, &Machine::soundTimer> soundTimer{};
+
+   // Where the state the recompiled code works on is, relative to the
+   // object the code is called with
+   struct RecompiledLayout
+   {
+      int32_t V;
+      int32_t I;
+      int32_t delayTimer;
+      int32_t soundTimer;
+   };
+
+   // V registers live in these while a recompiled block runs, RAX and RCX
+   // are scratch, RDI has the object the layout is relative to and RDX the
+   // budget. The ones to be saved go last so small blocks don't need to.
+   const std::array<X86Emitter::Reg, 11> VHostRegisters
+   {{
+      X86Emitter::RSI, X86Emitter::R8,  X86Emitter::R9,
+      X86Emitter::R10, X86Emitter::R11,
+      X86Emitter::RBX, X86Emitter::RBP,
+      X86Emitter::R12, X86Emitter::R13, X86Emitter::R14, X86Emitter::R15,
+   }};
+   const size_t CallerSavedHostRegisters = 5;
+
+   // Emits a block as a native function, it returns the program counter it
+   // left the block at in the high half and the opcodes it ran in the low
+   // one.
+   //
+   // It is called with the most opcodes it may run, so a frame can end in
+   // the middle of the block.
+   class BlockRecompiler
+   {
+   public:
+      using Reg = X86Emitter::Reg;
+      using Condition = X86Emitter::Condition;
+
+      BlockRecompiler(X86Emitter& x86, const RecompiledLayout& layout)
+      :x86(x86)
+      ,layout(layout)
+      ,allocated(0)
+      ,address(0)
+      ,count(0)
+      {
+         hosts.fill(X86Emitter::RAX);
+      }
+
+      // False when there are no host registers left for it
+      bool allocate(size_t index)
+      {
+         if (hosts[index] != X86Emitter::RAX)
+         {
+            return true;
+         }
+         if (allocated == VHostRegisters.size())
+         {
+            return false;
+         }
+         hosts[index] = VHostRegisters[allocated++];
+         return true;
+      }
+
+      Reg v(size_t index) const
+      {
+         return hosts[index];
+      }
+
+      void prologue()
+      {
+         // The budget comes in RSI, which is the first V register
+         x86.mov32(X86Emitter::RDX, X86Emitter::RSI);
+         for (auto i = CallerSavedHostRegisters; i < allocated; ++i)
+         {
+            x86.push(VHostRegisters[i]);
+         }
+         for (size_t i = 0; i < hosts.size(); ++i)
+         {
+            if (hosts[i] != X86Emitter::RAX)
+            {
+               x86.load8(hosts[i], X86Emitter::RDI, layout.V + i);
+            }
+         }
+      }
+
+      // Every opcode starts with it, the block is left before it once the
+      // budget is spent
+      void opcode(Address at)
+      {
+         address = at;
+         if (count > 0)
+         {
+            x86.cmpImm32(X86Emitter::RDX, count);
+            exits.push_back(Exit{x86.jump(X86Emitter::Equal), address, count});
+         }
+         ++count;
+      }
+
+      // The opcode skips the next one, which is not the one recompiled
+      void leaveIf(Condition condition)
+      {
+         exits.push_back(Exit{x86.jump(condition), static_cast<Address>(address + 4), count});
+      }
+
+      void epilogue(Address next)
+      {
+         leave(next, count);
+         for (const auto& exit : exits)
+         {
+            x86.bind(exit.label);
+            leave(exit.pc, exit.count);
+         }
+      }
+
+      int32_t I() const
+      {
+         return layout.I;
+      }
+
+      int32_t delayTimer() const
+      {
+         return layout.delayTimer;
+      }
+
+      int32_t soundTimer() const
+      {
+         return layout.soundTimer;
+      }
+
+      X86Emitter& x86;
+
+   private:
+      struct Exit
+      {
+         X86Emitter::Label label;
+         Address pc;
+         uint32_t count;
+      };
+
+      const RecompiledLayout layout;
+      // RAX means it is not allocated
+      std::array<Reg, 16> hosts;
+      size_t allocated;
+      Address address;
+      uint32_t count;
+      std::vector<Exit> exits;
+
+      void leave(Address pc, uint32_t count)
+      {
+         for (size_t i = 0; i < hosts.size(); ++i)
+         {
+            if (hosts[i] != X86Emitter::RAX)
+            {
+               x86.store8(X86Emitter::RDI, layout.V + i, hosts[i]);
+            }
+         }
+         x86.movImm64(X86Emitter::RAX, static_cast<uint64_t>(pc) << 32 | count);
+         for (auto i = allocated; i > CallerSavedHostRegisters; --i)
+         {
+            x86.pop(VHostRegisters[i - 1]);
+         }
+         x86.ret();
+      }
+   };
 
 }
 class Chip8::Pimpl
 {
+   // Runners are plain functions, the dispatch table has one per opcode
+   using OpcodeRunner = OpcodeRunnerResult (*)(Pimpl&, Opcode);
+
+   struct Runner
+   {
+      Runner(Flow flow, OpcodeRunner run)
+      :flow(flow)
+      ,run(run)
+      {}
+
+      Flow flow;
+      OpcodeRunner run;
+   };
+
+   struct Decoded
+   {
+      Runner runner;
+      const char* name;
+   };
+
+   // Node of the decoding tree, it is only walked when the dispatch table
+   // is built so the opcodes can be declared as readable as we want.
+   class Decoder
+   {
+   public:
+      Decoder()
+      {}
+
+      Decoder(Runner runner, const char* name = "")
+      :decode([=](Opcode) { return Decoded{runner, name}; })
+      {}
+
+      Decoder(std::function<Decoded(Opcode)> decode)
+      :decode(decode)
+      {}
+
+      Decoded operator()(Opcode opcode) const
+      {
+         if (not decode)
+         {
+            return Decoded{unknownOpcode(), "unknownOpcode"};
+         }
+         return decode(opcode);
+      }
+
+   private:
+      std::function<Decoded(Opcode)> decode;
+   };
+
+   template<size_t S>
+   using Opcodes = std::array<Decoder, S>;
+   using Mapping = std::unordered_map<Register, Decoder>;
+
+   struct DecodedOpcode
+   {
+      OpcodeRunner runner;
+      Opcode opcode;
+      // Where the next decoded opcode is
+      Address next;
+   };
+
+   // Opcodes decoded from the address it starts at following the static
+   // jumps and calls, it stops at the ones with an unknown destination.
+   // It is replayed while the program counter follows it.
+   struct Block
+   {
+      // Where its opcodes start in the decoded opcodes pool
+      uint32_t first;
+      // No opcodes means it has to be decoded
+      uint16_t size;
+      // Times it has been run, only counted for the recompiler
+      uint16_t hits;
+      // It starts with an idle loop, see idleLoopAt
+      bool idle;
+   };
+
+   static const size_t MaxBlockSize = 32;
+   // Opcodes of an idle loop
+   static const size_t IdleLoopSize = 3;
+   // Blocks are decoded again after self-modifying writes, the pool is
+   // started over when it gets this big.
+   static const size_t MaxDecodedOpcodes = 0x10000;
+
+   // A save state is this header and then the bytes of the Machine, which is
+   // trivially copyable. They are in the host byte order, the version has to
+   // change with the Machine layout.
+   struct SaveStateHeader
+   {
+      uint32_t magic;
+      uint32_t version;
+      uint32_t size;
+   };
+   static const uint32_t SaveStateMagic = 0x53384843; // "CH8S"
+   static const uint32_t SaveStateVersion = 2;
+   static_assert(std::is_trivially_copyable<Machine>::value, "Save states copy the Machine bytes");
+   static_assert(sizeof(Machine) == sizeof(Graphics) + sizeof(uint64_t) + sizeof(Stack) + sizeof(Keypad) +
+                 sizeof(Registers) + sizeof(Memory) + 3 * sizeof(Counter) + 2 * sizeof(Timer),
+                 "The Machine has padding, equal machines would give different save states");
+
+   // Recompiled blocks are called with the Pimpl and the most opcodes they
+   // may run, see BlockRecompiler
+   using NativeBlock = uint64_t (*)(Pimpl*, uint32_t);
+
+   // The opcodes with a native version, the ones not here end the
+   // recompiled block and are left to the interpreter: drawing, the
+   // keypad, memory accesses, calls, returns and indirect jumps.
+   using Recompile = void (*)(BlockRecompiler&, Machine&, Opcode);
+
+   enum Uses : uint8_t { UsesVx = 1, UsesVy = 2, UsesVF = 4 };
+
+   struct Recompiler
+   {
+      // V registers it needs in host registers
+      uint8_t uses;
+      Recompile recompile;
+   };
+
+   using Recompilers = std::unordered_map<OpcodeRunner, Recompiler>;
+
+   // A block is recompiled once it has been run this many times
+   static const uint16_t HotBlock = 16;
+   // Calling into less opcodes than these is slower than interpreting
+   // them, unless they are the whole block.
+   static const size_t MinRecompiledSize = 4;
+   // The recompiled code is started over when it gets this big
+   static const size_t RecompiledCodeSize = 1 << 20;
+
+   struct DispatchTable
+   {
+      std::array<OpcodeRunner, 0x10000> runners;
+      std::array<Flow, 0x10000> flows;
+#ifdef DEBUG
+      std::array<const char*, 0x10000> names;
+#endif
+#ifdef CHIP8_STATS
+      // Opcodes of the same runner are of the same kind
+      std::array<uint8_t, 0x10000> kinds;
+      std::vector<std::string> kindNames;
+#endif
+   };
 
 public:
    Pimpl()
    :machine() // I know it's not needed but is good to be consistent
-   ,Vx(FromV(&x)) // alias
-   ,Vy(FromV(&y)) // alias
-   ,V0(FromV(0))  // alias
    ,drawFlag(false)
-   ,beepFlag(false)
-   ,cpuRate(0)
-   ,runner(withMask(0xF000, 12, Opcodes<26>
-   {{
-     withMask(0x00FF, 
-         Mapping{
-            {0x00E0, D(clearDisplay())}, 
-            {0x00EE, D(returnFromSubroutine())}
-         }
-      ), 
-      // 0x01
-      D(jumpTo(nnn)), 
-      D(callTo(nnn)),
-      D(skipIfEquals(Vx, kk)),
-      D(skipIfNotEquals(Vx, kk)),
-      // 0x05
-      D(skipIfEquals(Vx, Vy)),
-      D(setToV(x, kk)),
-      D(addToV(x, kk)),
-      withMask(0x000F, 
-         Opcodes<9>{{
-            D(setToV(x, Vy)),
-            D(orToV(x, Vy)), 
-            D(andToV(x, Vy)),
-            D(xorToV(x, Vy)),  
-            D(addToV(x, Vy)),
-            D(subtractToV(x, Vy)), 
-            D(shiftRightToVx()), 
-            D(subtractNumericToVxVy()), 
-            D(shiftLeftToVx()),
-      }}),
-      D(skipIfNotEquals(Vx, Vy)),
-      // 0x0A
-      D(setTo(&Machine::I, nnn)),
-      D(jumpTo(V0, nnn)),
-      D(setToV(x, randomAnd(kk))),
-      D(display(Vx, Vy, n)),
-      withMask(0x0FF, 
-         Mapping{
-            {0x009E, D(skipIfPressedVx())},
-            {0x00A1, D(skipIfNotPressedVx())}
-         }), 
-      withMask(0x0FF, 
-         Mapping{
-            {0x0007, D(setToV(x, From(&Machine::delayTimer)))},
-            {0x000A, D(setToV(x, keyPressed))},
-            {0x0015, D(setTo(&Machine::delayTimer, Vx))},
-            {0x0018, D(setTo(&Machine::soundTimer, Vx))},
-            {0x001E, D(addTo(&Machine::I, Vx))},
-            {0x0029, D(setToF(Vx))},
-            {0x0033, D(setToB(Vx))},
-            {0x0055, D(storeToMemoryFromV(x))},
-            {0x0065, D(readFromMemoryToV(x))},
-         }),
-   }}))
-   {} 
+   ,parked(false)
+   ,cyclesPerFrame(DefaultCpuRate / FrameRate)
+   ,dispatchTable(getDispatchTable())
+   ,blocks(std::tuple_size<Memory>::value, Block{0, 0, 0, false})
+   ,cachedCodeBegin(std::tuple_size<Memory>::value)
+   ,cachedCodeEnd(0)
+   ,blocksGeneration(0)
+   ,frame(0)
+   {
+      resetStats();
+   } 
    
-   void loadGame(const std::string& name)
+   void loadGame(const Rom& rom)
    {
-      std::ifstream file(name, std::ios::binary);
-      if (file.is_open())
-      {
-         auto begin = std::istreambuf_iterator<char>(file);
-         auto end = std::istreambuf_iterator<char>();
-         
-         // The game has to be loaded after the the poss 0x200
-         std::copy(begin, end, &machine.getMemory()[0x200]);
+      // The Rom is never bigger than the program area
+      auto program = machine.getMemory() + ProgramStart;
+      std::memcpy(program, rom.data(), rom.size());
+      std::memset(program + rom.size(), 0, MaxRomSize - rom.size());
+      clearBlocks();
+      resetStats();
+   }
 
-         file.close();
-      }
-      else
+   void setCpuRate(uint32_t rate)
+   {
+      if (rate < FrameRate)
       {
-         throw std::invalid_argument(std::string("Cannot open game ") + name);
+         throw std::invalid_argument("The cpu rate has to be at least one opcode per frame");
       }
+      cyclesPerFrame = rate / FrameRate;
    }
 
-   void loadGame(std::function<void(Register*)> gameLoader)
+   uint32_t getCyclesPerFrame() const
    {
-         // The game has to be loaded after the the poss 0x200
-         gameLoader(&machine.getMemory()[0x200]);
+      return cyclesPerFrame;
    }
 
-   void setCpuRate(uint32_t rate)
+   void setSeed(uint64_t seed)
    {
-      cpuRate = rate;
+      machine.setSeed(seed);
+   }
+
+   void setEngine(Engine engine)
+   {
+      if (engine == Engine::Interpreter)
+      {
+         emitter.reset();
+         recompiled.clear();
+         return;
+      }
+      if (not X86Emitter::supported())
+      {
+         throw std::invalid_argument("The recompiler needs an x86-64 host");
+      }
+      if (not emitter)
+      {
+         emitter.reset(new X86Emitter(RecompiledCodeSize));
+         clearRecompiled();
+      }
    }
   
    void emulateTimers()
    {
       if (machine.delayTimer > 0)
       {
+         STATS(++stats.delayTicks);
          --machine.delayTimer;
       }
 
       if(machine.soundTimer > 0)
       {
-         if(machine.soundTimer == 1)
-         {
-            beepFlag = true;
-         }
+         STATS(++stats.soundTicks);
          --machine.soundTimer;
       }  
    }
@@ -342,7 +683,7 @@ public:
    void resetFlags()
    {
       drawFlag = false;
-      beepFlag = false;
+      parked = false;
    }
 
    void emulateCycle()
@@ -355,501 +696,1262 @@ public:
 
       resetFlags();
       
-      emulateCpuRate();
-      
-      emulateTimers();
-      
 #ifdef DEBUG
 
       std::cout << "Fetching opcode" << std::endl;
 #endif       
       Opcode opcode = machine.fetchOpcode();
+      auto pc = machine.getProgramCounter();
+      STATS(countOpcode(pc, opcode));
 
 
 #ifdef DEBUG
 
       std::cout << "opcode: " << std::hex << opcode << " ->";
+      std::cout << dispatchTable.names[opcode] << std::endl;
+
+#endif
+
+      auto runner = dispatchTable.runners[opcode];
+      auto result = traceRing ? runTraced(runner, pc, opcode) : runner(*this, opcode);
+      if (result == OpcodeRunnerResult::SkippNeeded)
+      {
+         machine.skip();
+      }
+   }
+
+   // One 60 Hz frame: the cpu rate worth of opcodes and then the timers
+   // tick once, the flags are the ones of the whole frame.
+   void emulateFrame()
+   {
+      emulateCycles(cyclesPerFrame);
+      emulateTimers();
+      ++frame;
+   }
+
+   // Same as emulateCycle in a loop, but replaying the predecoded blocks,
+   // the flags are the ones of the whole batch of cycles.
+   void emulateCycles(uint64_t cycles)
+   {
+      resetFlags();
+      if (traceRing)
+      {
+         runCycles<true>(cycles);
+      }
+      else
+      {
+         runCycles<false>(cycles);
+      }
+   }
+
+   // Tracing is a parameter so the loop without it has no trace of it
+   template<bool Traced>
+   void runCycles(uint64_t cycles)
+   {
+      while (cycles > 0)
+      {
+         auto pc = machine.getProgramCounter();
+         if (not Traced and emitter and pc < recompiled.size() and recompiled[pc])
+         {
+            auto budget = static_cast<uint32_t>(cycles < MaxBlockSize ? cycles : MaxBlockSize);
+            auto exit = recompiled[pc](this, budget);
+            machine.setProgramCounter(exit >> 32);
+            cycles -= exit & 0xFFFFFFFF;
+            STATS(countRecompiled(pc, exit));
+            continue;
+         }
+
+         auto& block = blockAt(pc);
+         if (not Traced and block.idle)
+         {
+            cycles -= skipIdleLoop(pc, cycles);
+         }
+         else if (not Traced and emitter and block.hits < HotBlock and ++block.hits == HotBlock)
+         {
+            recompileBlock(pc);
+         }
+
+         auto generation = blocksGeneration;
+         auto begin = &decodedOpcodes[block.first];
+         auto decoded = begin;
+         auto end = begin + std::min<uint64_t>(cycles, block.size);
+         while (decoded != end)
+         {
+#ifdef DEBUG
+
+            std::cout << "emulateCycle: " << std::endl;
+
+#endif
+
+#ifdef DEBUG
+
+            std::cout << "opcode: " << std::hex << decoded->opcode << " ->";
+            std::cout << dispatchTable.names[decoded->opcode] << std::endl;
+
+#endif
+
+            // Read before running it, the opcode may clear the blocks
+            auto next = decoded->next;
+            auto opcode = decoded->opcode;
+            STATS(countOpcode(machine.getProgramCounter(), opcode));
+            if (Traced)
+            {
+               pc = machine.getProgramCounter();
+            }
+            auto result = Traced ? runTraced(decoded->runner, pc, opcode) : decoded->runner(*this, opcode);
+            ++decoded;
+            if (result == OpcodeRunnerResult::SkippNeeded)
+            {
+               machine.skip();
+            }
+
+            // The rest of the block is only valid if it has not been
+            // overwritten and the program counter went where expected
+            if (generation != blocksGeneration or 
+                machine.getProgramCounter() != next)
+            {
+               break;
+            }
+         }
+         cycles -= decoded - begin;
+         // Fx0A would only run again until a key is pressed
+         if (parked)
+         {
+            break;
+         }
+      }
+   }
+   
+   // A machine waiting at Fx0A gets the key and goes on
+   void pressKey(Key key)
+   {
+      machine.keypad[static_cast<size_t>(key)] = KeyState::Pressed;
+      if (atKeyWait())
+      {
+         machine.V[X::get(machine, machine.fetchOpcode())] = static_cast<Register>(key);
+         machine.skip();
+      }
+   }
+
+ 
+   void releaseKey(Key key)
+   {
+      machine.keypad[static_cast<size_t>(key)] = KeyState::Released;
+   }
+
+    
+   bool soundOn() const
+   {
+      return machine.soundTimer > 0;
+   }
+
+   bool drawNeeded()
+   {
+      return drawFlag;
+   }
+
+   // Once the timers have run out nothing changes until a key is pressed
+   bool waitingForKey() const
+   {
+      return atKeyWait() and machine.delayTimer == 0 and machine.soundTimer == 0;
+   }
+
+   bool atKeyWait() const
+   {
+      auto pc = machine.getProgramCounter();
+      return pc + 1u < blocks.size() and
+             dispatchTable.runners[machine.fetchOpcode(pc)] == dispatchTable.runners[0xF00A];
+   }
+
+   SaveState saveState() const
+   {
+      SaveStateHeader header{SaveStateMagic, SaveStateVersion, sizeof(Machine)};
+      SaveState state(sizeof(header) + sizeof(Machine));
+      std::memcpy(state.data(), &header, sizeof(header));
+      std::memcpy(state.data() + sizeof(header), &machine, sizeof(Machine));
+      return state;
+   }
+
+   void loadState(const SaveState& state)
+   {
+      SaveStateHeader header;
+      if (state.size() != sizeof(header) + sizeof(Machine))
+      {
+         throw std::invalid_argument("Invalid save state size");
+      }
+      std::memcpy(&header, state.data(), sizeof(header));
+      if (header.magic != SaveStateMagic or header.version != SaveStateVersion or
+          header.size != sizeof(Machine))
+      {
+         throw std::invalid_argument("Invalid save state header");
+      }
 
+      Machine restored;
+      std::memcpy(&restored, state.data() + sizeof(header), sizeof(Machine));
+      // The runners index the stack with sp and fetch at pc unchecked, I
+      // may be anything as they wrap the addresses from it
+      if (restored.sp > restored.stack.size() or
+          restored.getProgramCounter() + 1u >= restored.getMemorySize())
+      {
+         throw std::invalid_argument("Invalid save state registers");
+      }
+      // The cached blocks are still good as long as the memory is the same
+      auto memoryChanged = std::memcmp(restored.getMemory(), machine.getMemory(), machine.getMemorySize()) != 0;
+      machine = restored;
+      if (memoryChanged)
+      {
+         clearBlocks();
+      }
+   }
+
+   const Graphics& getGraphics() const
+   {
+      return machine.graphics;
+   }
+
+   Stats getStats() const
+   {
+#ifdef CHIP8_STATS
+      return stats;
+#else
+      return Stats();
 #endif
+   }
+
+   void predecode(const std::vector<Address>& starts)
+   {
+      for (auto pc : starts)
+      {
+         if (pc + 1u < blocks.size())
+         {
+            blockAt(pc);
+         }
+      }
+   }
+
+   static Flow opcodeFlow(Opcode opcode)
+   {
+      return getDispatchTable().flows[opcode];
+   }
+
+   static bool sameInstruction(Opcode lhs, Opcode rhs)
+   {
+      const auto& runners = getDispatchTable().runners;
+      return runners[lhs] == runners[rhs];
+   }
+
+   void setTrace(size_t entries)
+   {
+      traceRing.reset(entries > 0 ? new TraceRing(entries) : nullptr);
+   }
+
+   Trace getTrace() const
+   {
+      return traceRing ? traceRing->snapshot() : Trace();
+   }
+
+   void resetStats()
+   {
+#ifdef CHIP8_STATS
+      stats = Stats();
+      for (const auto& name : dispatchTable.kindNames)
+      {
+         stats.opcodes.emplace_back(name, 0);
+      }
+#endif
+   }
+
+private:
+
+   Machine machine;
+   bool drawFlag;
+   // Fx0A ran since the flags were reset
+   bool parked;
+   uint32_t cyclesPerFrame;
+
+   const DispatchTable& dispatchTable;
+   std::vector<Block> blocks;
+   std::vector<DecodedOpcode> decodedOpcodes;
+   std::bitset<std::tuple_size<Memory>::value> cachedCode;
+   // Range of cachedCode with any bit set, most writes are outside it
+   size_t cachedCodeBegin;
+   size_t cachedCodeEnd;
+   uint32_t blocksGeneration;
+
+   // Only there when the recompiler is the engine
+   std::unique_ptr<X86Emitter> emitter;
+   std::vector<NativeBlock> recompiled;
+
+   // Only there while tracing
+   std::unique_ptr<TraceRing> traceRing;
+   uint32_t frame;
+
+   // The opcode that failed is the last one in the trace
+   OpcodeRunnerResult runTraced(OpcodeRunner runner, Counter pc, Opcode opcode)
+   {
+      try
+      {
+         auto result = runner(*this, opcode);
+         traceOpcode(pc, opcode);
+         return result;
+      }
+      catch (...)
+      {
+         traceOpcode(pc, opcode);
+         throw;
+      }
+   }
+
+   void traceOpcode(Counter pc, Opcode opcode)
+   {
+      traceRing->push(TraceEntry
+      {
+         frame, pc, opcode, machine.I,
+         machine.V[X::get(machine, opcode)], machine.V[Y::get(machine, opcode)], machine.V[0xF],
+         machine.delayTimer,
+      });
+   }
+
+#ifdef CHIP8_STATS
+   Stats stats;
+
+   void countOpcode(Counter pc, Opcode opcode)
+   {
+      ++stats.opcodes[dispatchTable.kinds[opcode]].second;
+      ++stats.pcs[pc];
+   }
+
+   // The skipped iterations count as run, none of their skips skipped
+   void countIdleLoop(Counter pc, uint64_t iterations)
+   {
+      for (size_t i = 0; i < IdleLoopSize; ++i, pc += 2)
+      {
+         stats.opcodes[dispatchTable.kinds[machine.fetchOpcode(pc)]].second += iterations;
+         stats.pcs[pc] += iterations;
+      }
+   }
+
+   // A recompiled block runs the first opcodes of the decoded block at pc,
+   // it was left by a skip if it did not leave where the last one goes.
+   void countRecompiled(Counter pc, uint64_t exit)
+   {
+      auto count = exit & 0xFFFFFFFF;
+      auto decoded = &decodedOpcodes[blocks[pc].first];
+      for (uint64_t i = 0; i < count; ++i)
+      {
+         countOpcode(pc, decoded[i].opcode);
+         pc = decoded[i].next;
+      }
+      if (count > 0 and (exit >> 32) != pc)
+      {
+         ++stats.skips;
+      }
+   }
+#endif
+
+   Block& blockAt(Counter pc)
+   {
+      if (pc + 1u >= blocks.size())
+      {
+         programCounterOutOfMemory(pc);
+      }
+      if (blocks[pc].size == 0)
+      {
+         decodeBlock(pc);
+      }
+      return blocks[pc];
+   }
+
+   void programCounterOutOfMemory(Counter pc)
+   {
+      std::ostringstream message;
+      message << "Program counter out of memory " << std::hex << pc;
+      throw std::out_of_range(message.str());
+   }
+
+   void decodeBlock(Counter pc)
+   {
+      if (decodedOpcodes.size() + MaxBlockSize > MaxDecodedOpcodes)
+      {
+         clearBlocks();
+      }
 
-      auto result = runner(opcode);
-      if (result == OpcodeRunnerResult::SkippNeeded)
+      auto& block = blocks[pc];
+      block.first = decodedOpcodes.size();
+      block.idle = idleLoopAt(pc);
+      size_t address = pc;
+      while (address + 1 < blocks.size() and block.size < MaxBlockSize)
       {
-         machine.skip();
+         // Idle loops start blocks of their own, so they are not unrolled
+         // and are found when the program counter gets to them
+         if (block.size > 0 and idleLoopAt(address))
+         {
+            break;
+         }
+         auto opcode = machine.fetchOpcode(address);
+         auto flow = dispatchTable.flows[opcode];
+         size_t next = address + 2;
+         if (flow == Flow::Jump or flow == Flow::Call)
+         {
+            next = Nnn::get(machine, opcode);
+         }
+         decodedOpcodes.push_back(DecodedOpcode{dispatchTable.runners[opcode], opcode, static_cast<Address>(next)});
+         ++block.size;
+         cachedCode.set(address);
+         cachedCode.set(address + 1);
+         cachedCodeBegin = std::min(cachedCodeBegin, address);
+         cachedCodeEnd = std::max(cachedCodeEnd, address + 2);
+
+         if (flow != Flow::Next and flow != Flow::Skip and 
+             flow != Flow::Jump and flow != Flow::Call)
+         {
+            break;
+         }
+         address = next;
       }
    }
-   
-   void pressKey(Key key)
+
+   // LD Vx, DT; SE Vx, kk (or SNE); JP back to the LD: a wait for the delay
+   // timer, which only ticks between frames, so until the frame ends every
+   // iteration does the same. The opcodes are recognised by their runner, as
+   // the recompilers are.
+   bool idleLoopAt(size_t address)
    {
-      machine.keypad[static_cast<size_t>(key)] = KeyState::Pressed;
+      if (address + 2 * IdleLoopSize > blocks.size())
+      {
+         return false;
+      }
+      const auto& runners = dispatchTable.runners;
+      auto load = machine.fetchOpcode(address);
+      auto test = machine.fetchOpcode(address + 2);
+      auto jump = machine.fetchOpcode(address + 4);
+      return runners[load] == runners[0xF007] and
+             (runners[test] == runners[0x3000] or runners[test] == runners[0x4000]) and
+             X::get(machine, load) == X::get(machine, test) and
+             runners[jump] == runners[0x1000] and Nnn::get(machine, jump) == address;
    }
 
- 
-   void releaseKey(Key key)
+   // Runs at once the iterations of the idle loop at pc that fit in the
+   // cycles, the machine is left as running them would, and returns the
+   // cycles they took. None if the loop is about to end.
+   uint64_t skipIdleLoop(Counter pc, uint64_t cycles)
    {
-      machine.keypad[static_cast<size_t>(key)] = KeyState::Released;
+      auto test = machine.fetchOpcode(pc + 2);
+      auto skipsIfEqual = dispatchTable.runners[test] == dispatchTable.runners[0x3000];
+      auto iterations = cycles / IdleLoopSize;
+      if ((machine.delayTimer == Kk::get(machine, test)) == skipsIfEqual or iterations == 0)
+      {
+         return 0;
+      }
+      machine.V[X::get(machine, test)] = machine.delayTimer;
+      STATS(countIdleLoop(pc, iterations));
+      return iterations * IdleLoopSize;
    }
 
-    
-   bool beepNeeded()
+   // Self-modifying code, writing any cached opcode starts the cache
+   // over as blocks can cover any address they jumped to. The range may
+   // go past the end of memory, the writes there wrapped to the beginning.
+   void codeWritten(size_t begin, size_t end)
    {
-      return beepFlag;
+      if (end > machine.getMemorySize())
+      {
+         codeWritten(0, end - machine.getMemorySize());
+      }
+      begin = std::max(begin, cachedCodeBegin);
+      end = std::min(end, cachedCodeEnd);
+      for (auto i = begin; i < end; ++i)
+      {
+         if (cachedCode[i])
+         {
+            clearBlocks();
+            return;
+         }
+      }
    }
 
-   bool drawNeeded()
+   void clearBlocks()
    {
-      return drawFlag;
+      for (auto& block : blocks)
+      {
+         block.size = 0;
+      }
+      decodedOpcodes.clear();
+      cachedCode.reset();
+      cachedCodeBegin = blocks.size();
+      cachedCodeEnd = 0;
+      ++blocksGeneration;
+      if (emitter)
+      {
+         clearRecompiled();
+      }
    }
 
-   const Graphics& getGraphics() const
+   void clearRecompiled()
    {
-      return machine.graphics;
+      for (auto& block : blocks)
+      {
+         block.hits = 0;
+      }
+      emitter->reset();
+      recompiled.assign(blocks.size(), nullptr);
    }
 
-private:
-   
-   void emulateCpuRate()
-   {   
-      if (cpuRate > 0)
+   // Recompiles the block up to the first opcode without a native version
+   // or needing more V registers than the host has.
+   void recompileBlock(Counter pc)
+   {
+      const auto& block = blocks[pc];
+      const auto& recompilers = getRecompilers();
+      auto begin = &decodedOpcodes[block.first];
+
+      BlockRecompiler jit(*emitter, recompiledLayout());
+      std::vector<const Recompiler*> natives;
+      for (auto decoded = begin; decoded != begin + block.size; ++decoded)
       {
-         // It will sleep for the number of microseconds between cycles
-         usleep(1000000/cpuRate);
+         auto native = recompilers.find(decoded->runner);
+         if (native == recompilers.end() or
+             not allocate(jit, native->second.uses, decoded->opcode))
+         {
+            break;
+         }
+         natives.push_back(&native->second);
+      }
+      if (natives.empty() or 
+          (natives.size() < MinRecompiledSize and natives.size() < block.size))
+      {
+         return;
       }
-   }
 
-   Machine machine;
-   OpcodeExtractor Vx;
-   OpcodeExtractor Vy;
-   Extractor V0;
-   bool drawFlag;
-   bool beepFlag;
-   uint32_t cpuRate;
+      emitter->begin();
+      jit.prologue();
+      Address address = pc;
+      for (size_t i = 0; i < natives.size(); ++i)
+      {
+         jit.opcode(address);
+         natives[i]->recompile(jit, machine, begin[i].opcode);
+         address = begin[i].next;
+      }
+      jit.epilogue(address);
+      auto code = emitter->end();
 
-   OpcodeRunner runner;
-   
+      if (emitter->overflow())
+      {
+         // Starting over, it is recompiled again once it gets hot
+         clearRecompiled();
+         return;
+      }
+      recompiled[pc] = reinterpret_cast<NativeBlock>(code);
+   }
 
-   OpcodeExtractor FromV(OpcodeExtractor extractor)
+   bool allocate(BlockRecompiler& jit, uint8_t uses, Opcode opcode)
    {
-      return [extractor, this](Opcode opcode)
-      {
-         return machine.V[extractor(opcode)];
-      };
+      return (not (uses & UsesVx) or jit.allocate(X::get(machine, opcode))) and
+             (not (uses & UsesVy) or jit.allocate(Y::get(machine, opcode))) and
+             (not (uses & UsesVF) or jit.allocate(0xF));
    }
-    
-   Extractor FromV(size_t index)
+
+   RecompiledLayout recompiledLayout()
    {
-      return [index, this]()
+      auto offset = [this](const void* attribute)
       {
-         return machine.V[index];
+         return static_cast<int32_t>(static_cast<const char*>(attribute) - reinterpret_cast<const char*>(this));
+      };
+      return RecompiledLayout
+      {
+         offset(machine.V.data()),
+         offset(&machine.I),
+         offset(&machine.delayTimer),
+         offset(&machine.soundTimer),
       };
    }
-   
-   template<typename T> 
-   Extractor From(T Machine::*attribute)
+
+   static Decoder opcodes()
+   {
+      return withMask(0xF000, 12, Opcodes<16>
+      {{
+         withMask(0x00FF, 
+            Mapping{
+               {0x00E0, D(clearDisplay())}, 
+               {0x00EE, D(returnFromSubroutine())}
+            }
+         ), 
+         // 0x01
+         D(jumpTo(nnn)), 
+         D(callTo(nnn)),
+         D(skipIfEquals(Vx, kk)),
+         D(skipIfNotEquals(Vx, kk)),
+         // 0x05
+         D(skipIfEquals(Vx, Vy)),
+         D(setToV(x, kk)),
+         D(addToV(x, kk)),
+         withMask(0x000F, 
+            Opcodes<16>{{
+               D(setToV(x, Vy)),
+               D(orToV(x, Vy)), 
+               D(andToV(x, Vy)),
+               D(xorToV(x, Vy)),  
+               D(addToV(x, Vy)),
+               D(subtractToV(x, Vy)), 
+               D(shiftRightToVx()), 
+               D(subtractNumericToVxVy()), 
+               // 0x08 - 0x0D are not defined
+               {}, {}, {}, {}, {}, {},
+               D(shiftLeftToVx()),
+         }}),
+         D(skipIfNotEquals(Vx, Vy)),
+         // 0x0A
+         D(setTo(I, nnn)),
+         D(jumpTo(V0, nnn)),
+         D(setToV(x, randomAnd(kk))),
+         D(display(Vx, Vy, n)),
+         withMask(0x0FF, 
+            Mapping{
+               {0x009E, D(skipIfPressedVx())},
+               {0x00A1, D(skipIfNotPressedVx())}
+            }), 
+         withMask(0x0FF, 
+            Mapping{
+               {0x0007, D(setToV(x, delayTimer))},
+               {0x000A, D(waitKeyVx())},
+               {0x0015, D(setTo(delayTimer, Vx))},
+               {0x0018, D(setTo(soundTimer, Vx))},
+               {0x001E, D(addTo(I, Vx))},
+               {0x0029, D(setToF(Vx))},
+               {0x0033, D(setToB(Vx))},
+               {0x0055, D(storeToMemoryFromV(x))},
+               {0x0065, D(readFromMemoryToV(x))},
+            }),
+      }});
+   }
+
+   // Decoding is done once for the whole opcode space and shared by
+   // all the instances, executing is then a single indexed call.
+   static const DispatchTable& getDispatchTable()
+   {
+      static const DispatchTable table = buildDispatchTable();
+      return table;
+   }
+
+   static DispatchTable buildDispatchTable()
    {
-      return [attribute, this]()
+      DispatchTable table;
+      auto decoder = opcodes();
+#ifdef CHIP8_STATS
+      std::unordered_map<std::string, uint8_t> kinds;
+#endif
+      for (size_t opcode = 0; opcode < table.runners.size(); ++opcode)
       {
-         return machine.*attribute;
-      };
+         auto decoded = decoder(opcode);
+         table.runners[opcode] = decoded.runner.run;
+         table.flows[opcode] = decoded.runner.flow;
+#ifdef DEBUG
+         table.names[opcode] = decoded.name;
+#endif
+#ifdef CHIP8_STATS
+         auto kind = kinds.emplace(decoded.name, kinds.size()).first;
+         if (kind->second == table.kindNames.size())
+         {
+            table.kindNames.push_back(decoded.name);
+         }
+         table.kinds[opcode] = kind->second;
+#endif
+      }
+      return table;
    }
-   
-   OpcodeRunner debugRunner(OpcodeRunner runner, const std::string& message)
+
+   // Recompilers are found by the runner the dispatch table has for the
+   // opcode, so they can't disagree with the decoding.
+   static const Recompilers& getRecompilers()
+   {
+      static const Recompilers recompilers = buildRecompilers();
+      return recompilers;
+   }
+
+   static Recompilers buildRecompilers()
    {
-      return [=](Opcode opcode)
+      using Reg = X86Emitter::Reg;
+      const auto scratch = X86Emitter::RAX;
+      const auto rhs = X86Emitter::RCX;
+      const auto self = X86Emitter::RDI;
+
+      return Recompilers
       {
-         std::cout << message << std::endl;
-         return runner(opcode);
+         {jumpTo(nnn).run, {0, [](BlockRecompiler&, Machine&, Opcode)
+         {
+            // The block already follows it
+         }}},
+         {skipIfEquals(Vx, kk).run, {UsesVx, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.cmpImm8(jit.v(X::get(machine, opcode)), Kk::get(machine, opcode));
+            jit.leaveIf(X86Emitter::Equal);
+         }}},
+         {skipIfNotEquals(Vx, kk).run, {UsesVx, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.cmpImm8(jit.v(X::get(machine, opcode)), Kk::get(machine, opcode));
+            jit.leaveIf(X86Emitter::NotEqual);
+         }}},
+         {skipIfEquals(Vx, Vy).run, {UsesVx | UsesVy, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.cmp8(jit.v(X::get(machine, opcode)), jit.v(Y::get(machine, opcode)));
+            jit.leaveIf(X86Emitter::Equal);
+         }}},
+         {skipIfNotEquals(Vx, Vy).run, {UsesVx | UsesVy, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.cmp8(jit.v(X::get(machine, opcode)), jit.v(Y::get(machine, opcode)));
+            jit.leaveIf(X86Emitter::NotEqual);
+         }}},
+         {setToV(x, kk).run, {UsesVx, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.movImm8(jit.v(X::get(machine, opcode)), Kk::get(machine, opcode));
+         }}},
+         {addToV(x, kk).run, {UsesVx, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.addImm8(jit.v(X::get(machine, opcode)), Kk::get(machine, opcode));
+         }}},
+         {setToV(x, Vy).run, {UsesVx | UsesVy, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.mov8(jit.v(X::get(machine, opcode)), jit.v(Y::get(machine, opcode)));
+         }}},
+         {orToV(x, Vy).run, {UsesVx | UsesVy, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.or8(jit.v(X::get(machine, opcode)), jit.v(Y::get(machine, opcode)));
+         }}},
+         {andToV(x, Vy).run, {UsesVx | UsesVy, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.and8(jit.v(X::get(machine, opcode)), jit.v(Y::get(machine, opcode)));
+         }}},
+         {xorToV(x, Vy).run, {UsesVx | UsesVy, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.xor8(jit.v(X::get(machine, opcode)), jit.v(Y::get(machine, opcode)));
+         }}},
+         {addToV(x, Vy).run, {UsesVx | UsesVy, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.add8(jit.v(X::get(machine, opcode)), jit.v(Y::get(machine, opcode)));
+         }}},
+         // The flag is written before Vx is, which may be VF itself
+         {subtractToV(x, Vy).run, {UsesVx | UsesVy | UsesVF, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            Reg Vx = jit.v(X::get(machine, opcode));
+            jit.x86.mov8(scratch, Vx);
+            jit.x86.mov8(rhs, jit.v(Y::get(machine, opcode)));
+            jit.x86.cmp8(scratch, rhs);
+            jit.x86.set8(X86Emitter::Above, scratch);
+            jit.x86.mov8(jit.v(0xF), scratch);
+            jit.x86.sub8(Vx, rhs);
+         }}},
+         {shiftRightToVx().run, {UsesVx | UsesVF, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            Reg Vx = jit.v(X::get(machine, opcode));
+            jit.x86.mov8(scratch, Vx);
+            jit.x86.andImm8(scratch, 1);
+            jit.x86.mov8(jit.v(0xF), scratch);
+            jit.x86.shr8(Vx, 1);
+         }}},
+         {subtractNumericToVxVy().run, {UsesVx | UsesVy | UsesVF, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            Reg Vx = jit.v(X::get(machine, opcode));
+            jit.x86.mov8(scratch, Vx);
+            jit.x86.mov8(rhs, jit.v(Y::get(machine, opcode)));
+            jit.x86.cmp8(rhs, scratch);
+            jit.x86.set8(X86Emitter::Above, scratch);
+            jit.x86.mov8(jit.v(0xF), scratch);
+            jit.x86.sub8(Vx, rhs);
+         }}},
+         {shiftLeftToVx().run, {UsesVx | UsesVF, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            Reg Vx = jit.v(X::get(machine, opcode));
+            jit.x86.mov8(scratch, Vx);
+            jit.x86.shr8(scratch, 7);
+            jit.x86.mov8(jit.v(0xF), scratch);
+            jit.x86.add8(Vx, Vx);
+         }}},
+         {setTo(I, nnn).run, {0, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.storeImm16(self, jit.I(), Nnn::get(machine, opcode));
+         }}},
+         {addTo(I, Vx).run, {UsesVx, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.movZeroExtend8(scratch, jit.v(X::get(machine, opcode)));
+            jit.x86.add16(self, jit.I(), scratch);
+         }}},
+         {setToF(Vx).run, {UsesVx, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.movZeroExtend8(scratch, jit.v(X::get(machine, opcode)));
+            jit.x86.times5(scratch, scratch);
+            jit.x86.store16(self, jit.I(), scratch);
+         }}},
+         {setToV(x, delayTimer).run, {UsesVx, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.load8(jit.v(X::get(machine, opcode)), self, jit.delayTimer());
+         }}},
+         {setTo(delayTimer, Vx).run, {UsesVx, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.store8(self, jit.delayTimer(), jit.v(X::get(machine, opcode)));
+         }}},
+         {setTo(soundTimer, Vx).run, {UsesVx, [](BlockRecompiler& jit, Machine& machine, Opcode opcode)
+         {
+            jit.x86.store8(self, jit.soundTimer(), jit.v(X::get(machine, opcode)));
+         }}},
       };
    }
 
    template<size_t S>
-   OpcodeRunner withMask(Opcode mask, Opcodes<S> runners)
+   static Decoder withMask(Opcode mask, Opcodes<S> runners)
    {
       return withMask(mask, 0 /*no shift*/, runners);
    }
    
    template<size_t S>
-   OpcodeRunner withMask(Opcode mask, size_t shift, Opcodes<S> runners)
+   static Decoder withMask(Opcode mask, size_t shift, Opcodes<S> runners)
    {
-      return [=](Opcode opcode)
+      return Decoder([=](Opcode opcode)
       {
          auto instruction = (opcode & mask) >> shift;
-         auto& runner = runners.at(instruction);
-         return runner(opcode);
-      };
+         return runners.at(instruction)(opcode);
+      });
    }
 
-   OpcodeRunner withMask(Opcode mask, Mapping runners)
+   static Decoder withMask(Opcode mask, Mapping runners)
    {
-      return [=](Opcode opcode)
+      return Decoder([=](Opcode opcode)
       {
          auto instruction = opcode & mask;
-         auto& runner = runners.at(instruction);
-         return runner(opcode);
-      };
+         auto runner = runners.find(instruction);
+         if (runner == runners.end())
+         {
+            return Decoder()(opcode);
+         }
+         return runner->second(opcode);
+      });
+   }
+
+   static Runner unknownOpcode()
+   {
+      return Runner(Flow::Unknown, [](Pimpl&, Opcode opcode) -> OpcodeRunnerResult
+      {
+         std::ostringstream message;
+         message << "Unknown opcode " << std::hex << opcode;
+         throw std::invalid_argument(message.str());
+      });
    }
  
-   OpcodeRunner clearDisplay()
+   static Runner clearDisplay()
    {
-      return [this](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode)
       {
-         std::cout << "TODO: " << std::hex << opcode << " clearDisplay" << std::endl;   
-         drawFlag = true;
+         self.machine.graphics.fill(0);
+         self.drawFlag = true;
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
  
-   OpcodeRunner returnFromSubroutine()
+   static Runner returnFromSubroutine()
    {
-      return [this](Opcode opcode)
+      return Runner(Flow::Return, [](Pimpl& self, Opcode)
       {
+         auto& machine = self.machine;
+         if (machine.sp == 0)
+         {
+            throw std::out_of_range("Stack underflow");
+         }
          --machine.sp;
          machine.setProgramCounter(machine.stack[machine.sp]);
          return OpcodeRunnerResult::SkippNotNeeded;
-      };
+      });
    }
 
-   OpcodeRunner setToF(OpcodeExtractor valueExtractor)
+   template<typename Value>
+   static Runner setToF(Value)
    {
-      return [this, valueExtractor](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         auto value = valueExtractor(opcode);
+         auto& machine = self.machine;
+         auto value = Value::get(machine, opcode);
          // Each font pixel has a size of 5
          machine.I = value * 5;
 #ifdef DEBUG
          machine.printI(std::cout);
 #endif // DEBUG
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
-   OpcodeRunner setToB(OpcodeExtractor valueExtractor)
+   template<typename Value>
+   static Runner setToB(Value)
    {
-      return [this, valueExtractor](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
+         auto& machine = self.machine;
          auto memory = machine.getMemory();
-         auto I      = machine.I;
-         auto value  = valueExtractor(opcode);
-         memory[I]     = value / 100;
-         memory[I + 1] = (value / 10) % 10;
-         memory[I + 2] = (value % 100) % 10;
+         auto size   = machine.getMemorySize();
+         auto I      = machine.I % size;
+         auto value  = Value::get(machine, opcode);
+         // Past the end of memory it wraps to the beginning, as drawing does
+         memory[I]              = value / 100;
+         memory[(I + 1) % size] = (value / 10) % 10;
+         memory[(I + 2) % size] = (value % 100) % 10;
+         self.codeWritten(I, I + 3);
 #ifdef DEBUG
-         machine.printMemory(std::cout, I, I + 3);
+         machine.printMemory(std::cout, I, std::min<size_t>(I + 3, size));
 #endif // DEBUG
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
-   OpcodeRunner storeToMemoryFromV(OpcodeExtractor)
+   template<typename End>
+   static Runner storeToMemoryFromV(End)
    {
-      return [this](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         std::cout << "TODO: " << std::hex << opcode <<  " storeToMemory" << std::endl;   
+         auto& machine = self.machine;
+         auto end = End::get(machine, opcode);
+         auto size = machine.getMemorySize();
+         auto I = machine.I % size;
+         for (size_t i = 0; i <= end; ++i)
+         {
+            auto memoryIndex = (I + i) % size;
+            machine.getMemory()[memoryIndex] = machine.V[i];
+         }
+         self.codeWritten(I, I + end + 1);
+#ifdef DEBUG
+         machine.printMemory(std::cout, I, std::min<size_t>(I + end + 1, size));
+#endif // DEBUG
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
-   OpcodeRunner readFromMemoryToV(OpcodeExtractor endExtractor)
+   template<typename End>
+   static Runner readFromMemoryToV(End)
    {
-      return [this, endExtractor](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         auto end = endExtractor(opcode);
+         auto& machine = self.machine;
+         auto end = End::get(machine, opcode);
          for (size_t i = 0; i <= end; ++i)
          {
-            auto memoryIndex = machine.I + i;
+            auto memoryIndex = (machine.I + i) % machine.getMemorySize();
             machine.V[i] = machine.getMemory()[memoryIndex];
          }
 #ifdef DEBUG
          machine.printV(std::cout, 0, end + 1);
 #endif // DEBUG
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
-   OpcodeRunner skipIfEquals(OpcodeExtractor lhs, OpcodeExtractor rhs)
+   template<typename Lhs, typename Rhs>
+   static Runner skipIfEquals(Lhs, Rhs)
    {
-      return [lhs, rhs, this](Opcode opcode)
+      return Runner(Flow::Skip, [](Pimpl& self, Opcode opcode)
       {
+         auto& machine = self.machine;
+         auto lhs = Lhs::get(machine, opcode);
+         auto rhs = Rhs::get(machine, opcode);
 #ifdef DEBUG
-         std::cout << "lhs: " << lhs(opcode) << " , rhs: " << rhs(opcode) << std::endl;
+         std::cout << "lhs: " << lhs << " , rhs: " << rhs << std::endl;
 #endif // DEBUG
-         if (lhs(opcode) == rhs(opcode))
+         if (lhs == rhs)
          {
 #ifdef DEBUG
             std::cout << "Skipped!!!" << std::endl;
 #endif // DEBUG
+            STATS(++self.stats.skips);
             machine.skip();
          }
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
    
-   OpcodeRunner skipIfNotEquals(OpcodeExtractor lhs, OpcodeExtractor rhs)
+   template<typename Lhs, typename Rhs>
+   static Runner skipIfNotEquals(Lhs, Rhs)
    {
-      return [lhs, rhs, this](Opcode opcode)
+      return Runner(Flow::Skip, [](Pimpl& self, Opcode opcode)
       {
-         if (lhs(opcode) != rhs(opcode)) machine.skip();
+         auto& machine = self.machine;
+         if (Lhs::get(machine, opcode) != Rhs::get(machine, opcode))
+         {
+            STATS(++self.stats.skips);
+            machine.skip();
+         }
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
-   OpcodeRunner jumpTo(OpcodeExtractor pcExtractor)
+   template<typename Address>
+   static Runner jumpTo(Address)
    {
-      return [pcExtractor, this](Opcode opcode)
+      return Runner(Flow::Jump, [](Pimpl& self, Opcode opcode)
       {
-         auto pc = pcExtractor(opcode);
+         auto& machine = self.machine;
+         auto pc = Address::get(machine, opcode);
          machine.setProgramCounter(pc);   
          return OpcodeRunnerResult::SkippNotNeeded;
-      };
+      });
    }
 
-   OpcodeRunner jumpTo(Extractor extractor, OpcodeExtractor opcodeExtractor)
+   template<typename Base, typename Address>
+   static Runner jumpTo(Base, Address)
    {
-      return [extractor, opcodeExtractor, this](Opcode opcode)
+      return Runner(Flow::IndirectJump, [](Pimpl& self, Opcode opcode)
       {
-         machine.setProgramCounter(extractor() + opcodeExtractor(opcode));   
+         auto& machine = self.machine;
+         machine.setProgramCounter(Base::get(machine, opcode) + Address::get(machine, opcode));   
          return OpcodeRunnerResult::SkippNotNeeded;
-      };
+      });
    }
 
 
-   OpcodeRunner callTo(OpcodeExtractor addressExtractor)
+   template<typename Address>
+   static Runner callTo(Address)
    {
-      return [addressExtractor, this](Opcode opcode)
+      return Runner(Flow::Call, [](Pimpl& self, Opcode opcode)
       {
+         auto& machine = self.machine;
+         if (machine.sp >= machine.stack.size())
+         {
+            throw std::out_of_range("Stack overflow");
+         }
          machine.skip();
          
          // Puts the program counter on the top of the stack
          machine.stack[machine.sp] = machine.getProgramCounter();
          ++machine.sp;
-         auto address = addressExtractor(opcode);
+         auto address = Address::get(machine, opcode);
          machine.setProgramCounter(address);     
          return OpcodeRunnerResult::SkippNotNeeded;
-      };
-   }
-   
-   /*   
-   Set Vx = random byte AND kk.
-
-   The interpreter generates a random number from 0 to 255, which is then ANDed with the value kk. The results are stored in Vx. See instruction 8xy2 for more information on AND.
-   */
-   OpcodeExtractor randomAnd(OpcodeExtractor rhsExtractor)
-   {
-      return [rhsExtractor, this](Opcode opcode)
-      {
-         auto rhs = rhsExtractor(opcode);
-         std::mt19937 mt(machine.rd());
-         std::uniform_int_distribution<>dist(0, 255);
-         return dist(mt) & rhs;
-      };
+      });
    }
    
-   template<typename T>
-   OpcodeRunner setTo(T Machine::*attribute, OpcodeExtractor opcodeExtractor)
+   template<typename T, T Machine::*attribute, typename Rhs>
+   static Runner setTo(From<T, attribute>, Rhs)
    {
-      return [attribute, opcodeExtractor, this](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         machine.*attribute = opcodeExtractor(opcode);
+         auto& machine = self.machine;
+         From<T, attribute>::ref(machine) = Rhs::get(machine, opcode);
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
-   OpcodeRunner setToV(OpcodeExtractor lhs, OpcodeExtractor rhs)
-   {
-      return [lhs, rhs, this](Opcode opcode)
-      {
-         machine.V[lhs(opcode)] = rhs(opcode);
-         return OpcodeRunnerResult::SkippNeeded;
-      };
-   }
- 
-   OpcodeRunner setToV(OpcodeExtractor lhs, Extractor rhs)
+   template<typename Lhs, typename Rhs>
+   static Runner setToV(Lhs, Rhs)
    {
-      return [lhs, rhs, this](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         machine.V[lhs(opcode)] = rhs();
+         auto& machine = self.machine;
+         machine.V[Lhs::get(machine, opcode)] = Rhs::get(machine, opcode);
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
   
-   template <typename T>
-   OpcodeRunner addTo(T Machine::*attribute, OpcodeExtractor opcodeExtractor)
+   template<typename T, T Machine::*attribute, typename Rhs>
+   static Runner addTo(From<T, attribute>, Rhs)
    {
-      return [attribute, opcodeExtractor, this](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         machine.*attribute += opcodeExtractor(opcode);
+         auto& machine = self.machine;
+         From<T, attribute>::ref(machine) += Rhs::get(machine, opcode);
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
-   OpcodeRunner addToV(OpcodeExtractor lhsExtractor, OpcodeExtractor rhsExtractor)
+   template<typename Lhs, typename Rhs>
+   static Runner addToV(Lhs, Rhs)
    {
-      return [lhsExtractor, rhsExtractor, this](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         auto lhs = lhsExtractor(opcode);
-         auto rhs = rhsExtractor(opcode);
+         auto& machine = self.machine;
+         auto lhs = Lhs::get(machine, opcode);
+         auto rhs = Rhs::get(machine, opcode);
          auto V = machine.V[lhs];
          machine.V[lhs] = V + rhs;
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
    //Set Vx = Vx - Vy, set VF = NOT borrow.
    //
    //If Vx > Vy, then VF is set to 1, otherwise 0. Then Vy is subtracted from Vx, and the results stored in Vx.
-   OpcodeRunner subtractToV(OpcodeExtractor lhs, OpcodeExtractor rhs)
+   template<typename Lhs, typename Rhs>
+   static Runner subtractToV(Lhs, Rhs)
    {
-      return [lhs, rhs, this](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {  
-         auto lhsIndex = lhs(opcode);
+         auto& machine = self.machine;
+         auto lhsIndex = Lhs::get(machine, opcode);
          auto lhsValue = machine.V[lhsIndex];
-         auto rhsValue = rhs(opcode);
+         auto rhsValue = Rhs::get(machine, opcode);
          
          machine.V[0xF] = ((lhsValue > rhsValue) ? 1 : 0);
 
          machine.V[lhsIndex] -= rhsValue;
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
   
-   OpcodeRunner orToV(OpcodeExtractor lhs, OpcodeExtractor rhs)
+   template<typename Lhs, typename Rhs>
+   static Runner orToV(Lhs, Rhs)
    {
-      return [lhs, rhs, this](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         machine.V[lhs(opcode)] or_eq rhs(opcode);
+         auto& machine = self.machine;
+         machine.V[Lhs::get(machine, opcode)] or_eq Rhs::get(machine, opcode);
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
-   OpcodeRunner andToV(OpcodeExtractor lhs, OpcodeExtractor rhs)
+   template<typename Lhs, typename Rhs>
+   static Runner andToV(Lhs, Rhs)
    {
-      return [lhs, rhs, this](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         machine.V[lhs(opcode)] and_eq rhs(opcode);
+         auto& machine = self.machine;
+         machine.V[Lhs::get(machine, opcode)] and_eq Rhs::get(machine, opcode);
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
 
-   OpcodeRunner xorToV(OpcodeExtractor lhs, OpcodeExtractor rhs)
+   template<typename Lhs, typename Rhs>
+   static Runner xorToV(Lhs, Rhs)
    {
-      return [lhs, rhs, this](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         machine.V[lhs(opcode)] xor_eq rhs(opcode);
+         auto& machine = self.machine;
+         machine.V[Lhs::get(machine, opcode)] xor_eq Rhs::get(machine, opcode);
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
    // If the least-significant bit of Vx is 1, then VF is set to 1, otherwise 0. 
    // Then Vx is divided by 2.
-   OpcodeRunner shiftRightToVx()
+   static Runner shiftRightToVx()
    {
-      return [&](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         auto x = ::x(opcode);
+         auto& machine = self.machine;
+         auto x = X::get(machine, opcode);
          auto Vx = machine.V[x];
          machine.V[0xF] = ((lsb(Vx) == 1) ? 1 : 0);
          machine.V[x] /= 2;
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
    // Set Vx = Vy - Vx, set VF = NOT borrow.
    // If Vy > Vx, then VF is set to 1, otherwise 0. Then Vx is subtracted from Vy, and the results stored in Vx.
-   OpcodeRunner subtractNumericToVxVy()
+   static Runner subtractNumericToVxVy()
    {
-      return [&](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         auto x = ::x(opcode);
-         auto y = ::y(opcode);
+         auto& machine = self.machine;
+         auto x = X::get(machine, opcode);
+         auto y = Y::get(machine, opcode);
          auto Vx = machine.V[x];
          auto Vy = machine.V[y];
          
          machine.V[0xF] = ((Vy > Vx) ? 1 : 0);
          machine.V[x] -= Vy;
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
    // Set Vx = Vx SHL 1.
    // If the most-significant bit of Vx is 1, then VF is set to 1, otherwise to 0. 
    // Then Vx is multiplied by 2.
-   OpcodeRunner shiftLeftToVx()
+   static Runner shiftLeftToVx()
    {
-      return [&](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-         auto x = ::x(opcode);
+         auto& machine = self.machine;
+         auto x = X::get(machine, opcode);
          auto Vx = machine.V[x];
          machine.V[0xF] = ((msb(Vx) == 1) ? 1 : 0);
          machine.V[x] *= 2;
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
-   OpcodeRunner display(OpcodeExtractor VxEtractor, OpcodeExtractor VyExtractor, OpcodeExtractor nExtractor)
+   // The sprite starts at (Vx, Vy) wrapped around the screen, the part of
+   // it beyond the right and bottom edges is clipped. Every sprite row is
+   // shifted to its place and XORed with a whole screen row, VF is set if
+   // any of them had pixels in common with the screen.
+   template<typename XExtractor, typename YExtractor, typename HeightExtractor>
+   static Runner display(XExtractor, YExtractor, HeightExtractor)
    {
-      return [VxEtractor, VyExtractor, nExtractor, this](Opcode opcode)
+      return Runner(Flow::Next, [](Pimpl& self, Opcode opcode)
       {
-
-         auto x = VxEtractor(opcode);
-         auto y = VyExtractor(opcode);
-         auto height = nExtractor(opcode);
-         machine.V[0xF] = 0;
-         for (int yoffset = 0; yoffset < height; yoffset ++)
+         auto& machine = self.machine;
+         auto x = XExtractor::get(machine, opcode) % ScreenXLimit;
+         auto y = YExtractor::get(machine, opcode) % ScreenYLimit;
+         auto height = std::min<size_t>(HeightExtractor::get(machine, opcode), ScreenYLimit - y);
+         auto memory = machine.getMemory();
+         GraphicsRow collision = 0;
+         for (size_t yoffset = 0; yoffset < height; yoffset++)
          {
-            auto pixel = machine.getMemory()[machine.I + yoffset];
-            for(int xoffset = 0; xoffset < 8; xoffset ++)
-            {  
-               auto xoffset_mask = 0x80 >> xoffset;
-               if((pixel & xoffset_mask) != 0)
-               {
-                  auto graphic_index = x + xoffset + ((y + yoffset) * 64);
-                  auto previous_value = machine.graphics[graphic_index];
-                  if(previous_value == 1)
-                  {
-                     machine.V[0xF] = 1;                                 
-                  }
-                  machine.graphics[graphic_index] = previous_value ^ 1;
-               }
-            }
+            auto sprite = GraphicsRow(memory[(machine.I + yoffset) % machine.getMemorySize()]);
+            // The sprite byte is moved to the left edge and then to x
+            auto row = sprite << (ScreenXLimit - 8) >> x;
+            auto& graphicsRow = machine.graphics[y + yoffset];
+            collision |= graphicsRow & row;
+            graphicsRow ^= row;
          }
-         drawFlag = true;
+         machine.V[0xF] = collision != 0;
+         self.drawFlag = true;
+         STATS(++self.stats.draws);
 #ifdef DEBUG
 
          machine.printV(std::cout, 0xF);
 
 #endif // DEBUG
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
    
+   // Wait for a key press, store the value of the key in Vx.
+   // The machine stays at the opcode, running it again does nothing, until
+   // pressKey stores the key and moves past it; the timers go on meanwhile.
+   static Runner waitKeyVx()
+   {
+      return Runner(Flow::Next, [](Pimpl& self, Opcode)
+      {
+         self.parked = true;
+         return OpcodeRunnerResult::SkippNotNeeded;
+      });
+   }
+
    // Skip next instruction if key with the value of Vx is pressed.
    // Checks the keyboard, and if the key corresponding to the value of Vx is currently in the down position, PC is increased by 2.
-   OpcodeRunner skipIfPressedVx()
+   static Runner skipIfPressedVx()
    {
-      return [&](Opcode opcode)
+      return Runner(Flow::Skip, [](Pimpl& self, Opcode opcode)
       {
-         auto Vx = machine.V[::x(opcode)];
-         if (machine.keypad[Vx] == KeyState::Pressed)
+         auto& machine = self.machine;
+         auto Vx = machine.V[X::get(machine, opcode)];
+         // Only the low digit selects the key
+         if (machine.keypad[Vx % machine.keypad.size()] == KeyState::Pressed)
          {
+            STATS(++self.stats.skips);
             machine.skip();
          }
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
    // Skip next instruction if key with the value of Vx is not pressed.
    // Checks the keyboard, and if the key corresponding to the value of Vx is currently in the up position, PC is increased by 2.
-   OpcodeRunner skipIfNotPressedVx()
+   static Runner skipIfNotPressedVx()
    {
-      return [&](Opcode opcode)
+      return Runner(Flow::Skip, [](Pimpl& self, Opcode opcode)
       {
-         auto Vx = machine.V[::x(opcode)];
-         if (machine.keypad[Vx] == KeyState::Released)
+         auto& machine = self.machine;
+         auto Vx = machine.V[X::get(machine, opcode)];
+         if (machine.keypad[Vx % machine.keypad.size()] == KeyState::Released)
          {
+            STATS(++self.stats.skips);
             machine.skip();
          }
          return OpcodeRunnerResult::SkippNeeded;
-      };
+      });
    }
 
 
@@ -864,13 +1966,13 @@ Chip8::~Chip8() = default;
 void 
 Chip8::loadGame(const std::string& name)
 {
-   pimpl->loadGame(name);
+   pimpl->loadGame(*Rom::map(name));
 }
 
 void 
-Chip8::loadGame(std::function<void(Register*)> gameLoader)
+Chip8::loadGame(const Rom& rom)
 {
-   pimpl->loadGame(gameLoader);
+   pimpl->loadGame(rom);
 }
 
 void 
@@ -879,12 +1981,42 @@ Chip8::setCpuRate(uint32_t rate)
    pimpl->setCpuRate(rate);
 }
 
+uint32_t
+Chip8::getCyclesPerFrame() const
+{
+   return pimpl->getCyclesPerFrame();
+}
+
+void 
+Chip8::setSeed(uint64_t seed)
+{
+   pimpl->setSeed(seed);
+}
+
+void 
+Chip8::setEngine(Engine engine)
+{
+   pimpl->setEngine(engine);
+}
+
+void 
+Chip8::emulateFrame()
+{
+   pimpl->emulateFrame();
+}
+
 void 
 Chip8::emulateCycle()
 {
    pimpl->emulateCycle();
 }
 
+void 
+Chip8::emulateCycles(uint64_t cycles)
+{
+   pimpl->emulateCycles(cycles);
+}
+
 void 
 Chip8::pressKey(Key key)
 {
@@ -898,6 +2030,12 @@ Chip8::releaseKey(Key key)
    pimpl->releaseKey(key);
 }
 
+bool
+Chip8::waitingForKey() const
+{
+   return pimpl->waitingForKey();
+}
+
 bool
 Chip8::drawNeeded()
 {
@@ -905,9 +2043,21 @@ Chip8::drawNeeded()
 }
 
 bool
-Chip8::beepNeeded()
+Chip8::soundOn() const
+{
+   return pimpl->soundOn();
+}
+
+SaveState
+Chip8::saveState() const
+{
+   return pimpl->saveState();
+}
+
+void
+Chip8::loadState(const SaveState& state)
 {
-   return pimpl->beepNeeded();
+   pimpl->loadState(state);
 }
 
 const Graphics&
@@ -915,3 +2065,116 @@ Chip8::getGraphics() const
 {
    return pimpl->getGraphics();
 }
+
+Stats
+Chip8::getStats() const
+{
+   return pimpl->getStats();
+}
+
+void
+Chip8::resetStats()
+{
+   pimpl->resetStats();
+}
+
+void
+Chip8::setTrace(size_t entries)
+{
+   pimpl->setTrace(entries);
+}
+
+Trace
+Chip8::getTrace() const
+{
+   return pimpl->getTrace();
+}
+
+void
+Chip8::predecode(const std::vector<Address>& starts)
+{
+   pimpl->predecode(starts);
+}
+
+OpcodeFlow
+Chip8::opcodeFlow(Opcode opcode)
+{
+   return Pimpl::opcodeFlow(opcode);
+}
+
+bool
+Chip8::sameInstruction(Opcode lhs, Opcode rhs)
+{
+   return Pimpl::sameInstruction(lhs, rhs);
+}
+
+bool
+Chip8::statsEnabled()
+{
+#ifdef CHIP8_STATS
+   return true;
+#else
+   return false;
+#endif
+}
+
+std::ostream&
+operator << (std::ostream& out, const Stats& stats)
+{
+   const size_t HottestAddresses = 16;
+
+   auto opcodes = stats.opcodes;
+   std::sort(opcodes.begin(), opcodes.end(), [](const std::pair<std::string, uint64_t>& lhs,
+                                                const std::pair<std::string, uint64_t>& rhs)
+   {
+      return lhs.second > rhs.second or (lhs.second == rhs.second and lhs.first < rhs.first);
+   });
+   uint64_t total = 0;
+   for (const auto& kind : opcodes)
+   {
+      total += kind.second;
+   }
+   auto share = [total](uint64_t count)
+   {
+      return total > 0 ? 100.0 * count / total : 0.0;
+   };
+
+   auto flags = out.flags();
+   auto precision = out.precision();
+   out << std::fixed << std::setprecision(2) << "Opcodes: " << total << std::endl;
+   for (const auto& kind : opcodes)
+   {
+      if (kind.second > 0)
+      {
+         out << std::setw(14) << kind.second << std::setw(8) << share(kind.second) << "%  " << kind.first << std::endl;
+      }
+   }
+
+   std::vector<size_t> addresses;
+   for (size_t pc = 0; pc < stats.pcs.size(); ++pc)
+   {
+      if (stats.pcs[pc] > 0)
+      {
+         addresses.push_back(pc);
+      }
+   }
+   auto hottest = std::min(addresses.size(), HottestAddresses);
+   std::partial_sort(addresses.begin(), addresses.begin() + hottest, addresses.end(), [&stats](size_t lhs, size_t rhs)
+   {
+      return stats.pcs[lhs] > stats.pcs[rhs] or (stats.pcs[lhs] == stats.pcs[rhs] and lhs < rhs);
+   });
+   out << "Hottest addresses:" << std::endl;
+   for (size_t i = 0; i < hottest; ++i)
+   {
+      auto count = stats.pcs[addresses[i]];
+      out << "  0x" << std::hex << std::setw(3) << std::setfill('0') << addresses[i] << std::dec << std::setfill(' ')
+          << std::setw(14) << count << std::setw(8) << share(count) << "%" << std::endl;
+   }
+
+   out << "Skips taken: " << stats.skips << std::endl
+       << "Draws: " << stats.draws << std::endl
+       << "Timer ticks: " << stats.delayTicks << " delay, " << stats.soundTicks << " sound" << std::endl;
+   out.flags(flags);
+   out.precision(precision);
+   return out;
+}
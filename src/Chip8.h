@@ -1,30 +1,77 @@
 #ifndef _CHIP8_H_
 #define _CHIP8_H_
 
-#include <functional>
 #include <string>
 #include <memory>
+#include <vector>
 
 #include "Chip8Types.h"
+#include "Trace.h"
+
+class Rom;
 
 class Chip8
 {
 public:
    Chip8();
    ~Chip8();
+   // The game is copied to the program area and the rest of it cleared,
+   // the file is mapped and thrown away, see Rom
    void loadGame(const std::string& name);
-   void loadGame(std::function<void(Register*)>);
+   void loadGame(const Rom&);
+   // Opcodes per second, it is run FrameRate times a second by emulateFrame
    void setCpuRate(uint32_t);
+   uint32_t getCyclesPerFrame() const;
+   // Cxkk draws from a generator in the machine, seeded at random unless
+   // given one, the same seed and input give the same game
+   void setSeed(uint64_t);
+   void setEngine(Engine);
+   // Runs a frame of opcodes and ticks the timers once
+   void emulateFrame();
+   // Only run opcodes, the timers are left as they are
    void emulateCycle();
+   void emulateCycles(uint64_t cycles);
+   // Fx0A waits for the next key pressed, the machine stays at it meanwhile
    void pressKey(Key);
    void releaseKey(Key);
+   // Waiting at Fx0A with the timers run out, frames change nothing until a
+   // key is pressed so there is no point in running them
+   bool waitingForKey() const;
    bool drawNeeded();
-   bool beepNeeded();
+   // The tone plays for as long as the sound timer runs
+   bool soundOn() const;
+   // The whole machine as a versioned binary blob, loadState throws
+   // std::invalid_argument if it is not one of this version
+   SaveState saveState() const;
+   void loadState(const SaveState&);
    const Graphics& getGraphics() const;
+   // All zero unless built with CHIP8_STATS, the counters cost nothing
+   // otherwise
+   Stats getStats() const;
+   void resetStats();
+   static bool statsEnabled();
+   // Keeps the last opcodes run, 0 stops tracing. Every opcode goes
+   // through the interpreter while tracing, the recompiler is not used.
+   void setTrace(size_t entries);
+   // Oldest first, empty when not tracing
+   Trace getTrace() const;
+   // Decodes the blocks starting at the addresses now rather than when they
+   // are first run, ControlFlowGraph::leaders has them
+   void predecode(const std::vector<Address>& starts);
+
+   // As the dispatch table decodes it, so nothing else has to
+   static OpcodeFlow opcodeFlow(Opcode);
+   // Whether the dispatch table runs both with the same runner, the same
+   // instruction with other operands
+   static bool sameInstruction(Opcode, Opcode);
 private:
    class Pimpl;
    std::unique_ptr<Pimpl> pimpl;
 
 };
 
+// The opcodes by how often they ran, the hottest addresses and the rest of
+// the counters
+std::ostream& operator << (std::ostream& out, const Stats& stats);
+
 #endif // _CHIP8_H_
@@ -0,0 +1,1111 @@
+#include "Chip8Lockstep.h"
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "Chip8.h"
+#include "Rom.h"
+
+#if defined(__x86_64__) and defined(__GNUC__)
+#include <immintrin.h>
+// Only the lockstep functions are built for AVX2, it is checked at run time
+#define LOCKSTEP_AVX2 1
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace
+{
+   // The lanes are run 32 at a time, their count is rounded up with lanes
+   // that never run
+   const size_t LaneBlock = 32;
+   // Set in the program counter of the lanes done with the slice, so the
+   // lowest program counter is always one of a lane still running
+   const Counter Retired = 0x8000;
+   // The cycles left are 16 bits, longer frames are run in slices
+   const uint32_t MaxSlice = 0xFFFF;
+   // Lockstep is given up for the slice once fewer than a 256th of the
+   // lanes run an opcode together, looking for them costs more than running
+   // them on their own then. Waiting lanes often catch up, so it is low.
+   const size_t MinLockstepShare = 256;
+
+   enum class Kind : uint8_t
+   {
+      ClearDisplay, Return, Jump, Call,
+      SkipEqualKk, SkipNotEqualKk, SkipEqualVy, SkipNotEqualVy,
+      SetKk, AddKk, SetVy, Or, And, Xor, Add,
+      Subtract, ShiftRight, SubtractNumeric, ShiftLeft,
+      SetI, JumpV0, Random, Draw, SkipPressed, SkipNotPressed,
+      GetDelay, WaitKey, SetDelay, SetSound, AddI, Font, Bcd, Store, Load,
+      Unknown,
+   };
+
+   // An opcode of every kind, the others are of the kind whose opcode the
+   // Chip8 dispatch table runs with the same runner, so the lanes decode
+   // exactly as Chip8 does
+   const std::array<std::pair<Kind, Opcode>, 34> Instructions =
+   {{
+      {Kind::ClearDisplay, 0x00E0}, {Kind::Return, 0x00EE}, {Kind::Jump, 0x1000},
+      {Kind::Call, 0x2000}, {Kind::SkipEqualKk, 0x3000}, {Kind::SkipNotEqualKk, 0x4000},
+      {Kind::SkipEqualVy, 0x5000}, {Kind::SetKk, 0x6000}, {Kind::AddKk, 0x7000},
+      {Kind::SetVy, 0x8000}, {Kind::Or, 0x8001}, {Kind::And, 0x8002}, {Kind::Xor, 0x8003},
+      {Kind::Add, 0x8004}, {Kind::Subtract, 0x8005}, {Kind::ShiftRight, 0x8006},
+      {Kind::SubtractNumeric, 0x8007}, {Kind::ShiftLeft, 0x800E}, {Kind::SkipNotEqualVy, 0x9000},
+      {Kind::SetI, 0xA000}, {Kind::JumpV0, 0xB000}, {Kind::Random, 0xC000}, {Kind::Draw, 0xD000},
+      {Kind::SkipPressed, 0xE09E}, {Kind::SkipNotPressed, 0xE0A1}, {Kind::GetDelay, 0xF007},
+      {Kind::WaitKey, 0xF00A}, {Kind::SetDelay, 0xF015}, {Kind::SetSound, 0xF018},
+      {Kind::AddI, 0xF01E}, {Kind::Font, 0xF029}, {Kind::Bcd, 0xF033}, {Kind::Store, 0xF055},
+      {Kind::Load, 0xF065},
+   }};
+
+   Kind decode(Opcode opcode)
+   {
+      if (Chip8::opcodeFlow(opcode) != OpcodeFlow::Unknown)
+      {
+         for (const auto& instruction : Instructions)
+         {
+            if (Chip8::sameInstruction(opcode, instruction.second))
+            {
+               return instruction.first;
+            }
+         }
+      }
+      return Kind::Unknown;
+   }
+
+   using Kinds = std::array<Kind, 0x10000>;
+
+   // Decoded once for the whole opcode space and shared by all the instances
+   const Kinds& getKinds()
+   {
+      static const Kinds kinds = []
+      {
+         Kinds kinds;
+         for (size_t opcode = 0; opcode < kinds.size(); ++opcode)
+         {
+            kinds[opcode] = decode(static_cast<Opcode>(opcode));
+         }
+         return kinds;
+      }();
+      return kinds;
+   }
+
+   size_t X(Opcode opcode)
+   {
+      return (opcode & 0x0F00) >> 8;
+   }
+
+   size_t Y(Opcode opcode)
+   {
+      return (opcode & 0x00F0) >> 4;
+   }
+
+   // Every machine register is an array with a value per lane, the rest of
+   // the machine is too big to be worth splitting and is kept per lane.
+   struct Lanes
+   {
+      explicit Lanes(size_t count)
+      :pc((count + LaneBlock - 1) / LaneBlock * LaneBlock, Retired)
+      ,remaining(pc.size(), 0)
+      ,I(pc.size(), 0xFFFF)
+      ,sp(pc.size(), 0)
+      ,delayTimer(pc.size(), 0)
+      ,soundTimer(pc.size(), 0)
+      ,random(pc.size(), 0)
+      ,stack(count)
+      ,memory(count)
+      ,graphics(count)
+      ,keypad(count)
+      {
+         for (auto& registers : V)
+         {
+            registers.assign(pc.size(), 0);
+         }
+         for (size_t lane = 0; lane < count; ++lane)
+         {
+            // At the old systems the emulator is at the beginning
+            pc[lane] = ProgramStart;
+            random[lane] = lane;
+            stack[lane].fill(0);
+            memory[lane].fill(0);
+            std::copy(Fontset.begin(), Fontset.end(), memory[lane].begin());
+            graphics[lane].fill(0);
+            keypad[lane].fill(KeyState::Released);
+         }
+      }
+
+      std::array<std::vector<Register>, 16> V;
+      std::vector<Counter> pc;
+      // Cycles each lane has left in the slice
+      std::vector<uint16_t> remaining;
+      std::vector<Counter> I;
+      std::vector<Counter> sp;
+      std::vector<Timer> delayTimer;
+      std::vector<Timer> soundTimer;
+      std::vector<uint64_t> random;
+      std::vector<Stack> stack;
+      std::vector<Memory> memory;
+      std::vector<Graphics> graphics;
+      std::vector<Keypad> keypad;
+   };
+
+#ifdef LOCKSTEP_AVX2
+   // How the opcode leaves the program counter of the lanes it ran in
+   enum class Flow { Next, Skip, Jump, PerLane };
+
+   // The lanes of a block of 32 that are at the opcode, as bytes for the
+   // registers and as words for the counters of the first and last 16
+   struct Active
+   {
+      __m256i bytes;
+      __m256i low;
+      __m256i high;
+   };
+
+   AVX2 inline __m256i load(const uint8_t* values)
+   {
+      return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values));
+   }
+
+   AVX2 inline __m256i load(const uint16_t* values)
+   {
+      return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values));
+   }
+
+   AVX2 inline void store(uint8_t* values, __m256i vector)
+   {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(values), vector);
+   }
+
+   AVX2 inline void store(uint16_t* values, __m256i vector)
+   {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(values), vector);
+   }
+
+   AVX2 inline __m256i ones()
+   {
+      return _mm256_set1_epi8(-1);
+   }
+
+   // Unsigned lhs > rhs, there is only a signed compare
+   AVX2 inline __m256i greater(__m256i lhs, __m256i rhs)
+   {
+      return _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(lhs, rhs), rhs), ones());
+   }
+
+   AVX2 inline __m256i widenLow(__m256i bytes)
+   {
+      return _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes));
+   }
+
+   AVX2 inline __m256i widenHigh(__m256i bytes)
+   {
+      return _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1));
+   }
+
+   // Writes value in the active lanes of a block of registers
+   AVX2 inline void update(uint8_t* values, __m256i value, __m256i active)
+   {
+      store(values, _mm256_blendv_epi8(load(values), value, active));
+   }
+
+   AVX2 inline void update(uint16_t* values, __m256i low, __m256i high, const Active& active)
+   {
+      store(values, _mm256_blendv_epi8(load(values), low, active.low));
+      store(values + 16, _mm256_blendv_epi8(load(values + 16), high, active.high));
+   }
+
+   // The operands are 32 lanes of a block, as the operand extractors of
+   // Chip8 are of a single machine
+   struct VyLanes
+   {
+      AVX2 static __m256i get(Lanes& lanes, size_t first, Opcode opcode)
+      {
+         return load(&lanes.V[Y(opcode)][first]);
+      }
+   };
+
+   struct KkLanes
+   {
+      AVX2 static __m256i get(Lanes&, size_t, Opcode opcode)
+      {
+         return _mm256_set1_epi8(static_cast<char>(opcode & 0x00FF));
+      }
+   };
+
+   struct DelayTimerLanes
+   {
+      AVX2 static __m256i get(Lanes& lanes, size_t first, Opcode)
+      {
+         return load(&lanes.delayTimer[first]);
+      }
+   };
+
+   struct Assign
+   {
+      AVX2 static __m256i apply(__m256i, __m256i rhs)
+      {
+         return rhs;
+      }
+   };
+
+   struct AddBytes
+   {
+      AVX2 static __m256i apply(__m256i lhs, __m256i rhs)
+      {
+         return _mm256_add_epi8(lhs, rhs);
+      }
+   };
+
+   struct OrBytes
+   {
+      AVX2 static __m256i apply(__m256i lhs, __m256i rhs)
+      {
+         return _mm256_or_si256(lhs, rhs);
+      }
+   };
+
+   struct AndBytes
+   {
+      AVX2 static __m256i apply(__m256i lhs, __m256i rhs)
+      {
+         return _mm256_and_si256(lhs, rhs);
+      }
+   };
+
+   struct XorBytes
+   {
+      AVX2 static __m256i apply(__m256i lhs, __m256i rhs)
+      {
+         return _mm256_xor_si256(lhs, rhs);
+      }
+   };
+
+   // Vx = Op(Vx, Rhs)
+   template<typename Op, typename Rhs>
+   struct ToVx
+   {
+      static const Flow flow = Flow::Next;
+
+      AVX2 static __m256i run(Lanes& lanes, size_t first, Opcode opcode, const Active& active)
+      {
+         auto Vx = &lanes.V[X(opcode)][first];
+         update(Vx, Op::apply(load(Vx), Rhs::get(lanes, first, opcode)), active.bytes);
+         return _mm256_setzero_si256();
+      }
+   };
+
+   // VF is written from Vx and Vy first and then Vx from the value it has
+   // after that, which is the flag when Vx is VF itself, as Chip8 does.
+   template<typename Op>
+   struct ToVxWithFlag
+   {
+      static const Flow flow = Flow::Next;
+
+      AVX2 static __m256i run(Lanes& lanes, size_t first, Opcode opcode, const Active& active)
+      {
+         auto Vx = &lanes.V[X(opcode)][first];
+         auto rhs = load(&lanes.V[Y(opcode)][first]);
+         auto flag = _mm256_and_si256(Op::flag(load(Vx), rhs), _mm256_set1_epi8(1));
+         update(&lanes.V[0xF][first], flag, active.bytes);
+         update(Vx, Op::apply(load(Vx), rhs), active.bytes);
+         return _mm256_setzero_si256();
+      }
+   };
+
+   struct SubtractBytes
+   {
+      AVX2 static __m256i flag(__m256i Vx, __m256i Vy)
+      {
+         return greater(Vx, Vy);
+      }
+
+      AVX2 static __m256i apply(__m256i Vx, __m256i Vy)
+      {
+         return _mm256_sub_epi8(Vx, Vy);
+      }
+   };
+
+   struct SubtractNumericBytes
+   {
+      AVX2 static __m256i flag(__m256i Vx, __m256i Vy)
+      {
+         return greater(Vy, Vx);
+      }
+
+      AVX2 static __m256i apply(__m256i Vx, __m256i Vy)
+      {
+         return _mm256_sub_epi8(Vx, Vy);
+      }
+   };
+
+   // There are no byte shifts, the bits crossing into the next byte of the
+   // word are masked out
+   struct ShiftRightBytes
+   {
+      AVX2 static __m256i flag(__m256i Vx, __m256i)
+      {
+         return Vx;
+      }
+
+      AVX2 static __m256i apply(__m256i Vx, __m256i)
+      {
+         return _mm256_and_si256(_mm256_srli_epi16(Vx, 1), _mm256_set1_epi8(0x7F));
+      }
+   };
+
+   struct ShiftLeftBytes
+   {
+      AVX2 static __m256i flag(__m256i Vx, __m256i)
+      {
+         return _mm256_srli_epi16(Vx, 7);
+      }
+
+      AVX2 static __m256i apply(__m256i Vx, __m256i)
+      {
+         return _mm256_add_epi8(Vx, Vx);
+      }
+   };
+
+   struct EqualBytes
+   {
+      AVX2 static __m256i apply(__m256i lhs, __m256i rhs)
+      {
+         return _mm256_cmpeq_epi8(lhs, rhs);
+      }
+   };
+
+   struct NotEqualBytes
+   {
+      AVX2 static __m256i apply(__m256i lhs, __m256i rhs)
+      {
+         return _mm256_xor_si256(_mm256_cmpeq_epi8(lhs, rhs), ones());
+      }
+   };
+
+   // Gives the lanes that skip the next opcode
+   template<typename Compare, typename Rhs>
+   struct SkipIf
+   {
+      static const Flow flow = Flow::Skip;
+
+      AVX2 static __m256i run(Lanes& lanes, size_t first, Opcode opcode, const Active&)
+      {
+         return Compare::apply(load(&lanes.V[X(opcode)][first]), Rhs::get(lanes, first, opcode));
+      }
+   };
+
+   struct JumpLanes
+   {
+      static const Flow flow = Flow::Jump;
+
+      AVX2 static __m256i run(Lanes&, size_t, Opcode, const Active&)
+      {
+         return _mm256_setzero_si256();
+      }
+   };
+
+   template<std::vector<Timer> Lanes::*timer>
+   struct SetTimerLanes
+   {
+      static const Flow flow = Flow::Next;
+
+      AVX2 static __m256i run(Lanes& lanes, size_t first, Opcode opcode, const Active& active)
+      {
+         update(&(lanes.*timer)[first], load(&lanes.V[X(opcode)][first]), active.bytes);
+         return _mm256_setzero_si256();
+      }
+   };
+
+   struct SetILanes
+   {
+      static const Flow flow = Flow::Next;
+
+      AVX2 static __m256i run(Lanes& lanes, size_t first, Opcode opcode, const Active& active)
+      {
+         auto nnn = _mm256_set1_epi16(static_cast<short>(opcode & 0x0FFF));
+         update(&lanes.I[first], nnn, nnn, active);
+         return _mm256_setzero_si256();
+      }
+   };
+
+   struct AddILanes
+   {
+      static const Flow flow = Flow::Next;
+
+      AVX2 static __m256i run(Lanes& lanes, size_t first, Opcode opcode, const Active& active)
+      {
+         auto Vx = load(&lanes.V[X(opcode)][first]);
+         auto I = &lanes.I[first];
+         update(I, _mm256_add_epi16(load(I), widenLow(Vx)), _mm256_add_epi16(load(I + 16), widenHigh(Vx)), active);
+         return _mm256_setzero_si256();
+      }
+   };
+
+   // Each font sprite has a size of 5
+   struct FontLanes
+   {
+      static const Flow flow = Flow::Next;
+
+      AVX2 static __m256i run(Lanes& lanes, size_t first, Opcode opcode, const Active& active)
+      {
+         auto Vx = load(&lanes.V[X(opcode)][first]);
+         auto five = _mm256_set1_epi16(5);
+         update(&lanes.I[first], _mm256_mullo_epi16(widenLow(Vx), five), _mm256_mullo_epi16(widenHigh(Vx), five), active);
+         return _mm256_setzero_si256();
+      }
+   };
+
+   // Drawing, the stack, memory, the keypad and the generator are run by
+   // Chip8Lockstep::Pimpl::runLane in each lane
+   struct PerLane
+   {
+      static const Flow flow = Flow::PerLane;
+
+      AVX2 static __m256i run(Lanes&, size_t, Opcode, const Active&)
+      {
+         return _mm256_setzero_si256();
+      }
+   };
+#endif
+}
+
+class Chip8Lockstep::Pimpl
+{
+public:
+   explicit Pimpl(size_t count)
+   :count(count)
+   ,lanes(count)
+   ,cyclesPerFrame(DefaultCpuRate / FrameRate)
+   ,vectorized(vectorSupported())
+   ,instructions(0)
+   ,lockstepInstructions(0)
+   ,kinds(getKinds())
+   {
+      if (count == 0)
+      {
+         throw std::invalid_argument("No lanes");
+      }
+   }
+
+   void loadGame(const Rom& rom)
+   {
+      for (auto& memory : lanes.memory)
+      {
+         auto program = memory.begin() + ProgramStart;
+         std::copy(rom.data(), rom.data() + rom.size(), program);
+         std::fill(program + rom.size(), memory.end(), 0);
+      }
+      written.reset();
+   }
+
+   void setCpuRate(uint32_t rate)
+   {
+      if (rate < FrameRate)
+      {
+         throw std::invalid_argument("The cpu rate has to be at least one opcode per frame");
+      }
+      cyclesPerFrame = rate / FrameRate;
+   }
+
+   uint32_t getCyclesPerFrame() const
+   {
+      return cyclesPerFrame;
+   }
+
+   void setSeed(size_t lane, uint64_t seed)
+   {
+      lanes.random[checkLane(lane)] = seed;
+   }
+
+   void setVectorized(bool enabled)
+   {
+      if (enabled and not vectorSupported())
+      {
+         throw std::invalid_argument("Lockstep needs a host with AVX2");
+      }
+      vectorized = enabled;
+   }
+
+   void emulateFrame()
+   {
+      for (auto left = cyclesPerFrame; left > 0; )
+      {
+         auto slice = std::min(left, MaxSlice);
+         runSlice(static_cast<uint16_t>(slice));
+         left -= slice;
+      }
+      emulateTimers();
+   }
+
+   void pressKey(size_t lane, Key key)
+   {
+      lanes.keypad[checkLane(lane)][static_cast<size_t>(key)] = KeyState::Pressed;
+      auto pc = lanes.pc[lane] & ~Retired;
+      if (pc + 1u < std::tuple_size<Memory>::value)
+      {
+         auto opcode = read(lane, pc) << 8 | read(lane, pc + 1);
+         if (kinds[opcode] == Kind::WaitKey)
+         {
+            lanes.V[X(opcode)][lane] = static_cast<Register>(key);
+            lanes.pc[lane] += 2;
+         }
+      }
+   }
+
+   void releaseKey(size_t lane, Key key)
+   {
+      lanes.keypad[checkLane(lane)][static_cast<size_t>(key)] = KeyState::Released;
+   }
+
+   const Graphics& getGraphics(size_t lane) const
+   {
+      return lanes.graphics[checkLane(lane)];
+   }
+
+   size_t getLanes() const
+   {
+      return count;
+   }
+
+   uint64_t getInstructions() const
+   {
+      return instructions;
+   }
+
+   uint64_t getLockstepInstructions() const
+   {
+      return lockstepInstructions;
+   }
+
+private:
+   size_t count;
+   Lanes lanes;
+   uint32_t cyclesPerFrame;
+   bool vectorized;
+   // Memory any lane has written, the lanes may have different opcodes there
+   std::bitset<std::tuple_size<Memory>::value> written;
+   uint64_t instructions;
+   uint64_t lockstepInstructions;
+   const Kinds& kinds;
+
+   size_t checkLane(size_t lane) const
+   {
+      if (lane >= count)
+      {
+         throw std::out_of_range("No such lane");
+      }
+      return lane;
+   }
+
+   // A slice stopped by an error counts for neither, so the lockstep ones
+   // are never more than all of them
+   void runSlice(uint16_t cycles)
+   {
+      for (size_t lane = 0; lane < count; ++lane)
+      {
+         lanes.pc[lane] &= ~Retired;
+         lanes.remaining[lane] = cycles;
+      }
+      uint64_t lockstep = 0;
+#ifdef LOCKSTEP_AVX2
+      if (vectorized)
+      {
+         lockstep = runLockstep();
+      }
+#endif
+      for (size_t lane = 0; lane < count; ++lane)
+      {
+         while (not (lanes.pc[lane] & Retired))
+         {
+            stepLane(lane);
+         }
+      }
+      for (size_t lane = 0; lane < count; ++lane)
+      {
+         // Left by the lanes waiting for a key
+         instructions += cycles - lanes.remaining[lane];
+      }
+      lockstepInstructions += lockstep;
+   }
+
+   void emulateTimers()
+   {
+      for (size_t lane = 0; lane < count; ++lane)
+      {
+         if (lanes.delayTimer[lane] > 0)
+         {
+            --lanes.delayTimer[lane];
+         }
+         if (lanes.soundTimer[lane] > 0)
+         {
+            --lanes.soundTimer[lane];
+         }
+      }
+   }
+
+   // splitmix64, as the Chip8 machine
+   Register nextRandom(size_t lane)
+   {
+      auto z = (lanes.random[lane] += 0x9E3779B97F4A7C15ULL);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      return static_cast<Register>((z ^ (z >> 31)) >> 56);
+   }
+
+   void programCounterOutOfMemory(Counter pc)
+   {
+      std::ostringstream message;
+      message << "Program counter out of memory " << std::hex << pc;
+      throw std::out_of_range(message.str());
+   }
+
+   // Runs the next opcode of a lane on its own
+   void stepLane(size_t lane)
+   {
+      auto pc = lanes.pc[lane];
+      if (pc + 1u >= std::tuple_size<Memory>::value)
+      {
+         programCounterOutOfMemory(pc);
+      }
+      runLane(lane, read(lane, pc) << 8 | read(lane, pc + 1));
+   }
+
+   // Runs the opcode in a lane, the semantics are the ones of the Chip8
+   // runners
+   void runLane(size_t lane, Opcode opcode)
+   {
+      auto pc = lanes.pc[lane];
+      auto& V = lanes.V;
+      auto x = X(opcode);
+      auto y = Y(opcode);
+      Register kk = opcode & 0x00FF;
+      Counter nnn = opcode & 0x0FFF;
+      Register Vx = V[x][lane];
+      Register Vy = V[y][lane];
+      auto& I = lanes.I[lane];
+      auto& sp = lanes.sp[lane];
+      Counter next = pc + 2;
+
+      switch (kinds[opcode])
+      {
+         case Kind::ClearDisplay:
+            lanes.graphics[lane].fill(0);
+            break;
+         case Kind::Return:
+            if (sp == 0)
+            {
+               throw std::out_of_range("Stack underflow");
+            }
+            --sp;
+            next = lanes.stack[lane][sp];
+            break;
+         case Kind::Jump:
+            next = nnn;
+            break;
+         case Kind::Call:
+            if (sp >= lanes.stack[lane].size())
+            {
+               throw std::out_of_range("Stack overflow");
+            }
+            // Puts the program counter on the top of the stack
+            lanes.stack[lane][sp] = next;
+            ++sp;
+            next = nnn;
+            break;
+         case Kind::SkipEqualKk:
+            next += Vx == kk ? 2 : 0;
+            break;
+         case Kind::SkipNotEqualKk:
+            next += Vx != kk ? 2 : 0;
+            break;
+         case Kind::SkipEqualVy:
+            next += Vx == Vy ? 2 : 0;
+            break;
+         case Kind::SkipNotEqualVy:
+            next += Vx != Vy ? 2 : 0;
+            break;
+         case Kind::SetKk:
+            V[x][lane] = kk;
+            break;
+         case Kind::AddKk:
+            V[x][lane] = Vx + kk;
+            break;
+         case Kind::SetVy:
+            V[x][lane] = Vy;
+            break;
+         case Kind::Or:
+            V[x][lane] = Vx | Vy;
+            break;
+         case Kind::And:
+            V[x][lane] = Vx & Vy;
+            break;
+         case Kind::Xor:
+            V[x][lane] = Vx ^ Vy;
+            break;
+         case Kind::Add:
+            V[x][lane] = Vx + Vy;
+            break;
+         // The flag is written first, Vx is then read again as it may be VF
+         case Kind::Subtract:
+            V[0xF][lane] = Vx > Vy ? 1 : 0;
+            V[x][lane] -= Vy;
+            break;
+         case Kind::ShiftRight:
+            V[0xF][lane] = Vx & 1;
+            V[x][lane] /= 2;
+            break;
+         case Kind::SubtractNumeric:
+            V[0xF][lane] = Vy > Vx ? 1 : 0;
+            V[x][lane] -= Vy;
+            break;
+         case Kind::ShiftLeft:
+            V[0xF][lane] = Vx >> 7;
+            V[x][lane] *= 2;
+            break;
+         case Kind::SetI:
+            I = nnn;
+            break;
+         case Kind::JumpV0:
+            next = V[0][lane] + nnn;
+            break;
+         case Kind::Random:
+            V[x][lane] = nextRandom(lane) & kk;
+            break;
+         case Kind::Draw:
+            draw(lane, Vx, Vy, opcode & 0x000F);
+            break;
+         case Kind::SkipPressed:
+            next += lanes.keypad[lane][Vx % lanes.keypad[lane].size()] == KeyState::Pressed ? 2 : 0;
+            break;
+         case Kind::SkipNotPressed:
+            next += lanes.keypad[lane][Vx % lanes.keypad[lane].size()] == KeyState::Released ? 2 : 0;
+            break;
+         case Kind::GetDelay:
+            V[x][lane] = lanes.delayTimer[lane];
+            break;
+         // As in Chip8 the lane stays at it, done with the slice, until
+         // pressKey gives it the key
+         case Kind::WaitKey:
+            --lanes.remaining[lane];
+            lanes.pc[lane] = pc | Retired;
+            return;
+         case Kind::SetDelay:
+            lanes.delayTimer[lane] = Vx;
+            break;
+         case Kind::SetSound:
+            lanes.soundTimer[lane] = Vx;
+            break;
+         case Kind::AddI:
+            I += Vx;
+            break;
+         case Kind::Font:
+            I = Vx * 5;
+            break;
+         case Kind::Bcd:
+            write(lane, I, Vx / 100);
+            write(lane, I + 1, (Vx / 10) % 10);
+            write(lane, I + 2, Vx % 10);
+            break;
+         case Kind::Store:
+            for (size_t i = 0; i <= x; ++i)
+            {
+               write(lane, I + i, V[i][lane]);
+            }
+            break;
+         case Kind::Load:
+            for (size_t i = 0; i <= x; ++i)
+            {
+               V[i][lane] = read(lane, (I + i) % std::tuple_size<Memory>::value);
+            }
+            break;
+         case Kind::Unknown:
+         {
+            std::ostringstream message;
+            message << "Unknown opcode " << std::hex << opcode;
+            throw std::invalid_argument(message.str());
+         }
+      }
+
+      lanes.pc[lane] = next;
+      if (--lanes.remaining[lane] == 0)
+      {
+         lanes.pc[lane] |= Retired;
+      }
+   }
+
+   // The memory no lane wrote is the same in all of them, it is read from
+   // the first one so the others are not brought into the cache
+   Register read(size_t lane, size_t address) const
+   {
+      return lanes.memory[written[address] ? lane : 0][address];
+   }
+
+   void write(size_t lane, size_t address, Register value)
+   {
+      address %= std::tuple_size<Memory>::value;
+      lanes.memory[lane][address] = value;
+      written.set(address);
+   }
+
+   // Same clipping and wrapping as the Chip8 display runner
+   void draw(size_t lane, Register Vx, Register Vy, size_t n)
+   {
+      auto& graphics = lanes.graphics[lane];
+      auto x = Vx % ScreenXLimit;
+      auto y = Vy % ScreenYLimit;
+      auto height = std::min<size_t>(n, ScreenYLimit - y);
+      GraphicsRow collision = 0;
+      for (size_t yoffset = 0; yoffset < height; yoffset++)
+      {
+         auto sprite = GraphicsRow(read(lane, (lanes.I[lane] + yoffset) % std::tuple_size<Memory>::value));
+         auto row = sprite << (ScreenXLimit - 8) >> x;
+         auto& graphicsRow = graphics[y + yoffset];
+         collision |= graphicsRow & row;
+         graphicsRow ^= row;
+      }
+      lanes.V[0xF][lane] = collision != 0;
+   }
+
+#ifdef LOCKSTEP_AVX2
+   // Runs the opcode at the lowest program counter in every lane that is
+   // there, until too few lanes are or they may not have the same opcode.
+   // Gives how many opcodes it ran.
+   AVX2 uint64_t runLockstep()
+   {
+      uint64_t lockstep = 0;
+      auto pc = *std::min_element(lanes.pc.begin(), lanes.pc.begin() + count);
+      while (pc < Retired and pc + 1u < std::tuple_size<Memory>::value and
+             not written[pc] and not written[pc + 1])
+      {
+         size_t ran = 0;
+         pc = stepLockstep(pc, ran);
+         lockstep += ran;
+         if (ran * MinLockstepShare < count)
+         {
+            break;
+         }
+      }
+      return lockstep;
+   }
+
+   // Gives the lowest program counter after it
+   AVX2 Counter stepLockstep(Counter pc, size_t& ran)
+   {
+      // No lane wrote there, it is the same opcode in all of them
+      Opcode opcode = lanes.memory[0][pc] << 8 | lanes.memory[0][pc + 1];
+      switch (kinds[opcode])
+      {
+         case Kind::Jump:
+            return runBlocks<JumpLanes>(pc, opcode, ran);
+         case Kind::SkipEqualKk:
+            return runBlocks<SkipIf<EqualBytes, KkLanes>>(pc, opcode, ran);
+         case Kind::SkipNotEqualKk:
+            return runBlocks<SkipIf<NotEqualBytes, KkLanes>>(pc, opcode, ran);
+         case Kind::SkipEqualVy:
+            return runBlocks<SkipIf<EqualBytes, VyLanes>>(pc, opcode, ran);
+         case Kind::SkipNotEqualVy:
+            return runBlocks<SkipIf<NotEqualBytes, VyLanes>>(pc, opcode, ran);
+         case Kind::SetKk:
+            return runBlocks<ToVx<Assign, KkLanes>>(pc, opcode, ran);
+         case Kind::AddKk:
+            return runBlocks<ToVx<AddBytes, KkLanes>>(pc, opcode, ran);
+         case Kind::SetVy:
+            return runBlocks<ToVx<Assign, VyLanes>>(pc, opcode, ran);
+         case Kind::Or:
+            return runBlocks<ToVx<OrBytes, VyLanes>>(pc, opcode, ran);
+         case Kind::And:
+            return runBlocks<ToVx<AndBytes, VyLanes>>(pc, opcode, ran);
+         case Kind::Xor:
+            return runBlocks<ToVx<XorBytes, VyLanes>>(pc, opcode, ran);
+         case Kind::Add:
+            return runBlocks<ToVx<AddBytes, VyLanes>>(pc, opcode, ran);
+         case Kind::Subtract:
+            return runBlocks<ToVxWithFlag<SubtractBytes>>(pc, opcode, ran);
+         case Kind::ShiftRight:
+            return runBlocks<ToVxWithFlag<ShiftRightBytes>>(pc, opcode, ran);
+         case Kind::SubtractNumeric:
+            return runBlocks<ToVxWithFlag<SubtractNumericBytes>>(pc, opcode, ran);
+         case Kind::ShiftLeft:
+            return runBlocks<ToVxWithFlag<ShiftLeftBytes>>(pc, opcode, ran);
+         case Kind::SetI:
+            return runBlocks<SetILanes>(pc, opcode, ran);
+         case Kind::GetDelay:
+            return runBlocks<ToVx<Assign, DelayTimerLanes>>(pc, opcode, ran);
+         case Kind::SetDelay:
+            return runBlocks<SetTimerLanes<&Lanes::delayTimer>>(pc, opcode, ran);
+         case Kind::SetSound:
+            return runBlocks<SetTimerLanes<&Lanes::soundTimer>>(pc, opcode, ran);
+         case Kind::AddI:
+            return runBlocks<AddILanes>(pc, opcode, ran);
+         case Kind::Font:
+            return runBlocks<FontLanes>(pc, opcode, ran);
+         default:
+            return runBlocks<PerLane>(pc, opcode, ran);
+      }
+   }
+
+   // Runs the opcode in the lanes at pc a block at a time, then moves their
+   // program counters and retires the ones done with the slice
+   template<typename Op>
+   AVX2 Counter runBlocks(Counter pc, Opcode opcode, size_t& ran)
+   {
+      const auto at = _mm256_set1_epi16(static_cast<short>(pc));
+      const auto retired = _mm256_set1_epi16(static_cast<short>(Retired));
+      const auto two = _mm256_set1_epi16(2);
+      const auto next = _mm256_set1_epi16(static_cast<short>(Op::flow == Flow::Jump ? opcode & 0x0FFF : pc + 2));
+      auto lowest = _mm256_set1_epi16(-1);
+      for (size_t first = 0; first < lanes.pc.size(); first += LaneBlock)
+      {
+         auto pcs = &lanes.pc[first];
+         auto low = load(pcs);
+         auto high = load(pcs + 16);
+         Active active;
+         active.low = _mm256_cmpeq_epi16(low, at);
+         active.high = _mm256_cmpeq_epi16(high, at);
+         // Packing works within each half, the quadwords are put back in order
+         active.bytes = _mm256_permute4x64_epi64(_mm256_packs_epi16(active.low, active.high), 0xD8);
+         auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(active.bytes));
+         if (mask != 0)
+         {
+            ran += __builtin_popcount(mask);
+            if (Op::flow == Flow::PerLane)
+            {
+               for (; mask != 0; mask &= mask - 1)
+               {
+                  runLane(first + __builtin_ctz(mask), opcode);
+               }
+               low = load(pcs);
+               high = load(pcs + 16);
+            }
+            else
+            {
+               auto skipped = Op::run(lanes, first, opcode, active);
+               auto nextLow = _mm256_add_epi16(next, _mm256_and_si256(widenSigned(skipped, 0), two));
+               auto nextHigh = _mm256_add_epi16(next, _mm256_and_si256(widenSigned(skipped, 1), two));
+               low = _mm256_blendv_epi8(low, nextLow, active.low);
+               high = _mm256_blendv_epi8(high, nextHigh, active.high);
+
+               // The masks are -1 in the active lanes
+               auto remaining = &lanes.remaining[first];
+               auto remainingLow = _mm256_add_epi16(load(remaining), active.low);
+               auto remainingHigh = _mm256_add_epi16(load(remaining + 16), active.high);
+               store(remaining, remainingLow);
+               store(remaining + 16, remainingHigh);
+               auto zero = _mm256_setzero_si256();
+               low = _mm256_or_si256(low, _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi16(remainingLow, zero), active.low), retired));
+               high = _mm256_or_si256(high, _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi16(remainingHigh, zero), active.high), retired));
+               store(pcs, low);
+               store(pcs + 16, high);
+            }
+         }
+         lowest = _mm256_min_epu16(lowest, _mm256_min_epu16(low, high));
+      }
+      auto half = _mm_min_epu16(_mm256_castsi256_si128(lowest), _mm256_extracti128_si256(lowest, 1));
+      return static_cast<Counter>(_mm_cvtsi128_si32(_mm_minpos_epu16(half)));
+   }
+
+   // Masks of bytes to masks of words
+   AVX2 static __m256i widenSigned(__m256i bytes, int half)
+   {
+      return _mm256_cvtepi8_epi16(half == 0 ? _mm256_castsi256_si128(bytes) : _mm256_extracti128_si256(bytes, 1));
+   }
+#endif
+};
+
+Chip8Lockstep::Chip8Lockstep(size_t lanes)
+:pimpl(new Pimpl(lanes))
+{}
+
+Chip8Lockstep::~Chip8Lockstep() = default;
+
+void
+Chip8Lockstep::loadGame(const std::string& name)
+{
+   pimpl->loadGame(*Rom::map(name));
+}
+
+void
+Chip8Lockstep::loadGame(const Rom& rom)
+{
+   pimpl->loadGame(rom);
+}
+
+void
+Chip8Lockstep::setCpuRate(uint32_t rate)
+{
+   pimpl->setCpuRate(rate);
+}
+
+uint32_t
+Chip8Lockstep::getCyclesPerFrame() const
+{
+   return pimpl->getCyclesPerFrame();
+}
+
+void
+Chip8Lockstep::setSeed(size_t lane, uint64_t seed)
+{
+   pimpl->setSeed(lane, seed);
+}
+
+void
+Chip8Lockstep::setVectorized(bool enabled)
+{
+   pimpl->setVectorized(enabled);
+}
+
+void
+Chip8Lockstep::emulateFrame()
+{
+   pimpl->emulateFrame();
+}
+
+void
+Chip8Lockstep::pressKey(size_t lane, Key key)
+{
+   pimpl->pressKey(lane, key);
+}
+
+void
+Chip8Lockstep::releaseKey(size_t lane, Key key)
+{
+   pimpl->releaseKey(lane, key);
+}
+
+const Graphics&
+Chip8Lockstep::getGraphics(size_t lane) const
+{
+   return pimpl->getGraphics(lane);
+}
+
+size_t
+Chip8Lockstep::getLanes() const
+{
+   return pimpl->getLanes();
+}
+
+uint64_t
+Chip8Lockstep::getInstructions() const
+{
+   return pimpl->getInstructions();
+}
+
+uint64_t
+Chip8Lockstep::getLockstepInstructions() const
+{
+   return pimpl->getLockstepInstructions();
+}
+
+bool
+Chip8Lockstep::vectorSupported()
+{
+#ifdef LOCKSTEP_AVX2
+   return __builtin_cpu_supports("avx2");
+#else
+   return false;
+#endif
+}
@@ -0,0 +1,53 @@
+#ifndef _CHIP8LOCKSTEP_H_
+#define _CHIP8LOCKSTEP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "Chip8Types.h"
+
+class Rom;
+
+// Many machines running the same game, each one its own seed and keys, with
+// the same opcode semantics as Chip8.
+//
+// Their registers are stored as structure of arrays, every V0 together and
+// so on, and the lanes that are at the same opcode run it at once with AVX2,
+// 32 lanes per instruction. Once the lanes have gone different ways and
+// only a few would run together, every lane runs on its own until the end
+// of the frame. Hosts without AVX2 always run them on their own.
+class Chip8Lockstep
+{
+public:
+   explicit Chip8Lockstep(size_t lanes);
+   ~Chip8Lockstep();
+   // The same game in every lane
+   void loadGame(const std::string& name);
+   void loadGame(const Rom&);
+   void setCpuRate(uint32_t);
+   uint32_t getCyclesPerFrame() const;
+   // The lanes are seeded with their index unless given a seed
+   void setSeed(size_t lane, uint64_t);
+   // Off runs every lane on its own, to compare
+   void setVectorized(bool);
+   // Runs a frame in every lane
+   void emulateFrame();
+   void pressKey(size_t lane, Key);
+   void releaseKey(size_t lane, Key);
+   const Graphics& getGraphics(size_t lane) const;
+   size_t getLanes() const;
+   // Opcodes run by all the lanes and how many of them in lockstep
+   uint64_t getInstructions() const;
+   uint64_t getLockstepInstructions() const;
+
+   // Whether the host has AVX2, without it there is no lockstep
+   static bool vectorSupported();
+
+private:
+   class Pimpl;
+   std::unique_ptr<Pimpl> pimpl;
+};
+
+#endif // _CHIP8LOCKSTEP_H_
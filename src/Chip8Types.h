@@ -2,7 +2,11 @@
 #define _CHIP8TYPES_HH_
 
 #include <array>
+#include <cstdint>
 #include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
 
 // 16 bits are needed for the opcodes
 using Opcode = uint16_t;
@@ -10,6 +14,9 @@ using Opcode = uint16_t;
 // We have 16 bits addresses
 using Address = uint16_t;
 
+// How an opcode leaves the program counter, see Chip8::opcodeFlow
+enum class OpcodeFlow { Next, Skip, Jump, IndirectJump, Call, Return, Unknown };
+
 // Chip 8 has 8 bits general purpose registers;
 using Register = uint8_t;
 
@@ -19,6 +26,11 @@ using Timer = uint8_t;
 // The Chip 8 has 4K memory in total
 using Memory = std::array<Register, 4096>;
 
+// Games are loaded at it, what is before was the interpreter's and has the
+// font, the rest of the memory is the program area
+const Address ProgramStart = 0x200;
+const size_t MaxRomSize = std::tuple_size<Memory>::value - ProgramStart;
+
 // We don't need std::stack,  it uses dynamic memory;
 using Stack = std::array<Counter, 16>;
 
@@ -27,13 +39,48 @@ using Stack = std::array<Counter, 16>;
 using Registers = std::array<Register, 16>;
 
 
+// The font sprites, 5 bytes per hexadecimal digit, at the start of memory
+const std::array<Register, 80> Fontset =
+{{
+   0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+   0x20, 0x60, 0x20, 0x20, 0x70, // 1
+   0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+   0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+   0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+   0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+   0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+   0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+   0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+   0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+   0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+   0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+   0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+   0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+   0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+   0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+}};
+
 //The graphics of the Chip 8 are black and white and the screen has a total of 2048 pixels (64 x 32).
 const size_t ScreenXLimit = 64;
 const size_t ScreenYLimit = 32;
-using Graphics = std::array<Register, ScreenXLimit * ScreenYLimit>;
+
+// The timers tick at 60 Hz, the emulation runs a frame of opcodes per tick
+const uint32_t FrameRate = 60;
+// Opcodes per second when no cpu rate is given
+const uint32_t DefaultCpuRate = 600;
+
+// One bit per pixel, a row per word with the leftmost pixel at the most
+// significant bit, so a sprite row is drawn with a shift and a XOR.
+using GraphicsRow = uint64_t;
+using Graphics = std::array<GraphicsRow, ScreenYLimit>;
+
+inline bool isPixelSet(const Graphics& graphics, size_t x, size_t y)
+{
+   return (graphics[y] >> (ScreenXLimit - 1 - x)) & 1;
+}
 
 // They key has 16 keys and two states
-enum class KeyState {Pressed, Released};
+enum class KeyState : uint8_t {Pressed, Released};
 enum class Key{
    Num1, Num2, Num3, C,
    Num4, Num5, Num6, D,
@@ -76,6 +123,29 @@ inline std::ostream& operator << (std::ostream& out, const Key& key)
 
 using Keypad = std::array<KeyState, 16>;
 
+// How the opcodes are run, the recompiler translates the hot blocks into
+// native code and is only available on x86-64 hosts.
+enum class Engine {Interpreter, Recompiler};
+
+// Snapshot of the whole machine, see Chip8::saveState
+using SaveState = std::vector<uint8_t>;
+
+// What a Chip8 has run since its game was loaded, only counted when it is
+// built with CHIP8_STATS, see Chip8::getStats
+struct Stats
+{
+   // Opcodes run per kind, named after their runner as "addToV(x, kk)"
+   std::vector<std::pair<std::string, uint64_t>> opcodes;
+   // Opcodes run per address
+   std::array<uint64_t, std::tuple_size<Memory>::value> pcs = {{}};
+   // Skip opcodes that did skip
+   uint64_t skips = 0;
+   uint64_t draws = 0;
+   // Frames each timer was running in
+   uint64_t delayTicks = 0;
+   uint64_t soundTicks = 0;
+};
+
 
 
 #endif // _CHIP8TYPES_HH_
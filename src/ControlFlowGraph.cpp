@@ -0,0 +1,270 @@
+#include "ControlFlowGraph.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+
+#include "Chip8.h"
+#include "Disassembler.h"
+#include "Rom.h"
+
+namespace
+{
+   using Edge = ControlFlowGraph::Edge;
+   using EdgeKind = ControlFlowGraph::EdgeKind;
+
+   // Empty for the opcodes whose destination is not known
+   std::vector<Edge> successors(Address address, Opcode opcode, OpcodeFlow flow)
+   {
+      auto next = static_cast<Address>(address + 2);
+      auto nnn = static_cast<Address>(opcode & 0x0FFF);
+      switch (flow)
+      {
+         case OpcodeFlow::Next:
+            return {Edge{next, EdgeKind::Next}};
+         case OpcodeFlow::Skip:
+            return {Edge{next, EdgeKind::Next}, Edge{static_cast<Address>(address + 4), EdgeKind::Skip}};
+         case OpcodeFlow::Jump:
+            return {Edge{nnn, EdgeKind::Jump}};
+         case OpcodeFlow::Call:
+            return {Edge{nnn, EdgeKind::Call}, Edge{next, EdgeKind::Next}};
+         default:
+            return {};
+      }
+   }
+
+   const char* kindName(EdgeKind kind)
+   {
+      switch (kind)
+      {
+         case EdgeKind::Next: return "next";
+         case EdgeKind::Skip: return "skip";
+         case EdgeKind::Jump: return "jump";
+         default: return "call";
+      }
+   }
+
+   std::string hex(unsigned value, int digits)
+   {
+      std::ostringstream out;
+      out << std::uppercase << std::hex << std::setw(digits) << std::setfill('0') << value;
+      return out.str();
+   }
+
+   Opcode fetch(const Memory& memory, Address address)
+   {
+      return memory[address] << 8 | memory[address + 1];
+   }
+}
+
+ControlFlowGraph
+ControlFlowGraph::build(const Rom& rom)
+{
+   ControlFlowGraph graph;
+   graph.memory.fill(0);
+   std::memcpy(graph.memory.data() + ProgramStart, rom.data(), rom.size());
+   graph.romSize = rom.size();
+   size_t end = ProgramStart + rom.size();
+   auto inProgram = [&](size_t address) { return address >= ProgramStart and address + 2 <= end; };
+
+   // Where opcodes start, they may overlap when code jumps to odd addresses
+   std::vector<bool> starts(graph.memory.size()), leaders(graph.memory.size()), code(graph.memory.size());
+   std::vector<Address> pending{ProgramStart};
+   leaders[ProgramStart] = true;
+   while (not pending.empty())
+   {
+      auto address = pending.back();
+      pending.pop_back();
+      if (not inProgram(address) or starts[address])
+      {
+         continue;
+      }
+      starts[address] = true;
+      code[address] = code[address + 1] = true;
+      auto opcode = fetch(graph.memory, address);
+      auto flow = Chip8::opcodeFlow(opcode);
+      for (const auto& edge : successors(address, opcode, flow))
+      {
+         // Skips and jumps past the end of the program lead nowhere
+         if (flow != OpcodeFlow::Next and inProgram(edge.to))
+         {
+            leaders[edge.to] = true;
+         }
+         pending.push_back(edge.to);
+      }
+   }
+
+   for (size_t start = ProgramStart; start < end; ++start)
+   {
+      if (not starts[start] or not leaders[start])
+      {
+         continue;
+      }
+      Block block{static_cast<Address>(start), static_cast<Address>(start), OpcodeFlow::Next, {}};
+      while (true)
+      {
+         auto opcode = fetch(graph.memory, block.end);
+         block.exit = Chip8::opcodeFlow(opcode);
+         block.successors = successors(block.end, opcode, block.exit);
+         block.end += 2;
+         if (block.exit != OpcodeFlow::Next or block.end >= end or not starts[block.end] or leaders[block.end])
+         {
+            break;
+         }
+      }
+      graph.blocks.push_back(block);
+   }
+
+   for (size_t address = ProgramStart; address < end; ++address)
+   {
+      if (code[address])
+      {
+         continue;
+      }
+      if (graph.data.empty() or graph.data.back().end != address)
+      {
+         graph.data.push_back(DataRegion{static_cast<Address>(address), static_cast<Address>(address)});
+      }
+      ++graph.data.back().end;
+   }
+   return graph;
+}
+
+const std::vector<ControlFlowGraph::Block>&
+ControlFlowGraph::getBlocks() const
+{
+   return blocks;
+}
+
+const std::vector<ControlFlowGraph::DataRegion>&
+ControlFlowGraph::getData() const
+{
+   return data;
+}
+
+std::vector<Address>
+ControlFlowGraph::leaders() const
+{
+   std::vector<Address> starts;
+   for (const auto& block : blocks)
+   {
+      starts.push_back(block.start);
+   }
+   return starts;
+}
+
+size_t
+ControlFlowGraph::codeBytes() const
+{
+   size_t bytes = romSize;
+   for (const auto& region : data)
+   {
+      bytes -= region.end - region.start;
+   }
+   return bytes;
+}
+
+size_t
+ControlFlowGraph::indirectJumps() const
+{
+   return std::count_if(blocks.begin(), blocks.end(),
+                        [](const Block& block) { return block.exit == OpcodeFlow::IndirectJump; });
+}
+
+void
+ControlFlowGraph::printText(std::ostream& out) const
+{
+   auto block = blocks.begin();
+   auto region = data.begin();
+   while (block != blocks.end() or region != data.end())
+   {
+      if (region == data.end() or (block != blocks.end() and block->start < region->start))
+      {
+         out << "0x" << hex(block->start, 3) << "  block";
+         for (const auto& edge : block->successors)
+         {
+            out << ", " << kindName(edge.kind) << " 0x" << hex(edge.to, 3);
+         }
+         if (block->exit == OpcodeFlow::IndirectJump)
+         {
+            out << ", indirect jump";
+         }
+         else if (block->exit == OpcodeFlow::Return)
+         {
+            out << ", return";
+         }
+         else if (block->exit == OpcodeFlow::Unknown)
+         {
+            out << ", unknown opcode";
+         }
+         out << '\n';
+         for (auto address = block->start; address < block->end; address += 2)
+         {
+            auto opcode = fetch(memory, address);
+            out << "  0x" << hex(address, 3) << "  " << hex(opcode, 4) << "  " << disassemble(opcode) << '\n';
+         }
+         ++block;
+      }
+      else
+      {
+         out << "0x" << hex(region->start, 3) << "  data, " << region->end - region->start << " bytes\n";
+         for (auto address = region->start; address < region->end; address += 8)
+         {
+            out << "  0x" << hex(address, 3) << " ";
+            for (auto byte = address; byte < std::min<size_t>(address + 8, region->end); ++byte)
+            {
+               out << ' ' << hex(memory[byte], 2);
+            }
+            out << '\n';
+         }
+         ++region;
+      }
+   }
+}
+
+void
+ControlFlowGraph::printDot(std::ostream& out) const
+{
+   out << "digraph rom\n{\n   node [shape=box, fontname=\"monospace\"];\n";
+   std::vector<Address> outside;
+   for (const auto& block : blocks)
+   {
+      out << "   b" << hex(block.start, 3) << " [label=\"0x" << hex(block.start, 3) << "\\l";
+      for (auto address = block.start; address < block.end; address += 2)
+      {
+         out << disassemble(fetch(memory, address)) << "\\l";
+      }
+      out << '"';
+      if (block.exit == OpcodeFlow::IndirectJump or block.exit == OpcodeFlow::Unknown)
+      {
+         out << ", color=red";
+      }
+      out << "];\n";
+      for (const auto& edge : block.successors)
+      {
+         if (edge.to < ProgramStart or edge.to + 2u > ProgramStart + romSize)
+         {
+            outside.push_back(edge.to);
+         }
+         out << "   b" << hex(block.start, 3) << " -> b" << hex(edge.to, 3);
+         if (edge.kind == EdgeKind::Call)
+         {
+            out << " [style=dashed]";
+         }
+         else if (edge.kind == EdgeKind::Skip)
+         {
+            out << " [label=\"skip\"]";
+         }
+         out << ";\n";
+      }
+   }
+   std::sort(outside.begin(), outside.end());
+   outside.erase(std::unique(outside.begin(), outside.end()), outside.end());
+   for (auto address : outside)
+   {
+      out << "   b" << hex(address, 3) << " [shape=ellipse, label=\"0x" << hex(address, 3) << " outside\"];\n";
+   }
+   out << "}\n";
+}
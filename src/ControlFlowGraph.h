@@ -0,0 +1,76 @@
+#ifndef _CONTROLFLOWGRAPH_H_
+#define _CONTROLFLOWGRAPH_H_
+
+#include <cstddef>
+#include <iosfwd>
+#include <vector>
+
+#include "Chip8Types.h"
+
+class Rom;
+
+// The program of a ROM found statically: its opcodes are followed from
+// ProgramStart through jumps, calls and skips, and split in basic blocks, a
+// leader and the opcodes up to the next leader or the one that leaves it.
+// Opcodes are classified by Chip8::opcodeFlow, so the graph decodes them
+// exactly as the emulator does.
+//
+// JP V0, nnn jumps where V0 says, the blocks ending in one have no known
+// successors and whatever they reach shows up as data, as do the sprites.
+// Returns are assumed to go back after their call.
+class ControlFlowGraph
+{
+public:
+   enum class EdgeKind { Next, Skip, Jump, Call };
+
+   struct Edge
+   {
+      Address to;
+      EdgeKind kind;
+   };
+
+   struct Block
+   {
+      Address start;
+      // Past its last opcode
+      Address end;
+      // How its last opcode leaves it
+      OpcodeFlow exit;
+      // To outside the program too, they are not followed
+      std::vector<Edge> successors;
+   };
+
+   // Bytes of the program no opcode was found at
+   struct DataRegion
+   {
+      Address start;
+      Address end;
+   };
+
+   static ControlFlowGraph build(const Rom&);
+
+   // By address
+   const std::vector<Block>& getBlocks() const;
+   const std::vector<DataRegion>& getData() const;
+   // Where the blocks start, to seed Chip8::predecode or any other cache of
+   // decoded opcodes
+   std::vector<Address> leaders() const;
+   size_t codeBytes() const;
+   size_t indirectJumps() const;
+
+   // The blocks with their disassembly and the data in hexadecimal, in
+   // address order
+   void printText(std::ostream&) const;
+   // A Graphviz digraph of the blocks
+   void printDot(std::ostream&) const;
+
+private:
+   ControlFlowGraph() = default;
+
+   Memory memory;
+   size_t romSize = 0;
+   std::vector<Block> blocks;
+   std::vector<DataRegion> data;
+};
+
+#endif // _CONTROLFLOWGRAPH_H_
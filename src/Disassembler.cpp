@@ -0,0 +1,113 @@
+#include "Disassembler.h"
+
+#include <iomanip>
+#include <sstream>
+
+#include "Chip8.h"
+
+namespace
+{
+   std::string hex(unsigned value, int digits)
+   {
+      std::ostringstream out;
+      out << "0x" << std::uppercase << std::hex << std::setw(digits) << std::setfill('0') << value;
+      return out.str();
+   }
+
+   std::string V(unsigned index)
+   {
+      std::ostringstream out;
+      out << 'V' << std::uppercase << std::hex << index;
+      return out.str();
+   }
+}
+
+std::string
+disassemble(Opcode opcode)
+{
+   auto x = (opcode & 0x0F00) >> 8;
+   auto y = (opcode & 0x00F0) >> 4;
+   auto n = opcode & 0x000F;
+   auto kk = hex(opcode & 0x00FF, 2);
+   auto nnn = hex(opcode & 0x0FFF, 3);
+   auto unknown = "DW " + hex(opcode, 4);
+   if (Chip8::opcodeFlow(opcode) == OpcodeFlow::Unknown)
+   {
+      return unknown;
+   }
+
+   // Only the bytes and nibbles Chip8 decodes are looked at, 0x01E0 is CLS
+   // there too
+   switch (opcode >> 12)
+   {
+      case 0x0:
+         if ((opcode & 0x00FF) == 0xE0)
+         {
+            return "CLS";
+         }
+         if ((opcode & 0x00FF) == 0xEE)
+         {
+            return "RET";
+         }
+         return unknown;
+      case 0x1:
+         return "JP " + nnn;
+      case 0x2:
+         return "CALL " + nnn;
+      case 0x3:
+         return "SE " + V(x) + ", " + kk;
+      case 0x4:
+         return "SNE " + V(x) + ", " + kk;
+      case 0x5:
+         return "SE " + V(x) + ", " + V(y);
+      case 0x6:
+         return "LD " + V(x) + ", " + kk;
+      case 0x7:
+         return "ADD " + V(x) + ", " + kk;
+      case 0x8:
+         switch (n)
+         {
+            case 0x0: return "LD " + V(x) + ", " + V(y);
+            case 0x1: return "OR " + V(x) + ", " + V(y);
+            case 0x2: return "AND " + V(x) + ", " + V(y);
+            case 0x3: return "XOR " + V(x) + ", " + V(y);
+            case 0x4: return "ADD " + V(x) + ", " + V(y);
+            case 0x5: return "SUB " + V(x) + ", " + V(y);
+            case 0x6: return "SHR " + V(x);
+            case 0x7: return "SUBN " + V(x) + ", " + V(y);
+            case 0xE: return "SHL " + V(x);
+            default: return unknown;
+         }
+      case 0x9:
+         return "SNE " + V(x) + ", " + V(y);
+      case 0xA:
+         return "LD I, " + nnn;
+      case 0xB:
+         return "JP V0, " + nnn;
+      case 0xC:
+         return "RND " + V(x) + ", " + kk;
+      case 0xD:
+         return "DRW " + V(x) + ", " + V(y) + ", " + std::to_string(n);
+      case 0xE:
+         switch (opcode & 0x00FF)
+         {
+            case 0x9E: return "SKP " + V(x);
+            case 0xA1: return "SKNP " + V(x);
+            default: return unknown;
+         }
+      default:
+         switch (opcode & 0x00FF)
+         {
+            case 0x07: return "LD " + V(x) + ", DT";
+            case 0x0A: return "LD " + V(x) + ", K";
+            case 0x15: return "LD DT, " + V(x);
+            case 0x18: return "LD ST, " + V(x);
+            case 0x1E: return "ADD I, " + V(x);
+            case 0x29: return "LD F, " + V(x);
+            case 0x33: return "LD B, " + V(x);
+            case 0x55: return "LD [I], " + V(x);
+            case 0x65: return "LD " + V(x) + ", [I]";
+            default: return unknown;
+         }
+   }
+}
@@ -0,0 +1,13 @@
+#ifndef _DISASSEMBLER_H_
+#define _DISASSEMBLER_H_
+
+#include <string>
+
+#include "Chip8Types.h"
+
+// The opcode in the usual assembler syntax, "ADD V1, 0x02" and so on, decoded
+// as Chip8 does, the opcodes its dispatch table has no runner for are
+// "DW 0x1234"
+std::string disassemble(Opcode opcode);
+
+#endif // _DISASSEMBLER_H_
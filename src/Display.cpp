@@ -1,38 +1,65 @@
 #include "Display.h"
 
 #include <array>
-#include <ctime>
-#include <iostream>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+
+const char* const Display::Title = "Chip-8 emulator";
 
 Display::Display()
-:window(sf::VideoMode::getFullscreenModes()[0], "Chip-8 emulator")
-,pixelHigh(window.getSize().y /ScreenYLimit)
-,pixelWidth(window.getSize().x / ScreenXLimit)
+:window(sf::VideoMode::getFullscreenModes()[0], Title)
+{
+   fitScreen(window.getSize().x, window.getSize().y);
+}
+
+void
+Display::drawGraphics(const Graphics& graphics)
+{
+   postProcess.process(graphics);
+   screenTexture.update(postProcess.getPixels());
+   window.draw(screen);
+}
+
+void
+Display::setPostProcessing(PostProcess::Scaler scaler, uint8_t persistence)
 {
-   if (not beepBuffer.loadFromFile("beep.wav"))
+   postProcess.setScaler(scaler);
+   postProcess.setPersistence(persistence);
+   fitScreen(window.getSize().x, window.getSize().y);
+}
+
+void
+Display::fitScreen(unsigned width, unsigned height)
+{
+   postProcess.setOutputSize(width, height);
+   if (not screenTexture.create(postProcess.getWidth(), postProcess.getHeight()))
    {
-      throw std::runtime_error("Beep wav file not found");
+      throw std::runtime_error("Cannot create the screen texture");
    }
-   beep.setBuffer(beepBuffer);
+   screen.setTexture(screenTexture, true);
+   screen.setPosition((static_cast<float>(width) - postProcess.getWidth()) / 2,
+                      (static_cast<float>(height) - postProcess.getHeight()) / 2);
 }
 
 void
-Display::drawPixel(size_t x, size_t y)
+Display::setTitle(const std::string& title)
 {
-   sf::RectangleShape rectangle(sf::Vector2f(pixelWidth, pixelHigh));
-   rectangle.setPosition(x * pixelWidth, y * pixelHigh);
-   rectangle.setFillColor(sf::Color::Green);  
-   window.draw(rectangle);
+   window.setTitle(title);
 }
 
 void
-Display::loop(CycleCallback doCycle, 
+Display::loop(FrameCallback doFrame, 
               DrawingCallback doDrawing, 
               KeyboardCallbacks keyboard, 
               TouchpadCallbacks touchpad
 )
 {
+   using Clock = std::chrono::steady_clock;
+   const auto frameTime = std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(1)) / FrameRate;
+
    sf::View view = window.getDefaultView();
+   auto nextFrame = Clock::now();
    while (window.isOpen())
    {
       sf::Event event;
@@ -47,6 +74,7 @@ Display::loop(CycleCallback doCycle,
             view.setSize(event.size.width, event.size.height);
             view.setCenter(event.size.width/2, event.size.height/2);
             window.setView(view);
+            fitScreen(event.size.width, event.size.height);
          }
          else if (event.type == sf::Event::KeyPressed)
          {
@@ -70,21 +98,24 @@ Display::loop(CycleCallback doCycle,
          }
       }
       
-      bool drawNeeded = false;
-      bool beepNeeded = false;
-      std::tie(drawNeeded, beepNeeded) = doCycle();
-      if (drawNeeded)
+      if (doFrame() or not postProcess.isSettled())
       {
          window.clear(sf::Color::Black);
-         vertexArray.clear();
          doDrawing();
-         window.draw(vertexArray);
          window.display();
       }
-      if(beepNeeded)
-      { 
-         std::cout << "BEEP !!!" << std::endl;
-         beep.play();
+
+      // Sleeping until a deadline instead of a frame time keeps the rate
+      // steady, after a stall it starts over instead of catching up
+      nextFrame += frameTime;
+      auto now = Clock::now();
+      if (nextFrame < now)
+      {
+         nextFrame = now;
+      }
+      else
+      {
+         std::this_thread::sleep_until(nextFrame);
       }
    }
 }
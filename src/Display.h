@@ -2,16 +2,19 @@
 #define _DISPLAY_H_
 
 #include <SFML/Graphics.hpp>
-#include <SFML/Audio.hpp>
 
+#include <array>
 #include <functional>
+#include <string>
 
 #include "Chip8Types.h"
+#include "PostProcess.h"
 
 class Display
 {
 public:
-   using CycleCallback = std::function<std::pair<bool, bool>(void)>;
+   // Gets the newest frame, it returns whether it has to be drawn
+   using FrameCallback = std::function<bool(void)>;
    using DrawingCallback = std::function<void(void)>;
    struct KeyboardCallbacks
    {
@@ -28,20 +31,31 @@ public:
 
    Display();
 
-   void drawPixel(size_t x, size_t y);
+   // The window title it starts with
+   static const char* const Title;
+
+   // The whole screen is post processed, uploaded as a texture and drawn
+   // at once
+   void drawGraphics(const Graphics& graphics);
+   void setPostProcessing(PostProcess::Scaler scaler, uint8_t persistence);
+   // Of the window, for what the screen itself doesn't show
+   void setTitle(const std::string& title);
+   // FrameRate times a second it polls the events, gets a frame and
+   // presents it if needed, or while the previous one is still fading
    void loop(
-         CycleCallback,
+         FrameCallback,
          DrawingCallback,
          KeyboardCallbacks,
          TouchpadCallbacks
    );
 private:
+   // The image is made for the window and centered in it
+   void fitScreen(unsigned width, unsigned height);
+
    sf::RenderWindow window;
-   sf::VertexArray vertexArray;
-   sf::SoundBuffer beepBuffer;
-   sf::Sound beep;
-   float pixelHigh;
-   float pixelWidth;
+   PostProcess postProcess;
+   sf::Texture screenTexture;
+   sf::Sprite screen;
 };
 
 #endif // _DISPLAY_H_
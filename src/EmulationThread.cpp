@@ -0,0 +1,350 @@
+#include "EmulationThread.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+
+EmulationThread::EmulationThread(Chip8& chip8)
+:chip8(chip8)
+,running(false)
+,rewinding(false)
+,speed(1)
+,movie(nullptr)
+,frameCount(0)
+,rewind(RewindSeconds * FrameRate)
+{
+   frames.backBuffer() = chip8.getGraphics();
+   frames.publish();
+}
+
+EmulationThread::~EmulationThread()
+{
+   stop();
+}
+
+void
+EmulationThread::start()
+{
+   if (not thread.joinable())
+   {
+      running = true;
+      thread = std::thread(&EmulationThread::run, this);
+   }
+}
+
+void
+EmulationThread::stop()
+{
+   running = false;
+   wakeUp();
+   if (thread.joinable())
+   {
+      thread.join();
+   }
+   if (movie)
+   {
+      movie->frames = frameCount;
+   }
+}
+
+void
+EmulationThread::pressKey(Key key)
+{
+   input.push(InputEvent{Clock::now(), key, KeyState::Pressed});
+   wakeUp();
+}
+
+void
+EmulationThread::releaseKey(Key key)
+{
+   input.push(InputEvent{Clock::now(), key, KeyState::Released});
+   wakeUp();
+}
+
+bool
+EmulationThread::newFrame()
+{
+   return frames.update();
+}
+
+const Graphics&
+EmulationThread::getGraphics() const
+{
+   return frames.frontBuffer();
+}
+
+void
+EmulationThread::saveState(const std::string& file)
+{
+   commands.push(Command{Command::SaveState, file});
+   wakeUp();
+}
+
+void
+EmulationThread::loadState(const std::string& file)
+{
+   commands.push(Command{Command::LoadState, file});
+   wakeUp();
+}
+
+void
+EmulationThread::setRewinding(bool enabled)
+{
+   rewinding = enabled;
+   wakeUp();
+}
+
+void
+EmulationThread::setSound(SoundCallback callback)
+{
+   sound = callback;
+}
+
+void
+EmulationThread::record(Movie* recording)
+{
+   movie = recording;
+}
+
+void
+EmulationThread::traceTo(const std::string& file)
+{
+   traceFile = file;
+}
+
+void
+EmulationThread::dumpTrace()
+{
+   commands.push(Command{Command::DumpTrace, traceFile});
+   wakeUp();
+}
+
+const Rewind&
+EmulationThread::getRewind() const
+{
+   return rewind;
+}
+
+void
+EmulationThread::setSpeed(uint32_t multiple)
+{
+   speed.store(multiple, std::memory_order_relaxed);
+}
+
+uint64_t
+EmulationThread::getFramesRun() const
+{
+   return frameCount.load(std::memory_order_relaxed);
+}
+
+void
+EmulationThread::run()
+{
+   const auto frameTime = std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(1)) / FrameRate;
+
+   auto nextFrame = Clock::now();
+   uint32_t framesThisTick = 0;
+   try
+   {
+      while (running)
+      {
+         runCommands();
+         if (rewinding and not movie)
+         {
+            stepBack();
+         }
+         else
+         {
+            drainInput(nextFrame);
+            chip8.emulateFrame();
+            frameCount.fetch_add(1, std::memory_order_relaxed);
+            rewind.push(chip8.saveState());
+            if (chip8.drawNeeded())
+            {
+               frames.backBuffer() = chip8.getGraphics();
+               frames.publish();
+            }
+            if (sound and speed.load(std::memory_order_relaxed) == 1)
+            {
+               sound(chip8.soundOn());
+            }
+         }
+
+         if (chip8.waitingForKey() and not rewinding)
+         {
+            waitForEvents();
+            // The frames slept through are not made up for
+            nextFrame = Clock::now();
+            continue;
+         }
+
+         // Faster than real time the frames run back to back, the input is
+         // applied as it comes when uncapped
+         auto multiple = speed.load(std::memory_order_relaxed);
+         if (multiple == Uncapped)
+         {
+            nextFrame = Clock::now();
+            continue;
+         }
+         if (++framesThisTick < multiple)
+         {
+            continue;
+         }
+         framesThisTick = 0;
+
+         // Same pacing as the renderer, but a slow present doesn't delay it
+         nextFrame += frameTime;
+         auto now = Clock::now();
+         if (nextFrame < now)
+         {
+            nextFrame = now;
+         }
+         else
+         {
+            std::this_thread::sleep_until(nextFrame);
+         }
+      }
+   }
+   catch (const std::exception& e)
+   {
+      // The last frame stays on the screen
+      std::cerr << "Emulation stopped: " << e.what() << std::endl;
+      if (not traceFile.empty())
+      {
+         writeTrace();
+      }
+   }
+}
+
+// Events newer than the frame wait for the next one, and so does a release of
+// a key pressed in this frame, otherwise a short tap would never be seen.
+void
+EmulationThread::drainInput(Clock::time_point frame)
+{
+   std::array<bool, 16> pressed{};
+   InputEvent event;
+   while (input.front(event) and event.time <= frame)
+   {
+      auto index = static_cast<size_t>(event.key);
+      if (event.state == KeyState::Pressed)
+      {
+         chip8.pressKey(event.key);
+         pressed[index] = true;
+      }
+      else if (pressed[index])
+      {
+         break;
+      }
+      else
+      {
+         chip8.releaseKey(event.key);
+      }
+      if (movie)
+      {
+         movie->events.push_back(Movie::Event{frameCount, event.key, event.state});
+      }
+      input.pop();
+   }
+}
+
+void
+EmulationThread::runCommands()
+{
+   Command command;
+   while (commands.front(command))
+   {
+      commands.pop();
+      try
+      {
+         if (command.action == Command::SaveState)
+         {
+            auto state = chip8.saveState();
+            std::ofstream file(command.file, std::ios::binary);
+            if (not file.write(reinterpret_cast<const char*>(state.data()), state.size()))
+            {
+               throw std::runtime_error(std::string("Cannot write ") + command.file);
+            }
+         }
+         else if (command.action == Command::DumpTrace)
+         {
+            if (not command.file.empty())
+            {
+               writeTrace();
+            }
+         }
+         else if (movie)
+         {
+            throw std::invalid_argument("Cannot load states while recording");
+         }
+         else
+         {
+            std::ifstream file(command.file, std::ios::binary);
+            if (not file.is_open())
+            {
+               throw std::invalid_argument(std::string("Cannot open ") + command.file);
+            }
+            SaveState state((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            chip8.loadState(state);
+            // The history is of another timeline
+            rewind.clear();
+            rewind.push(state);
+            // It may not draw for a while, the restored screen is shown now
+            frames.backBuffer() = chip8.getGraphics();
+            frames.publish();
+         }
+      }
+      catch (const std::exception& e)
+      {
+         std::cerr << "Save state failed: " << e.what() << std::endl;
+      }
+   }
+}
+
+// The events are pushed before waking it up, so it can't miss the last one
+void
+EmulationThread::waitForEvents()
+{
+   std::unique_lock<std::mutex> lock(wakeMutex);
+   wake.wait(lock, [this]
+   {
+      InputEvent event;
+      Command command;
+      return not running or rewinding or input.front(event) or commands.front(command);
+   });
+}
+
+void
+EmulationThread::wakeUp()
+{
+   std::lock_guard<std::mutex> lock(wakeMutex);
+   wake.notify_one();
+}
+
+void
+EmulationThread::stepBack()
+{
+   SaveState state;
+   if (rewind.stepBack(state))
+   {
+      chip8.loadState(state);
+      frames.backBuffer() = chip8.getGraphics();
+      frames.publish();
+   }
+}
+
+void
+EmulationThread::writeTrace()
+{
+   try
+   {
+      auto trace = chip8.getTrace();
+      trace.save(traceFile);
+      std::cerr << "Traced the last " << trace.entries.size() << " opcodes to " << traceFile << std::endl;
+   }
+   catch (const std::exception& e)
+   {
+      std::cerr << "Trace failed: " << e.what() << std::endl;
+   }
+}
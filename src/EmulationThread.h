@@ -0,0 +1,130 @@
+#ifndef _EMULATIONTHREAD_H_
+#define _EMULATIONTHREAD_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "Chip8.h"
+#include "Movie.h"
+#include "Rewind.h"
+#include "RingBuffer.h"
+#include "TripleBuffer.h"
+
+// Runs a Chip8 on its own thread, FrameRate frames a second, so the emulation
+// speed doesn't depend on how long the renderer takes to present.
+//
+// The frames drawn are handed to the renderer through a triple buffer and the
+// keys pressed in the renderer thread are queued with the time they happened
+// at, the queue is drained before every frame up to the time the frame is
+// due. The Chip8 is not to be used by anyone else while it runs.
+//
+// Every frame is recorded for rewinding, while rewinding it steps a frame
+// back instead of running one.
+//
+// After every frame the sound callback is told whether the tone is on, so the
+// sound starts and stops with the frames.
+//
+// It can run faster than real time, several frames per frame due or as many
+// as the host can; the renderer still presents only the newest frame FrameRate
+// times a second, and the sound is dropped meanwhile so it doesn't pile up.
+//
+// While the game waits for a key at Fx0A the frames would change nothing, the
+// thread sleeps until there is an event or a command instead of running them.
+//
+// When tracing, the trace is dumped to the trace file on demand and when the
+// emulation stops on an error.
+//
+// When recording, the key events are added to the movie stamped with the
+// frame they were applied before. Loading states and rewinding would make the
+// movie impossible to replay, they are ignored meanwhile.
+class EmulationThread
+{
+public:
+   // From the emulation thread, whether the tone is on for the frame
+   using SoundCallback = std::function<void(bool)>;
+
+   explicit EmulationThread(Chip8& chip8);
+   ~EmulationThread();
+   EmulationThread(const EmulationThread&) = delete;
+   EmulationThread& operator=(const EmulationThread&) = delete;
+
+   void start();
+   void stop();
+
+   // From the renderer thread, the event is dropped if the queue is full
+   void pressKey(Key);
+   void releaseKey(Key);
+   // True when there is a frame newer than the one in getGraphics
+   bool newFrame();
+   const Graphics& getGraphics() const;
+   // Queued as the keys are, errors are only reported
+   void saveState(const std::string& file);
+   void loadState(const std::string& file);
+   void setRewinding(bool);
+   // Before starting
+   void setSound(SoundCallback);
+   // Before starting, the movie is only to be looked at once stopped
+   void record(Movie* movie);
+   // Before starting, the Chip8 has to be tracing
+   void traceTo(const std::string& file);
+   // Queued as the keys are, errors are only reported
+   void dumpTrace();
+   // Only to be looked at once stopped
+   const Rewind& getRewind() const;
+   // Frames run per frame due, 1 is real time and Uncapped as many as it can
+   void setSpeed(uint32_t multiple);
+   // From any thread, to measure the speed
+   uint64_t getFramesRun() const;
+
+   static const uint32_t Uncapped = 0;
+
+   static const size_t RewindSeconds = 300;
+
+private:
+   using Clock = std::chrono::steady_clock;
+
+   struct InputEvent
+   {
+      Clock::time_point time;
+      Key key;
+      KeyState state;
+   };
+
+   struct Command
+   {
+      enum {SaveState, LoadState, DumpTrace} action;
+      std::string file;
+   };
+
+   void run();
+   void drainInput(Clock::time_point frame);
+   void runCommands();
+   void stepBack();
+   void writeTrace();
+   void waitForEvents();
+   void wakeUp();
+
+   Chip8& chip8;
+   std::thread thread;
+   std::atomic<bool> running;
+   std::atomic<bool> rewinding;
+   std::atomic<uint32_t> speed;
+   SoundCallback sound;
+   Movie* movie;
+   std::string traceFile;
+   std::atomic<uint64_t> frameCount;
+   RingBuffer<InputEvent, 64> input;
+   RingBuffer<Command, 8> commands;
+   TripleBuffer<Graphics> frames;
+   Rewind rewind;
+   std::mutex wakeMutex;
+   std::condition_variable wake;
+};
+
+#endif // _EMULATIONTHREAD_H_
@@ -0,0 +1,165 @@
+#include "Movie.h"
+
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+namespace
+{
+   const uint32_t MovieMagic = 0x564D3843; // "C8MV"
+   const uint32_t MovieVersion = 1;
+   const uint8_t EndMark = 0xFF;
+   const uint8_t Released = 0x10;
+
+   void writeInteger(std::vector<uint8_t>& out, uint64_t value, size_t bytes)
+   {
+      for (size_t i = 0; i < bytes; ++i)
+      {
+         out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+      }
+   }
+
+   void writeLength(std::vector<uint8_t>& out, uint64_t value)
+   {
+      while (value >= 0x80)
+      {
+         out.push_back(static_cast<uint8_t>(value) | 0x80);
+         value >>= 7;
+      }
+      out.push_back(static_cast<uint8_t>(value));
+   }
+
+   class Reader
+   {
+   public:
+      explicit Reader(const std::vector<uint8_t>& bytes)
+      :bytes(bytes)
+      ,position(0)
+      {}
+
+      uint8_t byte()
+      {
+         if (position == bytes.size())
+         {
+            throw std::invalid_argument("Truncated movie");
+         }
+         return bytes[position++];
+      }
+
+      uint64_t integer(size_t size)
+      {
+         uint64_t value = 0;
+         for (size_t i = 0; i < size; ++i)
+         {
+            value |= static_cast<uint64_t>(byte()) << (8 * i);
+         }
+         return value;
+      }
+
+      uint64_t length()
+      {
+         uint64_t value = 0;
+         for (size_t shift = 0; shift < 64; shift += 7)
+         {
+            auto next = byte();
+            value |= static_cast<uint64_t>(next & 0x7F) << shift;
+            if (not (next & 0x80))
+            {
+               return value;
+            }
+         }
+         throw std::invalid_argument("Invalid movie length");
+      }
+
+   private:
+      const std::vector<uint8_t>& bytes;
+      size_t position;
+   };
+}
+
+void
+Movie::save(const std::string& file) const
+{
+   std::vector<uint8_t> bytes;
+   writeInteger(bytes, MovieMagic, 4);
+   writeInteger(bytes, MovieVersion, 4);
+   writeInteger(bytes, seed, 8);
+   writeInteger(bytes, cpuRate, 4);
+   writeInteger(bytes, romHash, 8);
+
+   uint64_t frame = 0;
+   for (const auto& event : events)
+   {
+      writeLength(bytes, event.frame - frame);
+      bytes.push_back(static_cast<uint8_t>(event.key) | (event.state == KeyState::Released ? Released : 0));
+      frame = event.frame;
+   }
+   writeLength(bytes, frames - frame);
+   bytes.push_back(EndMark);
+   writeInteger(bytes, finalHash, 8);
+
+   std::ofstream out(file, std::ios::binary);
+   if (not out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size()))
+   {
+      throw std::runtime_error(std::string("Cannot write movie ") + file);
+   }
+}
+
+Movie
+Movie::load(const std::string& file)
+{
+   std::ifstream in(file, std::ios::binary);
+   if (not in.is_open())
+   {
+      throw std::invalid_argument(std::string("Cannot open movie ") + file);
+   }
+   std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+   Reader reader(bytes);
+   if (reader.integer(4) != MovieMagic or reader.integer(4) != MovieVersion)
+   {
+      throw std::invalid_argument(std::string("Not a movie of this version ") + file);
+   }
+   Movie movie;
+   movie.seed = reader.integer(8);
+   movie.cpuRate = static_cast<uint32_t>(reader.integer(4));
+   movie.romHash = reader.integer(8);
+
+   uint64_t frame = 0;
+   while (true)
+   {
+      frame += reader.length();
+      auto code = reader.byte();
+      if (code == EndMark)
+      {
+         break;
+      }
+      if (code & ~(Released | 0x0F))
+      {
+         throw std::invalid_argument("Invalid movie event");
+      }
+      movie.events.push_back(Event{frame, static_cast<Key>(code & 0x0F),
+                                   code & Released ? KeyState::Released : KeyState::Pressed});
+   }
+   movie.frames = frame;
+   movie.finalHash = reader.integer(8);
+   return movie;
+}
+
+uint64_t
+Movie::hash(const std::vector<uint8_t>& bytes)
+{
+   return hash(bytes.data(), bytes.size());
+}
+
+uint64_t
+Movie::hash(const uint8_t* bytes, size_t size)
+{
+   uint64_t hash = 0xcbf29ce484222325ULL;
+   for (size_t i = 0; i < size; ++i)
+   {
+      hash ^= bytes[i];
+      hash *= 0x100000001b3ULL;
+   }
+   return hash;
+}
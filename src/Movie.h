@@ -0,0 +1,43 @@
+#ifndef _MOVIE_H_
+#define _MOVIE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Chip8Types.h"
+
+// A recorded session: with the same ROM, seed and cpu rate, applying the key
+// events before the frames they are stamped with reproduces it exactly, the
+// hash of the final save state tells whether it did.
+//
+// On disk it is a little endian header, then every event as the frames since
+// the previous one (LEB128) and a byte with the key in the low nibble and 1
+// in the high one for releases, and an end mark with the frames since the
+// last event followed by the final hash.
+struct Movie
+{
+   struct Event
+   {
+      uint64_t frame;
+      Key key;
+      KeyState state;
+   };
+
+   uint64_t seed = 0;
+   uint32_t cpuRate = DefaultCpuRate;
+   uint64_t romHash = 0;
+   std::vector<Event> events;
+   uint64_t frames = 0;
+   uint64_t finalHash = 0;
+
+   // Throw std::invalid_argument or std::runtime_error
+   void save(const std::string& file) const;
+   static Movie load(const std::string& file);
+
+   // FNV-1a, for the ROM and the final save state
+   static uint64_t hash(const std::vector<uint8_t>& bytes);
+   static uint64_t hash(const uint8_t* bytes, size_t size);
+};
+
+#endif // _MOVIE_H_
@@ -0,0 +1,429 @@
+#include "PostProcess.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) and defined(__GNUC__)
+#include <immintrin.h>
+// SSE2 is always there on x86-64, the AVX2 kernels are checked at run time
+#define POSTPROCESS_SIMD 1
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace
+{
+   // The widest store of the kernels, in pixels
+   const size_t ExpandPadding = 8;
+
+   // The bytes of a row of pixels, 0xFF for the lit ones, 8 at a time
+   const std::array<uint64_t, 256> LitBytes = []
+   {
+      std::array<uint64_t, 256> bytes;
+      for (size_t bits = 0; bits < bytes.size(); ++bits)
+      {
+         uint64_t value = 0;
+         for (size_t pixel = 0; pixel < 8; ++pixel)
+         {
+            if (bits & (0x80 >> pixel))
+            {
+               // In memory order, the leftmost pixel at the lowest address
+               value |= uint64_t(0xFF) << (8 * pixel);
+            }
+         }
+         bytes[bits] = value;
+      }
+      return bytes;
+   }();
+
+   void fadeScalar(const uint8_t* lit, uint8_t* brightness, size_t size, uint8_t persistence)
+   {
+      for (size_t i = 0; i < size; ++i)
+      {
+         brightness[i] = static_cast<uint8_t>((brightness[i] * persistence) >> 8) | lit[i];
+      }
+   }
+
+   // Scale2x: every pixel becomes four, a corner takes the color of the two
+   // neighbours next to it when they are equal unless it is a straight edge
+   void scale2xPixel(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                     uint8_t* top, uint8_t* bottom, size_t x)
+   {
+      auto up = above[x];
+      auto down = below[x];
+      auto left = row[x - 1];
+      auto right = row[x + 1];
+      auto pixel = row[x];
+      auto corner = up != down and left != right;
+      top[2 * x] = corner and left == up ? left : pixel;
+      top[2 * x + 1] = corner and up == right ? right : pixel;
+      bottom[2 * x] = corner and left == down ? left : pixel;
+      bottom[2 * x + 1] = corner and down == right ? right : pixel;
+   }
+
+   void scale2xScalar(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                      uint8_t* top, uint8_t* bottom, size_t width)
+   {
+      for (size_t x = 0; x < width; ++x)
+      {
+         scale2xPixel(above, row, below, top, bottom, x);
+      }
+   }
+
+   void expandScalar(const uint8_t* row, const uint32_t* palette, uint32_t* out, size_t width, size_t scale)
+   {
+      for (size_t x = 0; x < width; ++x)
+      {
+         std::fill_n(out + x * scale, scale, palette[row[x]]);
+      }
+   }
+
+#ifdef POSTPROCESS_SIMD
+   void fadeSSE2(const uint8_t* lit, uint8_t* brightness, size_t size, uint8_t persistence)
+   {
+      const auto zero = _mm_setzero_si128();
+      const auto kept = _mm_set1_epi16(persistence);
+      size_t i = 0;
+      for (; i + 16 <= size; i += 16)
+      {
+         auto pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(brightness + i));
+         auto low = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), kept), 8);
+         auto high = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), kept), 8);
+         pixels = _mm_or_si128(_mm_packus_epi16(low, high),
+                               _mm_loadu_si128(reinterpret_cast<const __m128i*>(lit + i)));
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(brightness + i), pixels);
+      }
+      fadeScalar(lit + i, brightness + i, size - i, persistence);
+   }
+
+   // The byte lanes where mask is set from one and the others from other
+   inline __m128i select(__m128i mask, __m128i one, __m128i other)
+   {
+      return _mm_or_si128(_mm_and_si128(mask, one), _mm_andnot_si128(mask, other));
+   }
+
+   void scale2xSSE2(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                    uint8_t* top, uint8_t* bottom, size_t width)
+   {
+      const auto ones = _mm_set1_epi8(-1);
+      size_t x = 0;
+      for (; x + 16 <= width; x += 16)
+      {
+         auto up = _mm_loadu_si128(reinterpret_cast<const __m128i*>(above + x));
+         auto down = _mm_loadu_si128(reinterpret_cast<const __m128i*>(below + x));
+         auto left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x - 1));
+         auto right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x + 1));
+         auto pixel = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+         auto corner = _mm_xor_si128(_mm_or_si128(_mm_cmpeq_epi8(up, down), _mm_cmpeq_epi8(left, right)), ones);
+         auto topLeft = select(_mm_and_si128(corner, _mm_cmpeq_epi8(left, up)), left, pixel);
+         auto topRight = select(_mm_and_si128(corner, _mm_cmpeq_epi8(up, right)), right, pixel);
+         auto bottomLeft = select(_mm_and_si128(corner, _mm_cmpeq_epi8(left, down)), left, pixel);
+         auto bottomRight = select(_mm_and_si128(corner, _mm_cmpeq_epi8(down, right)), right, pixel);
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(top + 2 * x), _mm_unpacklo_epi8(topLeft, topRight));
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(top + 2 * x + 16), _mm_unpackhi_epi8(topLeft, topRight));
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(bottom + 2 * x), _mm_unpacklo_epi8(bottomLeft, bottomRight));
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(bottom + 2 * x + 16), _mm_unpackhi_epi8(bottomLeft, bottomRight));
+      }
+      for (; x < width; ++x)
+      {
+         scale2xPixel(above, row, below, top, bottom, x);
+      }
+   }
+
+   void expandSSE2(const uint8_t* row, const uint32_t* palette, uint32_t* out, size_t width, size_t scale)
+   {
+      for (size_t x = 0; x < width; ++x)
+      {
+         auto color = _mm_set1_epi32(palette[row[x]]);
+         // The last store may go into the next pixel, which is stored after
+         for (size_t i = 0; i < scale; i += 4)
+         {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x * scale + i), color);
+         }
+      }
+   }
+
+   TARGET_AVX2 void fadeAVX2(const uint8_t* lit, uint8_t* brightness, size_t size, uint8_t persistence)
+   {
+      const auto zero = _mm256_setzero_si256();
+      const auto kept = _mm256_set1_epi16(persistence);
+      size_t i = 0;
+      for (; i + 32 <= size; i += 32)
+      {
+         auto pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(brightness + i));
+         // Unpacking and packing are within the 128 bit halves, they undo
+         // each other
+         auto low = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(pixels, zero), kept), 8);
+         auto high = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(pixels, zero), kept), 8);
+         pixels = _mm256_or_si256(_mm256_packus_epi16(low, high),
+                                  _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lit + i)));
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(brightness + i), pixels);
+      }
+      fadeScalar(lit + i, brightness + i, size - i, persistence);
+   }
+
+   TARGET_AVX2 inline __m256i select(__m256i mask, __m256i one, __m256i other)
+   {
+      return _mm256_blendv_epi8(other, one, mask);
+   }
+
+   TARGET_AVX2 void scale2xAVX2(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                                uint8_t* top, uint8_t* bottom, size_t width)
+   {
+      const auto ones = _mm256_set1_epi8(-1);
+      size_t x = 0;
+      for (; x + 32 <= width; x += 32)
+      {
+         auto up = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(above + x));
+         auto down = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(below + x));
+         auto left = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + x - 1));
+         auto right = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + x + 1));
+         auto pixel = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + x));
+         auto corner = _mm256_xor_si256(_mm256_or_si256(_mm256_cmpeq_epi8(up, down),
+                                                        _mm256_cmpeq_epi8(left, right)), ones);
+         auto topLeft = select(_mm256_and_si256(corner, _mm256_cmpeq_epi8(left, up)), left, pixel);
+         auto topRight = select(_mm256_and_si256(corner, _mm256_cmpeq_epi8(up, right)), right, pixel);
+         auto bottomLeft = select(_mm256_and_si256(corner, _mm256_cmpeq_epi8(left, down)), left, pixel);
+         auto bottomRight = select(_mm256_and_si256(corner, _mm256_cmpeq_epi8(down, right)), right, pixel);
+         // The unpacks interleave within the halves, pixels 0 to 7 and 16 to
+         // 23 and then 8 to 15 and 24 to 31, the permutes put them in order
+         auto topLow = _mm256_unpacklo_epi8(topLeft, topRight);
+         auto topHigh = _mm256_unpackhi_epi8(topLeft, topRight);
+         auto bottomLow = _mm256_unpacklo_epi8(bottomLeft, bottomRight);
+         auto bottomHigh = _mm256_unpackhi_epi8(bottomLeft, bottomRight);
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(top + 2 * x), _mm256_permute2x128_si256(topLow, topHigh, 0x20));
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(top + 2 * x + 32), _mm256_permute2x128_si256(topLow, topHigh, 0x31));
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(bottom + 2 * x), _mm256_permute2x128_si256(bottomLow, bottomHigh, 0x20));
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(bottom + 2 * x + 32), _mm256_permute2x128_si256(bottomLow, bottomHigh, 0x31));
+      }
+      for (; x < width; ++x)
+      {
+         scale2xPixel(above, row, below, top, bottom, x);
+      }
+   }
+
+   TARGET_AVX2 void expandAVX2(const uint8_t* row, const uint32_t* palette, uint32_t* out, size_t width, size_t scale)
+   {
+      for (size_t x = 0; x < width; ++x)
+      {
+         auto color = _mm256_set1_epi32(palette[row[x]]);
+         for (size_t i = 0; i < scale; i += 8)
+         {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x * scale + i), color);
+         }
+      }
+   }
+#endif
+}
+
+PostProcess::PostProcess()
+:scaler(Scaler::Nearest)
+,kernels(Kernels::Scalar)
+,persistence(0)
+,on(0xFF00FF00)
+,off(0xFF000000)
+,outputWidth(ScreenXLimit)
+,outputHeight(ScreenYLimit)
+,sourceWidth(ScreenXLimit)
+,sourceHeight(ScreenYLimit)
+,scale(1)
+,settled(true)
+,lit(ScreenXLimit * ScreenYLimit)
+,brightness(ScreenXLimit * ScreenYLimit)
+,bordered((ScreenXLimit + 2) * (ScreenYLimit + 2))
+,smoothed(4 * ScreenXLimit * ScreenYLimit)
+{
+   setKernels(bestKernels());
+   updatePalette();
+   resize();
+}
+
+void
+PostProcess::setOutputSize(size_t width, size_t height)
+{
+   outputWidth = width;
+   outputHeight = height;
+   resize();
+}
+
+void
+PostProcess::setScaler(Scaler newScaler)
+{
+   scaler = newScaler;
+   resize();
+}
+
+void
+PostProcess::setPersistence(uint8_t kept)
+{
+   persistence = kept;
+}
+
+void
+PostProcess::setColors(uint32_t newOn, uint32_t newOff)
+{
+   on = newOn;
+   off = newOff;
+   updatePalette();
+}
+
+void
+PostProcess::setKernels(Kernels newKernels)
+{
+   if (newKernels == Kernels::Scalar)
+   {
+      fade = fadeScalar;
+      scale2x = scale2xScalar;
+      expand = expandScalar;
+   }
+#ifdef POSTPROCESS_SIMD
+   else if (newKernels == Kernels::SSE2)
+   {
+      fade = fadeSSE2;
+      scale2x = scale2xSSE2;
+      expand = expandSSE2;
+   }
+   else if (newKernels == Kernels::AVX2 and __builtin_cpu_supports("avx2"))
+   {
+      fade = fadeAVX2;
+      scale2x = scale2xAVX2;
+      expand = expandAVX2;
+   }
+#endif
+   else
+   {
+      throw std::invalid_argument("The host doesn't have these kernels");
+   }
+   kernels = newKernels;
+}
+
+PostProcess::Kernels
+PostProcess::getKernels() const
+{
+   return kernels;
+}
+
+void
+PostProcess::process(const Graphics& graphics)
+{
+   for (size_t y = 0; y < ScreenYLimit; ++y)
+   {
+      for (size_t byte = 0; byte < ScreenXLimit / 8; ++byte)
+      {
+         auto bits = (graphics[y] >> (ScreenXLimit - 8 - 8 * byte)) & 0xFF;
+         std::memcpy(&lit[y * ScreenXLimit + 8 * byte], &LitBytes[bits], 8);
+      }
+   }
+   fade(lit.data(), brightness.data(), brightness.size(), persistence);
+   settled = brightness == lit;
+
+   const uint8_t* source = brightness.data();
+   if (scaler == Scaler::Scale2x)
+   {
+      const size_t stride = ScreenXLimit + 2;
+      for (size_t y = 0; y < ScreenYLimit; ++y)
+      {
+         auto row = &bordered[(y + 1) * stride];
+         std::memcpy(row + 1, &brightness[y * ScreenXLimit], ScreenXLimit);
+         row[0] = row[1];
+         row[stride - 1] = row[stride - 2];
+      }
+      std::memcpy(&bordered[0], &bordered[stride], stride);
+      std::memcpy(&bordered[(ScreenYLimit + 1) * stride], &bordered[ScreenYLimit * stride], stride);
+
+      for (size_t y = 0; y < ScreenYLimit; ++y)
+      {
+         auto row = &bordered[(y + 1) * stride + 1];
+         scale2x(row - stride, row, row + stride,
+                 &smoothed[2 * y * sourceWidth], &smoothed[(2 * y + 1) * sourceWidth], ScreenXLimit);
+      }
+      source = smoothed.data();
+   }
+
+   // A row is expanded once and copied for the rest of its scale
+   const size_t width = sourceWidth * scale;
+   for (size_t y = 0; y < sourceHeight; ++y)
+   {
+      auto out = &pixels[y * scale * width];
+      expand(source + y * sourceWidth, palette.data(), out, sourceWidth, scale);
+      for (size_t copy = 1; copy < scale; ++copy)
+      {
+         std::memcpy(out + copy * width, out, width * sizeof(uint32_t));
+      }
+   }
+}
+
+bool
+PostProcess::isSettled() const
+{
+   return settled;
+}
+
+const uint8_t*
+PostProcess::getPixels() const
+{
+   return reinterpret_cast<const uint8_t*>(pixels.data());
+}
+
+size_t
+PostProcess::getWidth() const
+{
+   return sourceWidth * scale;
+}
+
+size_t
+PostProcess::getHeight() const
+{
+   return sourceHeight * scale;
+}
+
+PostProcess::Kernels
+PostProcess::bestKernels()
+{
+#ifdef POSTPROCESS_SIMD
+   return __builtin_cpu_supports("avx2") ? Kernels::AVX2 : Kernels::SSE2;
+#else
+   return Kernels::Scalar;
+#endif
+}
+
+PostProcess::Scaler
+PostProcess::parseScaler(const std::string& name)
+{
+   if (name == "nearest")
+   {
+      return Scaler::Nearest;
+   }
+   if (name == "scale2x")
+   {
+      return Scaler::Scale2x;
+   }
+   throw std::invalid_argument(std::string("Unknown scaler ") + name);
+}
+
+void
+PostProcess::resize()
+{
+   auto factor = scaler == Scaler::Scale2x ? 2 : 1;
+   sourceWidth = ScreenXLimit * factor;
+   sourceHeight = ScreenYLimit * factor;
+   scale = std::max<size_t>(1, std::min(outputWidth / sourceWidth, outputHeight / sourceHeight));
+   pixels.assign(getWidth() * getHeight() + ExpandPadding, off);
+}
+
+void
+PostProcess::updatePalette()
+{
+   // Every brightness is on and off mixed, channel by channel
+   for (uint32_t level = 0; level < palette.size(); ++level)
+   {
+      uint32_t color = 0;
+      for (uint32_t shift = 0; shift < 32; shift += 8)
+      {
+         auto from = (off >> shift) & 0xFF;
+         auto to = (on >> shift) & 0xFF;
+         color |= ((from * (255 - level) + to * level) / 255) << shift;
+      }
+      palette[level] = color;
+   }
+}
@@ -0,0 +1,95 @@
+#ifndef _POSTPROCESS_H_
+#define _POSTPROCESS_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Chip8Types.h"
+
+// Turns the one bit per pixel frames into the RGBA image the renderer
+// uploads, on the CPU.
+//
+// Every pixel has a brightness: lit pixels are at full brightness and the
+// others keep a share of it every frame, like the phosphor of a CRT, so the
+// sprites the games erase and draw back with XOR don't flicker. The
+// brightness is optionally smoothed with Scale2x, which doubles the
+// resolution rounding the diagonals, and then scaled by the largest integer
+// that fits the output and colored.
+//
+// The steps run over whole rows with SSE2 or AVX2 when the host has them,
+// the scalar ones give the same image.
+class PostProcess
+{
+public:
+   enum class Scaler {Nearest, Scale2x};
+   enum class Kernels {Scalar, SSE2, AVX2};
+
+   PostProcess();
+
+   // The image is the largest that fits, the scale is at least 1
+   void setOutputSize(size_t width, size_t height);
+   void setScaler(Scaler);
+   // Out of 256 of the brightness a pixel keeps every frame it is off, 0
+   // turns them off at once
+   void setPersistence(uint8_t);
+   // As RGBA bytes in memory order
+   void setColors(uint32_t on, uint32_t off);
+   // The best the host has unless asked for others, to compare them
+   void setKernels(Kernels);
+   Kernels getKernels() const;
+
+   // Runs every step on a new frame, or on the same one again to fade it
+   void process(const Graphics& graphics);
+   // Whether processing the same frame again would change nothing
+   bool isSettled() const;
+
+   // RGBA, width times height pixels
+   const uint8_t* getPixels() const;
+   size_t getWidth() const;
+   size_t getHeight() const;
+
+   static Kernels bestKernels();
+   static Scaler parseScaler(const std::string& name);
+
+private:
+   // A pointer per step, chosen with the kernels
+   using FadeKernel = void (*)(const uint8_t* lit, uint8_t* brightness, size_t size, uint8_t persistence);
+   using Scale2xKernel = void (*)(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                                  uint8_t* top, uint8_t* bottom, size_t width);
+   using ExpandKernel = void (*)(const uint8_t* row, const uint32_t* palette, uint32_t* out,
+                                 size_t width, size_t scale);
+
+   void resize();
+   void updatePalette();
+
+   Scaler scaler;
+   Kernels kernels;
+   uint8_t persistence;
+   uint32_t on;
+   uint32_t off;
+   size_t outputWidth;
+   size_t outputHeight;
+   // Of the brightness before scaling, and how many times it is scaled
+   size_t sourceWidth;
+   size_t sourceHeight;
+   size_t scale;
+   bool settled;
+   FadeKernel fade;
+   Scale2xKernel scale2x;
+   ExpandKernel expand;
+   // 0 or 255 for every pixel of the frame
+   std::vector<uint8_t> lit;
+   std::vector<uint8_t> brightness;
+   // With a border repeating the edges, for Scale2x to look past them
+   std::vector<uint8_t> bordered;
+   std::vector<uint8_t> smoothed;
+   std::array<uint32_t, 256> palette;
+   // The rows are expanded with whole vectors, the last one may go past
+   // the end of the image into some padding
+   std::vector<uint32_t> pixels;
+};
+
+#endif // _POSTPROCESS_H_
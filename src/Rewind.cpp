@@ -0,0 +1,184 @@
+#include "Rewind.h"
+
+#include <chrono>
+#include <cstring>
+
+namespace
+{
+   // Shorter runs of equal bytes are cheaper left inside the literal
+   const size_t MinEqualRun = 4;
+
+   void writeLength(std::vector<uint8_t>& out, size_t value)
+   {
+      while (value >= 0x80)
+      {
+         out.push_back(static_cast<uint8_t>(value) | 0x80);
+         value >>= 7;
+      }
+      out.push_back(static_cast<uint8_t>(value));
+   }
+
+   size_t readLength(const std::vector<uint8_t>& in, size_t& position)
+   {
+      size_t value = 0;
+      for (size_t shift = 0; ; shift += 7)
+      {
+         auto byte = in[position++];
+         value |= static_cast<size_t>(byte & 0x7F) << shift;
+         if (not (byte & 0x80))
+         {
+            return value;
+         }
+      }
+   }
+
+   // Most of the state doesn't change, it is skipped a word at a time
+   size_t skipEqual(const SaveState& from, const SaveState& to, size_t i)
+   {
+      uint64_t lhs = 0;
+      uint64_t rhs = 0;
+      while (i + sizeof(lhs) <= to.size())
+      {
+         std::memcpy(&lhs, &from[i], sizeof(lhs));
+         std::memcpy(&rhs, &to[i], sizeof(rhs));
+         if (lhs != rhs)
+         {
+            break;
+         }
+         i += sizeof(lhs);
+      }
+      while (i < to.size() and from[i] == to[i])
+      {
+         ++i;
+      }
+      return i;
+   }
+}
+
+Rewind::Rewind(size_t capacity)
+:capacity(capacity)
+,snapshots(0)
+,snapshotNanoseconds(0)
+{}
+
+void
+Rewind::push(const SaveState& state)
+{
+   auto start = std::chrono::steady_clock::now();
+   if (capacity == 0)
+   {
+      return;
+   }
+   if (newest.size() != state.size())
+   {
+      // Nothing to diff against, or states of another version
+      clear();
+   }
+   else
+   {
+      encode(state, newest, scratch);
+      deltas.insert(deltas.end(), scratch.begin(), scratch.end());
+      deltaSizes.push_back(static_cast<uint16_t>(scratch.size()));
+      if (deltaSizes.size() >= capacity)
+      {
+         deltas.erase(deltas.begin(), deltas.begin() + deltaSizes.front());
+         deltaSizes.pop_front();
+      }
+   }
+   newest = state;
+
+   ++snapshots;
+   snapshotNanoseconds += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool
+Rewind::stepBack(SaveState& state)
+{
+   if (deltaSizes.empty())
+   {
+      return false;
+   }
+   auto begin = deltas.end() - deltaSizes.back();
+   scratch.assign(begin, deltas.end());
+   deltas.erase(begin, deltas.end());
+   deltaSizes.pop_back();
+   apply(scratch, newest);
+   state = newest;
+   return true;
+}
+
+void
+Rewind::clear()
+{
+   newest.clear();
+   deltas.clear();
+   deltaSizes.clear();
+}
+
+size_t
+Rewind::frames() const
+{
+   return newest.empty() ? 0 : deltaSizes.size() + 1;
+}
+
+size_t
+Rewind::memoryUsage() const
+{
+   return newest.size() + deltas.size() + deltaSizes.size() * sizeof(uint16_t);
+}
+
+double
+Rewind::nanosecondsPerSnapshot() const
+{
+   return snapshots > 0 ? snapshotNanoseconds / snapshots : 0;
+}
+
+// Pairs of lengths, equal bytes to skip and bytes that differ, followed by
+// the XOR of those bytes. The equal bytes at the end are left out.
+void
+Rewind::encode(const SaveState& from, const SaveState& to, Delta& delta)
+{
+   delta.clear();
+   size_t i = 0;
+   while (true)
+   {
+      auto skipped = i;
+      i = skipEqual(from, to, i);
+      if (i == to.size())
+      {
+         break;
+      }
+
+      auto literal = i;
+      size_t equal = 0;
+      while (i < to.size() and equal < MinEqualRun)
+      {
+         equal = from[i] == to[i] ? equal + 1 : 0;
+         ++i;
+      }
+      i -= equal;
+
+      writeLength(delta, literal - skipped);
+      writeLength(delta, i - literal);
+      for (auto j = literal; j < i; ++j)
+      {
+         delta.push_back(from[j] ^ to[j]);
+      }
+   }
+}
+
+void
+Rewind::apply(const Delta& delta, SaveState& state)
+{
+   size_t position = 0;
+   size_t i = 0;
+   while (position < delta.size())
+   {
+      i += readLength(delta, position);
+      auto length = readLength(delta, position);
+      for (size_t j = 0; j < length; ++j)
+      {
+         state[i++] ^= delta[position++];
+      }
+   }
+}
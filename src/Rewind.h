@@ -0,0 +1,53 @@
+#ifndef _REWIND_H_
+#define _REWIND_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "Chip8Types.h"
+
+// History of one save state per frame to step the game backwards.
+//
+// Only the newest state is kept whole, every older one is the XOR against
+// the state after it, run-length encoded: consecutive frames only differ in
+// a few bytes, so that is mostly a couple of zero runs. Stepping back XORs
+// the newest state with its delta. Once it holds the frames it was made for
+// the oldest one is dropped.
+class Rewind
+{
+public:
+   explicit Rewind(size_t capacity);
+
+   // The state the machine is at, after every frame
+   void push(const SaveState& state);
+   // Drops the newest state and gives the one before it, which the machine
+   // is to be put back at. False when there is no older state.
+   bool stepBack(SaveState& state);
+   void clear();
+
+   size_t frames() const;
+   // Bytes held by the deltas and the newest state
+   size_t memoryUsage() const;
+   // Average time push takes
+   double nanosecondsPerSnapshot() const;
+
+private:
+   using Delta = std::vector<uint8_t>;
+
+   static void encode(const SaveState& from, const SaveState& to, Delta& delta);
+   static void apply(const Delta& delta, SaveState& state);
+
+   size_t capacity;
+   SaveState newest;
+   // The deltas one after another, oldest first, a container per delta
+   // would take more than the deltas themselves
+   std::deque<uint8_t> deltas;
+   std::deque<uint16_t> deltaSizes;
+   Delta scratch;
+   uint64_t snapshots;
+   double snapshotNanoseconds;
+};
+
+#endif // _REWIND_H_
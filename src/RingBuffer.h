@@ -0,0 +1,62 @@
+#ifndef _RINGBUFFER_H_
+#define _RINGBUFFER_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// Fixed size queue from one producer thread to one consumer thread without
+// locks. The indexes only grow, each of them is written by one side only.
+template<typename T, size_t Capacity>
+class RingBuffer
+{
+   static_assert(Capacity > 0 and (Capacity & (Capacity - 1)) == 0,
+                 "The capacity has to be a power of two");
+
+public:
+   RingBuffer()
+   :head(0)
+   ,tail(0)
+   {}
+
+   RingBuffer(const RingBuffer&) = delete;
+   RingBuffer& operator=(const RingBuffer&) = delete;
+
+   // Producer side, false when it is full
+   bool push(const T& value)
+   {
+      auto position = tail.load(std::memory_order_relaxed);
+      if (position - head.load(std::memory_order_acquire) == Capacity)
+      {
+         return false;
+      }
+      items[position & (Capacity - 1)] = value;
+      tail.store(position + 1, std::memory_order_release);
+      return true;
+   }
+
+   // Consumer side, front is false when it is empty and pop drops the front
+   bool front(T& value) const
+   {
+      auto position = head.load(std::memory_order_relaxed);
+      if (position == tail.load(std::memory_order_acquire))
+      {
+         return false;
+      }
+      value = items[position & (Capacity - 1)];
+      return true;
+   }
+
+   void pop()
+   {
+      head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+   }
+
+private:
+   std::array<T, Capacity> items;
+   // Apart so the producer and the consumer don't share a cache line
+   alignas(64) std::atomic<size_t> head;
+   alignas(64) std::atomic<size_t> tail;
+};
+
+#endif // _RINGBUFFER_H_
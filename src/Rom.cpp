@@ -0,0 +1,104 @@
+#include "Rom.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::shared_ptr<const Rom>
+Rom::map(const std::string& file)
+{
+   auto descriptor = open(file.c_str(), O_RDONLY);
+   if (descriptor < 0)
+   {
+      throw std::invalid_argument(std::string("Cannot open game ") + file);
+   }
+   struct stat status;
+   if (fstat(descriptor, &status) != 0 or not S_ISREG(status.st_mode))
+   {
+      close(descriptor);
+      throw std::invalid_argument(std::string("Cannot open game ") + file);
+   }
+   try
+   {
+      validate(status.st_size, file);
+   }
+   catch (...)
+   {
+      close(descriptor);
+      throw;
+   }
+
+   auto size = static_cast<size_t>(status.st_size);
+   auto mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+   // The mapping holds the file on its own
+   close(descriptor);
+   if (mapping == MAP_FAILED)
+   {
+      throw std::invalid_argument(std::string("Cannot map game ") + file);
+   }
+   return std::shared_ptr<const Rom>(new Rom(static_cast<const uint8_t*>(mapping), size, mapping, false));
+}
+
+std::shared_ptr<const Rom>
+Rom::copy(const uint8_t* bytes, size_t size)
+{
+   validate(size, "image");
+   auto owned = new uint8_t[size];
+   std::memcpy(owned, bytes, size);
+   return std::shared_ptr<const Rom>(new Rom(owned, size, nullptr, true));
+}
+
+std::shared_ptr<const Rom>
+Rom::view(const uint8_t* bytes, size_t size)
+{
+   validate(size, "image");
+   return std::shared_ptr<const Rom>(new Rom(bytes, size, nullptr, false));
+}
+
+Rom::Rom(const uint8_t* bytes, size_t size, void* mapping, bool owned)
+:bytes(bytes)
+,length(size)
+,mapping(mapping)
+,owned(owned)
+{}
+
+Rom::~Rom()
+{
+   if (mapping)
+   {
+      munmap(mapping, length);
+   }
+   if (owned)
+   {
+      delete[] bytes;
+   }
+}
+
+const uint8_t*
+Rom::data() const
+{
+   return bytes;
+}
+
+size_t
+Rom::size() const
+{
+   return length;
+}
+
+void
+Rom::validate(size_t size, const std::string& name)
+{
+   if (size == 0)
+   {
+      throw std::invalid_argument(std::string("Empty game ") + name);
+   }
+   if (size > MaxRomSize)
+   {
+      throw std::invalid_argument("The game " + name + " has " + std::to_string(size) + " bytes, more than the " +
+                                  std::to_string(MaxRomSize) + " of the program area");
+   }
+}
@@ -0,0 +1,46 @@
+#ifndef _ROM_H_
+#define _ROM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "Chip8Types.h"
+
+// A game image, read only, so one of them can be loaded by any number of
+// machines at once; loading it is a single copy into the machine memory.
+//
+// Files are mapped rather than read. An empty image or one bigger than the
+// program area is refused with std::invalid_argument, as are files that
+// can't be opened.
+class Rom
+{
+public:
+   // The file mapped read only
+   static std::shared_ptr<const Rom> map(const std::string& file);
+   // Its own copy of the bytes, for images that are not files
+   static std::shared_ptr<const Rom> copy(const uint8_t* bytes, size_t size);
+   // Neither copies nor owns the bytes, they have to outlive it
+   static std::shared_ptr<const Rom> view(const uint8_t* bytes, size_t size);
+
+   ~Rom();
+   Rom(const Rom&) = delete;
+   Rom& operator=(const Rom&) = delete;
+
+   const uint8_t* data() const;
+   size_t size() const;
+
+private:
+   Rom(const uint8_t* bytes, size_t size, void* mapping, bool owned);
+
+   static void validate(size_t size, const std::string& name);
+
+   const uint8_t* bytes;
+   size_t length;
+   // Unmapped or deleted with it, at most one of them
+   void* mapping;
+   bool owned;
+};
+
+#endif // _ROM_H_
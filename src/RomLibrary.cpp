@@ -0,0 +1,375 @@
+#include "RomLibrary.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "Movie.h"
+
+const char* const RomLibrary::IndexFile = ".chip8index";
+
+namespace
+{
+   const uint32_t IndexVersion = 1;
+
+   std::string lowercase(std::string text)
+   {
+      std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+      return text;
+   }
+
+   std::string extension(const std::string& name)
+   {
+      auto dot = name.rfind('.');
+      return dot == std::string::npos ? std::string() : lowercase(name.substr(dot + 1));
+   }
+
+   bool isDocument(const std::string& name)
+   {
+      static const char* const documents[] = {"doc", "src", "txt", "md", "db", "pdf", "html"};
+      auto suffix = extension(name);
+      return std::find(std::begin(documents), std::end(documents), suffix) != std::end(documents);
+   }
+
+   int hexDigit(char c)
+   {
+      if (c >= '0' and c <= '9')
+      {
+         return c - '0';
+      }
+      c = std::tolower(static_cast<unsigned char>(c));
+      return c >= 'a' and c <= 'f' ? c - 'a' + 10 : -1;
+   }
+
+   // "00000010: 6c09 2210 ...  l.\"." lines, the text column is left out
+   bool decodeHexDump(const std::string& text, std::vector<uint8_t>& bytes)
+   {
+      std::istringstream lines(text);
+      std::string line;
+      while (std::getline(lines, line))
+      {
+         auto colon = line.find(':');
+         if (colon == std::string::npos)
+         {
+            if (line.find_first_not_of(" \t\r") != std::string::npos)
+            {
+               return false;
+            }
+            continue;
+         }
+         auto end = line.find("  ", colon + 1);
+         int high = -1;
+         for (auto i = colon + 1; i < std::min(end, line.size()); ++i)
+         {
+            if (line[i] == ' ' or line[i] == '\r')
+            {
+               continue;
+            }
+            auto digit = hexDigit(line[i]);
+            if (digit < 0)
+            {
+               return false;
+            }
+            if (high < 0)
+            {
+               high = digit;
+            }
+            else
+            {
+               bytes.push_back(static_cast<uint8_t>(high << 4 | digit));
+               high = -1;
+            }
+         }
+         if (high >= 0)
+         {
+            return false;
+         }
+      }
+      return not bytes.empty();
+   }
+
+   std::string readFile(const std::string& file)
+   {
+      std::ifstream in(file, std::ios::binary);
+      if (not in.is_open())
+      {
+         throw std::invalid_argument(std::string("Cannot open game ") + file);
+      }
+      return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+   }
+
+   std::unordered_map<std::string, RomEntry> readIndex(const std::string& file)
+   {
+      std::unordered_map<std::string, RomEntry> index;
+      std::ifstream in(file);
+      uint32_t version = 0;
+      if (not (in >> version) or version != IndexVersion)
+      {
+         return index;
+      }
+      RomEntry entry;
+      while (in >> std::hex >> entry.hash >> std::dec >> entry.size >> entry.modified >> entry.format >> std::ws and
+             std::getline(in, entry.name))
+      {
+         index[entry.name] = entry;
+      }
+      return index;
+   }
+
+   void writeIndex(const std::string& file, const std::vector<RomEntry>& entries)
+   {
+      std::ofstream out(file, std::ios::trunc);
+      out << IndexVersion << '\n';
+      for (const auto& entry : entries)
+      {
+         out << std::hex << entry.hash << std::dec << ' ' << entry.size << ' ' << entry.modified << ' '
+             << entry.format << ' ' << entry.name << '\n';
+      }
+   }
+}
+
+void
+RomLibrary::scan(const std::string& directory)
+{
+   auto listing = opendir(directory.c_str());
+   if (not listing)
+   {
+      throw std::invalid_argument(std::string("Cannot open library ") + directory);
+   }
+   std::vector<std::string> names;
+   while (auto item = readdir(listing))
+   {
+      std::string name = item->d_name;
+      if (name[0] != '.' and not isDocument(name))
+      {
+         names.push_back(name);
+      }
+   }
+   closedir(listing);
+   std::sort(names.begin(), names.end());
+
+   auto indexFile = directory + "/" + IndexFile;
+   auto cached = readIndex(indexFile);
+   auto changed = false;
+   std::vector<RomEntry> found;
+   for (const auto& name : names)
+   {
+      RomEntry entry;
+      entry.name = name;
+      entry.file = directory + "/" + name;
+      struct stat status;
+      if (stat(entry.file.c_str(), &status) != 0 or not S_ISREG(status.st_mode))
+      {
+         continue;
+      }
+      entry.size = static_cast<uint64_t>(status.st_size);
+      entry.modified = static_cast<int64_t>(status.st_mtime);
+
+      auto previous = cached.find(name);
+      if (previous != cached.end() and previous->second.size == entry.size and
+          previous->second.modified == entry.modified)
+      {
+         entry.hash = previous->second.hash;
+         entry.format = previous->second.format;
+      }
+      else
+      {
+         // Not a game, as far as the library is concerned
+         std::shared_ptr<const Rom> rom;
+         try
+         {
+            rom = load(entry.file);
+         }
+         catch (const std::invalid_argument&)
+         {
+            continue;
+         }
+         ++filesRead;
+         changed = true;
+         entry.hash = hash(*rom);
+         entry.format = extension(name) == "hex" ? "xxd" : "raw";
+      }
+      found.push_back(entry);
+   }
+   changed = changed or found.size() != cached.size();
+   if (changed)
+   {
+      // A library that can't be written is scanned in full every time
+      writeIndex(indexFile, found);
+   }
+
+   entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                [&](const RomEntry& entry) { return entry.file.compare(0, directory.size() + 1, directory + "/") == 0; }),
+                 entries.end());
+   entries.insert(entries.end(), found.begin(), found.end());
+}
+
+void
+RomLibrary::loadDatabase(const std::string& file)
+{
+   std::ifstream in(file);
+   if (not in.is_open())
+   {
+      throw std::invalid_argument(std::string("Cannot open database ") + file);
+   }
+   std::string line;
+   for (size_t number = 1; std::getline(in, line); ++number)
+   {
+      auto comment = line.find('#');
+      std::istringstream fields(line.substr(0, comment));
+      std::string hashText;
+      RomSettings game;
+      if (not (fields >> hashText))
+      {
+         continue;
+      }
+      auto invalid = [&](const std::string& what)
+      {
+         return std::invalid_argument(file + ":" + std::to_string(number) + ": " + what);
+      };
+      size_t parsed = 0;
+      uint64_t gameHash = 0;
+      try
+      {
+         gameHash = std::stoull(hashText, &parsed, 16);
+      }
+      catch (const std::exception&)
+      {
+      }
+      if (parsed == 0 or parsed != hashText.size() or not (fields >> game.title))
+      {
+         throw invalid("Expected a hash and a title");
+      }
+
+      std::string setting;
+      while (fields >> setting)
+      {
+         auto equals = setting.find('=');
+         if (equals == std::string::npos or equals == 0 or equals + 1 == setting.size())
+         {
+            throw invalid("Invalid setting " + setting);
+         }
+         auto name = setting.substr(0, equals);
+         auto value = setting.substr(equals + 1);
+         if (name == "ipf")
+         {
+            auto rate = std::atoi(value.c_str());
+            if (rate <= 0)
+            {
+               throw invalid("Invalid instructions per frame " + value);
+            }
+            game.instructionsPerFrame = static_cast<uint32_t>(rate);
+         }
+         else if (name == "quirks")
+         {
+            try
+            {
+               RomSettings::unemulatedQuirks(value);
+            }
+            catch (const std::invalid_argument&)
+            {
+               throw invalid("Unknown quirks profile " + value);
+            }
+            game.quirks = value;
+         }
+         else
+         {
+            auto key = value.size() == 1 ? hexDigit(value[0]) : -1;
+            if (key < 0)
+            {
+               throw invalid("Invalid keypad key " + value);
+            }
+            // The keypad is indexed by the key value
+            game.keys.emplace_back(name, static_cast<Key>(key));
+         }
+      }
+      settings[gameHash] = game;
+   }
+}
+
+std::vector<RomSettings::Quirk>
+RomSettings::unemulatedQuirks(const std::string& profile)
+{
+   // 8xy6 and 8xyE, Fx55 and Fx65, Bnnn
+   const Opcode Shifts = 0x8006, ShiftsMask = 0xF007;
+   const Opcode LoadStore = 0xF045, LoadStoreMask = 0xF0CF;
+   const Opcode Jump = 0xB000, JumpMask = 0xF000;
+   if (profile.empty())
+   {
+      return {};
+   }
+   if (profile == "cosmac")
+   {
+      return {{"8xy6 and 8xyE shift Vy into Vx", ShiftsMask, Shifts},
+              {"Fx55 and Fx65 advance I past the last register", LoadStoreMask, LoadStore}};
+   }
+   if (profile == "chip48")
+   {
+      return {{"Fx55 and Fx65 advance I to the last register", LoadStoreMask, LoadStore},
+              {"Bxnn adds Vx", JumpMask, Jump}};
+   }
+   if (profile == "schip")
+   {
+      return {{"Bxnn adds Vx", JumpMask, Jump}};
+   }
+   throw std::invalid_argument("Unknown quirks profile " + profile);
+}
+
+const std::vector<RomEntry>&
+RomLibrary::getEntries() const
+{
+   return entries;
+}
+
+const RomEntry*
+RomLibrary::find(const std::string& name) const
+{
+   for (const auto& entry : entries)
+   {
+      if (entry.file == name or entry.name == name)
+      {
+         return &entry;
+      }
+   }
+   return nullptr;
+}
+
+const RomSettings*
+RomLibrary::getSettings(uint64_t hash) const
+{
+   auto found = settings.find(hash);
+   return found == settings.end() ? nullptr : &found->second;
+}
+
+size_t
+RomLibrary::getFilesRead() const
+{
+   return filesRead;
+}
+
+std::shared_ptr<const Rom>
+RomLibrary::load(const std::string& file)
+{
+   if (extension(file) != "hex")
+   {
+      return Rom::map(file);
+   }
+   std::vector<uint8_t> bytes;
+   if (not decodeHexDump(readFile(file), bytes))
+   {
+      throw std::invalid_argument(std::string("Invalid hex dump ") + file);
+   }
+   return Rom::copy(bytes.data(), bytes.size());
+}
+
+uint64_t
+RomLibrary::hash(const Rom& rom)
+{
+   return Movie::hash(rom.data(), rom.size());
+}
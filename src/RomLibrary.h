@@ -0,0 +1,96 @@
+#ifndef _ROMLIBRARY_H_
+#define _ROMLIBRARY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Chip8Types.h"
+#include "Rom.h"
+
+// How a game is meant to be played, from the settings database
+struct RomSettings
+{
+   // An ambiguous behaviour of the opcodes that match the mask
+   struct Quirk
+   {
+      std::string description;
+      Opcode mask;
+      Opcode opcode;
+   };
+
+   std::string title;
+   uint32_t instructionsPerFrame = DefaultCpuRate / FrameRate;
+   // The machine the game was written for, which decides how it expects
+   // the ambiguous opcodes to behave: "cosmac" (the COSMAC VIP), "chip48"
+   // (the HP48 CHIP-48) or "schip" (SUPER-CHIP), empty when unknown
+   std::string quirks;
+   // Keyboard key names ("Up", "Space", "A"...) for keypad keys, on top of
+   // the usual layout
+   std::vector<std::pair<std::string, Key>> keys;
+
+   // Chip8 shifts Vx at 8xy6 and 8xyE, leaves I as it was at Fx55 and
+   // Fx65, adds V0 at Bnnn and clips the sprites at the edges. What the
+   // profile expects that Chip8 does otherwise, throws std::invalid_argument
+   // for unknown profiles.
+   static std::vector<Quirk> unemulatedQuirks(const std::string& profile);
+};
+
+// A ROM found in a library directory
+struct RomEntry
+{
+   // Path of the file, the directory and its name
+   std::string file;
+   std::string name;
+   // The content hash, of the image it decodes to, see Movie::hash
+   uint64_t hash;
+   // The file is hashed again when they change
+   uint64_t size;
+   int64_t modified;
+   // Raw images or "xxd" hex dumps
+   std::string format;
+};
+
+// The ROMs in a directory, by content hash, and the settings database.
+//
+// Scanning caches what it found in an index file in the directory, the
+// next scans only read the files whose size or modification time changed.
+// Files named as documents or sources (.DOC, .SRC, .txt...), hidden files,
+// subdirectories and anything bigger than the program area are left out.
+//
+// The database is a text file with a game per line, "<hash> <title>" and
+// then "ipf=<instructions per frame>", "quirks=<profile>" and
+// "<keyboard key>=<hexadecimal keypad key>" settings.
+class RomLibrary
+{
+public:
+   // Both throw std::invalid_argument
+   void scan(const std::string& directory);
+   void loadDatabase(const std::string& file);
+
+   const std::vector<RomEntry>& getEntries() const;
+   // By name or path, nullptr when it is not in the library
+   const RomEntry* find(const std::string& name) const;
+   // nullptr when the database doesn't have the game
+   const RomSettings* getSettings(uint64_t hash) const;
+   // Files read since the library was made, the rest came from the index
+   size_t getFilesRead() const;
+
+   // The image of a file of any of the formats, hex dumps are decoded
+   static std::shared_ptr<const Rom> load(const std::string& file);
+   static uint64_t hash(const Rom&);
+
+   // In every scanned directory
+   static const char* const IndexFile;
+
+private:
+   std::vector<RomEntry> entries;
+   std::unordered_map<uint64_t, RomSettings> settings;
+   size_t filesRead = 0;
+};
+
+#endif // _ROMLIBRARY_H_
@@ -0,0 +1,92 @@
+#include "SquareWave.h"
+
+#include <algorithm>
+
+namespace
+{
+   const sf::Int16 Amplitude = 6000;
+   const uint32_t HalfPeriod = 0x80000000;
+}
+
+SquareWave::SquareWave()
+:toneOn(false)
+,frameSamplesLeft(0)
+,phase(0)
+,underruns(0)
+,droppedFrames(0)
+{
+   initialize(1, SampleRate);
+}
+
+SquareWave::~SquareWave()
+{
+   // The stream thread may still be asking for samples
+   stop();
+}
+
+void
+SquareWave::queueFrame(bool frameToneOn)
+{
+   if (not frames.push(frameToneOn))
+   {
+      droppedFrames.fetch_add(1, std::memory_order_relaxed);
+   }
+}
+
+uint64_t
+SquareWave::getUnderruns() const
+{
+   return underruns.load(std::memory_order_relaxed);
+}
+
+uint64_t
+SquareWave::getDroppedFrames() const
+{
+   return droppedFrames.load(std::memory_order_relaxed);
+}
+
+bool
+SquareWave::onGetData(Chunk& chunk)
+{
+   const uint32_t step = static_cast<uint32_t>((uint64_t(Frequency) << 32) / SampleRate);
+
+   size_t sample = 0;
+   while (sample < ChunkSamples)
+   {
+      if (frameSamplesLeft == 0)
+      {
+         bool next = false;
+         if (not frames.front(next))
+         {
+            if (toneOn)
+            {
+               underruns.fetch_add(1, std::memory_order_relaxed);
+               toneOn = false;
+            }
+            // Silence until the next frame comes
+            std::fill(samples.begin() + sample, samples.end(), 0);
+            break;
+         }
+         frames.pop();
+         toneOn = next;
+         frameSamplesLeft = SamplesPerFrame;
+      }
+
+      auto count = std::min(frameSamplesLeft, ChunkSamples - sample);
+      frameSamplesLeft -= count;
+      for (auto end = sample + count; sample < end; ++sample)
+      {
+         samples[sample] = toneOn ? (phase & HalfPeriod ? Amplitude : -Amplitude) : 0;
+         phase += step;
+      }
+   }
+
+   chunk.samples = samples.data();
+   chunk.sampleCount = samples.size();
+   return true;
+}
+
+void
+SquareWave::onSeek(sf::Time)
+{
+}
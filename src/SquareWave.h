@@ -0,0 +1,57 @@
+#ifndef _SQUAREWAVE_H_
+#define _SQUAREWAVE_H_
+
+#include <SFML/Audio.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "Chip8Types.h"
+#include "RingBuffer.h"
+
+// The Chip 8 buzzer, a square wave synthesized while it is streamed.
+//
+// The emulation queues whether the tone is on for every frame it runs and
+// every frame is played as exactly SampleRate / FrameRate samples, so the
+// tone starts and stops with the frame the sound timer did. The samples are
+// handed to SFML in small chunks, the tone is heard a few milliseconds
+// after its frame ran.
+//
+// When the queue runs dry the stream plays silence, an underrun if the tone
+// was on. Frames queued while it is full are dropped, which bounds how far
+// behind the emulation the sound can get.
+class SquareWave : public sf::SoundStream
+{
+public:
+   static const unsigned SampleRate = 44100;
+   static const unsigned Frequency = 440;
+
+   SquareWave();
+   ~SquareWave();
+
+   // From the emulation thread, a frame at a time
+   void queueFrame(bool toneOn);
+
+   uint64_t getUnderruns() const;
+   uint64_t getDroppedFrames() const;
+
+private:
+   static const size_t SamplesPerFrame = SampleRate / FrameRate;
+   static const size_t ChunkSamples = 256;
+
+   bool onGetData(Chunk& chunk) override;
+   void onSeek(sf::Time) override;
+
+   // Four frames keep up with the host jitter without falling behind much
+   RingBuffer<bool, 4> frames;
+   std::array<sf::Int16, ChunkSamples> samples;
+   bool toneOn;
+   size_t frameSamplesLeft;
+   // A 32 bit fraction of the period, the high bit is the half of it
+   uint32_t phase;
+   std::atomic<uint64_t> underruns;
+   std::atomic<uint64_t> droppedFrames;
+};
+
+#endif // _SQUAREWAVE_H_
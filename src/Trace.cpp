@@ -0,0 +1,85 @@
+#include "Trace.h"
+
+#include <fstream>
+#include <stdexcept>
+
+namespace
+{
+   struct TraceHeader
+   {
+      uint32_t magic;
+      uint32_t version;
+      uint64_t entries;
+      uint64_t total;
+   };
+   const uint32_t TraceMagic = 0x52543843; // "C8TR"
+   const uint32_t TraceVersion = 1;
+}
+
+void
+Trace::save(const std::string& file) const
+{
+   TraceHeader header{TraceMagic, TraceVersion, entries.size(), total};
+   std::ofstream out(file, std::ios::binary);
+   if (not out.write(reinterpret_cast<const char*>(&header), sizeof(header)) or
+       not out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(TraceEntry)))
+   {
+      throw std::runtime_error(std::string("Cannot write trace ") + file);
+   }
+}
+
+Trace
+Trace::load(const std::string& file)
+{
+   std::ifstream in(file, std::ios::binary);
+   if (not in.is_open())
+   {
+      throw std::invalid_argument(std::string("Cannot open trace ") + file);
+   }
+   TraceHeader header;
+   if (not in.read(reinterpret_cast<char*>(&header), sizeof(header)) or
+       header.magic != TraceMagic or header.version != TraceVersion or header.entries > header.total)
+   {
+      throw std::invalid_argument(std::string("Not a trace of this version ") + file);
+   }
+
+   Trace trace;
+   trace.total = header.total;
+   trace.entries.resize(header.entries);
+   if (not in.read(reinterpret_cast<char*>(trace.entries.data()), header.entries * sizeof(TraceEntry)))
+   {
+      throw std::invalid_argument(std::string("Truncated trace ") + file);
+   }
+   return trace;
+}
+
+TraceRing::TraceRing(size_t capacity)
+:written(0)
+{
+   size_t size = 1;
+   while (size < capacity)
+   {
+      size <<= 1;
+   }
+   entries.reset(new TraceEntry[size]);
+   mask = size - 1;
+}
+
+Trace
+TraceRing::snapshot() const
+{
+   Trace trace;
+   trace.total = written;
+   auto begin = entries.get();
+   auto end = begin + mask + 1;
+   if (written <= mask + 1)
+   {
+      trace.entries.assign(begin, begin + written);
+      return trace;
+   }
+   // The oldest entry is the one the next push overwrites
+   auto oldest = begin + (written & mask);
+   trace.entries.assign(oldest, end);
+   trace.entries.insert(trace.entries.end(), begin, oldest);
+   return trace;
+}
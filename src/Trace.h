@@ -0,0 +1,71 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Chip8Types.h"
+
+// An opcode a Chip8 ran, with the registers it may have touched as they
+// were left by it
+struct TraceEntry
+{
+   // Frames run before it, the machine time it ran at
+   uint32_t frame;
+   Address pc;
+   Opcode opcode;
+   Counter I;
+   // The V registers named by the opcode and the flag
+   Register Vx;
+   Register Vy;
+   Register VF;
+   Timer delayTimer;
+};
+
+static_assert(sizeof(TraceEntry) == 16, "Trace files are these bytes");
+
+// The last opcodes a Chip8 ran, oldest first.
+//
+// On disk it is a header and the entries as they are in memory, in the host
+// byte order as save states are.
+struct Trace
+{
+   std::vector<TraceEntry> entries;
+   // Opcodes run since tracing started, the ones before the entries were
+   // overwritten
+   uint64_t total = 0;
+
+   // Throw std::invalid_argument or std::runtime_error
+   void save(const std::string& file) const;
+   static Trace load(const std::string& file);
+};
+
+// Fixed size ring of the last entries, writing one is a store and an
+// increment, nothing is ever allocated while tracing
+class TraceRing
+{
+public:
+   // Rounded up to a power of two
+   explicit TraceRing(size_t capacity);
+
+   void push(const TraceEntry& entry)
+   {
+      entries[written++ & mask] = entry;
+   }
+
+   Trace snapshot() const;
+
+private:
+   // Not initialized, the pages are only touched once written
+   std::unique_ptr<TraceEntry[]> entries;
+   size_t mask;
+   uint64_t written;
+};
+
+// Enough to see how a game got wherever it failed, 64 MB
+const size_t DefaultTraceEntries = 1 << 22;
+
+#endif // _TRACE_H_
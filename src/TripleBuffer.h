@@ -0,0 +1,65 @@
+#ifndef _TRIPLEBUFFER_H_
+#define _TRIPLEBUFFER_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Hands values from one writer thread to one reader thread without locks.
+//
+// The writer fills its back buffer and swaps it with the middle one, the
+// reader swaps the middle one with its front buffer only when there is a new
+// value in it. Neither of them ever waits on the other and the reader always
+// gets the newest value, the ones it didn't get to read are dropped.
+template<typename T>
+class TripleBuffer
+{
+public:
+   TripleBuffer()
+   :back(0)
+   ,middle(1)
+   ,front(2)
+   {}
+
+   TripleBuffer(const TripleBuffer&) = delete;
+   TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+   // Writer side, the back buffer is only seen by the reader once published
+   T& backBuffer()
+   {
+      return buffers[back];
+   }
+
+   void publish()
+   {
+      back = middle.exchange(back | Fresh, std::memory_order_acq_rel) & Index;
+   }
+
+   // Reader side, false when nothing was published since the last update
+   bool update()
+   {
+      if (not (middle.load(std::memory_order_relaxed) & Fresh))
+      {
+         return false;
+      }
+      front = middle.exchange(front, std::memory_order_acq_rel) & Index;
+      return true;
+   }
+
+   const T& frontBuffer() const
+   {
+      return buffers[front];
+   }
+
+private:
+   // The middle index has this bit set while it holds an unread value
+   static const uint8_t Fresh = 4;
+   static const uint8_t Index = 3;
+
+   std::array<T, 3> buffers;
+   uint8_t back;
+   std::atomic<uint8_t> middle;
+   uint8_t front;
+};
+
+#endif // _TRIPLEBUFFER_H_
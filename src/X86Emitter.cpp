@@ -0,0 +1,337 @@
+#include "X86Emitter.h"
+
+#include <stdexcept>
+#include <sys/mman.h>
+
+X86Emitter::X86Emitter(size_t capacity):
+   code(nullptr),
+   capacity(capacity),
+   size(0),
+   function(0),
+   overflowed(false)
+{
+   auto memory = mmap(nullptr, capacity, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (memory == MAP_FAILED)
+   {
+      throw std::runtime_error("Cannot map memory for recompiled code");
+   }
+   code = static_cast<uint8_t*>(memory);
+}
+
+X86Emitter::~X86Emitter()
+{
+   munmap(code, capacity);
+}
+
+bool X86Emitter::supported()
+{
+#if defined(__x86_64__)
+   return true;
+#else
+   return false;
+#endif
+}
+
+void X86Emitter::begin()
+{
+   protect(true);
+   function = size;
+   overflowed = false;
+}
+
+void* X86Emitter::end()
+{
+   protect(false);
+   if (overflowed)
+   {
+      size = function;
+      return nullptr;
+   }
+   return code + function;
+}
+
+bool X86Emitter::overflow() const
+{
+   return overflowed;
+}
+
+void X86Emitter::reset()
+{
+   size = 0;
+   function = 0;
+}
+
+void X86Emitter::protect(bool writable)
+{
+   if (mprotect(code, capacity, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0)
+   {
+      throw std::runtime_error("Cannot change the protection of recompiled code");
+   }
+}
+
+void X86Emitter::emit(uint8_t byte)
+{
+   if (size == capacity)
+   {
+      overflowed = true;
+      return;
+   }
+   code[size++] = byte;
+}
+
+void X86Emitter::emit16(uint16_t value)
+{
+   emit(value & 0xFF);
+   emit(value >> 8);
+}
+
+void X86Emitter::emit32(uint32_t value)
+{
+   emit16(value & 0xFFFF);
+   emit16(value >> 16);
+}
+
+void X86Emitter::rex(bool wide, Reg reg, Reg rm)
+{
+   emit(0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+void X86Emitter::modrm(uint8_t mod, uint8_t reg, uint8_t rm)
+{
+   emit((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [base + disp32], RSP and R12 as base need a SIB byte
+void X86Emitter::memory(Reg reg, Reg base, int32_t displacement)
+{
+   modrm(2, reg, base);
+   if ((base & 7) == RSP)
+   {
+      emit(0x24);
+   }
+   emit32(displacement);
+}
+
+void X86Emitter::byteOperation(uint8_t opcode, Reg dst, Reg src)
+{
+   rex(false, src, dst);
+   emit(opcode);
+   modrm(3, src, dst);
+}
+
+void X86Emitter::byteImmediate(uint8_t extension, Reg dst, uint8_t imm)
+{
+   rex(false, RAX, dst);
+   emit(0x80);
+   modrm(3, extension, dst);
+   emit(imm);
+}
+
+void X86Emitter::push(Reg reg)
+{
+   if (reg >= R8)
+   {
+      emit(0x41);
+   }
+   emit(0x50 | (reg & 7));
+}
+
+void X86Emitter::pop(Reg reg)
+{
+   if (reg >= R8)
+   {
+      emit(0x41);
+   }
+   emit(0x58 | (reg & 7));
+}
+
+void X86Emitter::ret()
+{
+   emit(0xC3);
+}
+
+void X86Emitter::movImm8(Reg dst, uint8_t imm)
+{
+   rex(false, RAX, dst);
+   emit(0xB0 | (dst & 7));
+   emit(imm);
+}
+
+void X86Emitter::addImm8(Reg dst, uint8_t imm)
+{
+   byteImmediate(0, dst, imm);
+}
+
+void X86Emitter::andImm8(Reg dst, uint8_t imm)
+{
+   byteImmediate(4, dst, imm);
+}
+
+void X86Emitter::cmpImm8(Reg dst, uint8_t imm)
+{
+   byteImmediate(7, dst, imm);
+}
+
+void X86Emitter::mov8(Reg dst, Reg src)
+{
+   byteOperation(0x88, dst, src);
+}
+
+void X86Emitter::or8(Reg dst, Reg src)
+{
+   byteOperation(0x08, dst, src);
+}
+
+void X86Emitter::and8(Reg dst, Reg src)
+{
+   byteOperation(0x20, dst, src);
+}
+
+void X86Emitter::xor8(Reg dst, Reg src)
+{
+   byteOperation(0x30, dst, src);
+}
+
+void X86Emitter::add8(Reg dst, Reg src)
+{
+   byteOperation(0x00, dst, src);
+}
+
+void X86Emitter::sub8(Reg dst, Reg src)
+{
+   byteOperation(0x28, dst, src);
+}
+
+void X86Emitter::cmp8(Reg dst, Reg src)
+{
+   byteOperation(0x38, dst, src);
+}
+
+void X86Emitter::shr8(Reg dst, uint8_t count)
+{
+   rex(false, RAX, dst);
+   emit(count == 1 ? 0xD0 : 0xC0);
+   modrm(3, 5, dst);
+   if (count != 1)
+   {
+      emit(count);
+   }
+}
+
+void X86Emitter::set8(Condition condition, Reg dst)
+{
+   rex(false, RAX, dst);
+   emit(0x0F);
+   emit(0x90 | condition);
+   modrm(3, 0, dst);
+}
+
+void X86Emitter::load8(Reg dst, Reg base, int32_t displacement)
+{
+   rex(false, dst, base);
+   emit(0x8A);
+   memory(dst, base, displacement);
+}
+
+void X86Emitter::store8(Reg base, int32_t displacement, Reg src)
+{
+   rex(false, src, base);
+   emit(0x88);
+   memory(src, base, displacement);
+}
+
+void X86Emitter::store16(Reg base, int32_t displacement, Reg src)
+{
+   emit(0x66);
+   rex(false, src, base);
+   emit(0x89);
+   memory(src, base, displacement);
+}
+
+void X86Emitter::storeImm16(Reg base, int32_t displacement, uint16_t imm)
+{
+   emit(0x66);
+   rex(false, RAX, base);
+   emit(0xC7);
+   memory(RAX, base, displacement);
+   emit16(imm);
+}
+
+void X86Emitter::add16(Reg base, int32_t displacement, Reg src)
+{
+   emit(0x66);
+   rex(false, src, base);
+   emit(0x01);
+   memory(src, base, displacement);
+}
+
+void X86Emitter::mov32(Reg dst, Reg src)
+{
+   rex(false, src, dst);
+   emit(0x89);
+   modrm(3, src, dst);
+}
+
+void X86Emitter::movZeroExtend8(Reg dst, Reg src)
+{
+   rex(false, dst, src);
+   emit(0x0F);
+   emit(0xB6);
+   modrm(3, dst, src);
+}
+
+void X86Emitter::cmpImm32(Reg dst, uint32_t imm)
+{
+   rex(false, RAX, dst);
+   emit(0x81);
+   modrm(3, 7, dst);
+   emit32(imm);
+}
+
+// lea dst, [src + src * 4 + 0], the displacement keeps RBP and R13 usable
+void X86Emitter::times5(Reg dst, Reg src)
+{
+   emit(0x40 | ((dst >> 3) << 2) | ((src >> 3) << 1) | (src >> 3));
+   emit(0x8D);
+   modrm(1, dst, RSP);
+   emit((2 << 6) | ((src & 7) << 3) | (src & 7));
+   emit(0);
+}
+
+void X86Emitter::movImm64(Reg dst, uint64_t imm)
+{
+   rex(true, RAX, dst);
+   emit(0xB8 | (dst & 7));
+   emit32(imm & 0xFFFFFFFF);
+   emit32(imm >> 32);
+}
+
+X86Emitter::Label X86Emitter::jump()
+{
+   emit(0xE9);
+   auto label = size;
+   emit32(0);
+   return label;
+}
+
+X86Emitter::Label X86Emitter::jump(Condition condition)
+{
+   emit(0x0F);
+   emit(0x80 | condition);
+   auto label = size;
+   emit32(0);
+   return label;
+}
+
+void X86Emitter::bind(Label label)
+{
+   if (overflowed)
+   {
+      return;
+   }
+   uint32_t offset = size - (label + 4);
+   for (size_t i = 0; i < 4; ++i)
+   {
+      code[label + i] = (offset >> (i * 8)) & 0xFF;
+   }
+}
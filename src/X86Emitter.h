@@ -0,0 +1,105 @@
+#ifndef _X86EMITTER_H_
+#define _X86EMITTER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Minimal x86-64 code emitter for the recompiler, it only knows the
+// encodings the recompiled opcodes need.
+//
+// The code lives in an mmap'd buffer which is never writable and executable
+// at the same time: it is writable between begin() and end() only.
+class X86Emitter
+{
+public:
+   enum Reg : uint8_t
+   {
+      RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+      R8,  R9,  R10, R11, R12, R13, R14, R15,
+   };
+
+   enum Condition : uint8_t
+   {
+      Equal    = 0x4,
+      NotEqual = 0x5,
+      Above    = 0x7,
+   };
+
+   // Position of a rel32 to be patched by bind
+   using Label = size_t;
+
+   explicit X86Emitter(size_t capacity);
+   ~X86Emitter();
+   X86Emitter(const X86Emitter&) = delete;
+   X86Emitter& operator=(const X86Emitter&) = delete;
+
+   // Whether the host can run the emitted code at all
+   static bool supported();
+
+   // Everything emitted between them is a function, end returns its entry
+   void begin();
+   void* end();
+   // Whether the last function did not fit, end returned nullptr for it
+   bool overflow() const;
+   // Drops every function emitted so far
+   void reset();
+
+   void push(Reg reg);
+   void pop(Reg reg);
+   void ret();
+
+   // 8 bits registers, always encoded with REX so SPL, BPL, SIL and DIL
+   // are used instead of AH, CH, DH and BH.
+   void movImm8(Reg dst, uint8_t imm);
+   void addImm8(Reg dst, uint8_t imm);
+   void andImm8(Reg dst, uint8_t imm);
+   void cmpImm8(Reg dst, uint8_t imm);
+   void mov8(Reg dst, Reg src);
+   void or8(Reg dst, Reg src);
+   void and8(Reg dst, Reg src);
+   void xor8(Reg dst, Reg src);
+   void add8(Reg dst, Reg src);
+   void sub8(Reg dst, Reg src);
+   void cmp8(Reg dst, Reg src);
+   void shr8(Reg dst, uint8_t count);
+   void set8(Condition condition, Reg dst);
+   void load8(Reg dst, Reg base, int32_t displacement);
+   void store8(Reg base, int32_t displacement, Reg src);
+
+   // 16 bits memory operands
+   void store16(Reg base, int32_t displacement, Reg src);
+   void storeImm16(Reg base, int32_t displacement, uint16_t imm);
+   void add16(Reg base, int32_t displacement, Reg src);
+
+   // 32 bits registers
+   void mov32(Reg dst, Reg src);
+   void movZeroExtend8(Reg dst, Reg src);
+   void cmpImm32(Reg dst, uint32_t imm);
+   // dst = src * 5
+   void times5(Reg dst, Reg src);
+
+   void movImm64(Reg dst, uint64_t imm);
+
+   Label jump();
+   Label jump(Condition condition);
+   void bind(Label label);
+
+private:
+   uint8_t* code;
+   size_t capacity;
+   size_t size;
+   size_t function;
+   bool overflowed;
+
+   void emit(uint8_t byte);
+   void emit16(uint16_t value);
+   void emit32(uint32_t value);
+   void rex(bool wide, Reg reg, Reg rm);
+   void modrm(uint8_t mod, uint8_t reg, uint8_t rm);
+   void memory(Reg reg, Reg base, int32_t displacement);
+   void byteOperation(uint8_t opcode, Reg dst, Reg src);
+   void byteImmediate(uint8_t extension, Reg dst, uint8_t imm);
+   void protect(bool writable);
+};
+
+#endif // _X86EMITTER_H_
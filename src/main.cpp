@@ -1,12 +1,20 @@
+#include <algorithm>
 #include <array>
-#include <bitset>
+#include <chrono>
 #include <future>
+#include <iomanip>
 #include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
 #include <getopt.h>
-#include <unordered_map>
 
 #include "Chip8.h" 
+#include "ControlFlowGraph.h"
 #include "Display.h"
+#include "EmulationThread.h"
+#include "RomLibrary.h"
+#include "SquareWave.h"
 
 //Keypad                   Keyboard
 //+-+-+-+-+                +-+-+-+-+
@@ -19,30 +27,109 @@
 //|A|0|B|F|                |Z|X|C|V|
 //+-+-+-+-+                +-+-+-+-+
 
-std::map<sf::Keyboard::Key, Key> sfmlToChip9Key = 
+// Chip 8 key for every SFML key, -1 when it is not mapped, so a key event is
+// a single lookup; the settings of the game may map more keys
+std::array<int8_t, sf::Keyboard::KeyCount> sfmlToChip8Key = []
 {
-   {sf::Keyboard::Num1, Key::Num1},      
-   {sf::Keyboard::Num2, Key::Num2},      
-   {sf::Keyboard::Num3, Key::Num3},      
-   {sf::Keyboard::Num4, Key::C},      
-   {sf::Keyboard::Q,    Key::Num4},      
-   {sf::Keyboard::W,    Key::Num5},      
-   {sf::Keyboard::E,    Key::Num6},      
-   {sf::Keyboard::R,    Key::D},      
-   {sf::Keyboard::A,    Key::Num7},      
-   {sf::Keyboard::S,    Key::Num8},      
-   {sf::Keyboard::D,    Key::Num9},      
-   {sf::Keyboard::F,    Key::E},      
-   {sf::Keyboard::Z,    Key::A},      
-   {sf::Keyboard::X,    Key::Num0},      
-   {sf::Keyboard::C,    Key::B},      
-   {sf::Keyboard::V,    Key::F},      
-};
+   std::array<int8_t, sf::Keyboard::KeyCount> keys;
+   keys.fill(-1);
+   for (const auto& mapping : std::initializer_list<std::pair<sf::Keyboard::Key, Key>>
+   {
+      {sf::Keyboard::Num1, Key::Num1},
+      {sf::Keyboard::Num2, Key::Num2},
+      {sf::Keyboard::Num3, Key::Num3},
+      {sf::Keyboard::Num4, Key::C},
+      {sf::Keyboard::Q,    Key::Num4},
+      {sf::Keyboard::W,    Key::Num5},
+      {sf::Keyboard::E,    Key::Num6},
+      {sf::Keyboard::R,    Key::D},
+      {sf::Keyboard::A,    Key::Num7},
+      {sf::Keyboard::S,    Key::Num8},
+      {sf::Keyboard::D,    Key::Num9},
+      {sf::Keyboard::F,    Key::E},
+      {sf::Keyboard::Z,    Key::A},
+      {sf::Keyboard::X,    Key::Num0},
+      {sf::Keyboard::C,    Key::B},
+      {sf::Keyboard::V,    Key::F},
+   })
+   {
+      keys[mapping.first] = static_cast<int8_t>(mapping.second);
+   }
+   return keys;
+}();
+
+bool toChip8Key(sf::Keyboard::Key sfKey, Key& key)
+{
+   if (sfKey < 0 or sfKey >= sf::Keyboard::KeyCount or sfmlToChip8Key[sfKey] < 0)
+   {
+      return false;
+   }
+   key = static_cast<Key>(sfmlToChip8Key[sfKey]);
+   return true;
+}
+
+// The keyboard key names of the settings database
+bool mapKey(const std::string& name, Key key)
+{
+   static const std::initializer_list<std::pair<const char*, sf::Keyboard::Key>> named =
+   {
+      {"Up", sf::Keyboard::Up},
+      {"Down", sf::Keyboard::Down},
+      {"Left", sf::Keyboard::Left},
+      {"Right", sf::Keyboard::Right},
+      {"Space", sf::Keyboard::Space},
+      {"Return", sf::Keyboard::Return},
+   };
+   auto sfKey = sf::Keyboard::Unknown;
+   for (const auto& candidate : named)
+   {
+      if (name == candidate.first)
+      {
+         sfKey = candidate.second;
+      }
+   }
+   if (name.size() == 1 and name[0] >= 'A' and name[0] <= 'Z')
+   {
+      sfKey = static_cast<sf::Keyboard::Key>(sf::Keyboard::A + (name[0] - 'A'));
+   }
+   else if (name.size() == 1 and name[0] >= '0' and name[0] <= '9')
+   {
+      sfKey = static_cast<sf::Keyboard::Key>(sf::Keyboard::Num0 + (name[0] - '0'));
+   }
+   if (sfKey == sf::Keyboard::Unknown)
+   {
+      return false;
+   }
+   sfmlToChip8Key[sfKey] = static_cast<int8_t>(key);
+   return true;
+}
 
 struct Options
 {
+   // The game's from the settings database when not given, DefaultCpuRate
+   // for games it doesn't have
    uint32_t cpu_rate = 0;
+   // A file, or the name of one in the library
    std::string rom_file;
+   std::string library_dir;
+   std::string database_file = "roms.db";
+   // F5 saves the state to it and F9 loads it back, the ROM file with
+   // ".state" appended by default
+   std::string state_file;
+   // Records the session as a movie chip8batch --movie replays
+   std::string movie_file;
+   // Keeps the last opcodes run, F12 writes them to it and so does an error
+   // stopping the emulation, chip8trace reads it
+   std::string trace_file;
+   // Times real time when F7 turns the turbo on, 0 as fast as it can
+   uint32_t turbo = 4;
+   PostProcess::Scaler scaler = PostProcess::Scaler::Nearest;
+   // Percent of its brightness a pixel keeps every frame after it is
+   // turned off, so sprites redrawn with XOR don't flicker
+   uint32_t phosphor = 50;
+   // Where the code of the game found statically starts, decoded before the
+   // first frame
+   std::vector<Address> leaders;
 };
 
 void setupInput()
@@ -51,7 +138,11 @@ void setupInput()
 
 void printUsage()
 {
-   std::cout << "Usage: chip8emulator --rom-file|-r 'ROM file' [--cpu-rate|-c 'rate' ]" << std::endl;
+   std::cout << "Usage: chip8emulator --rom-file|-r 'ROM file' [--cpu-rate|-c 'rate, at least 60' ] "
+                "[--library|-l 'ROM directory' ] [--database|-d 'settings file' ] "
+                "[--state-file|-s 'file' ] [--record|-m 'movie file' ] "
+                "[--trace|-t 'trace file' ] [--turbo|-u 'speed' ] "
+                "[--scaler|-x nearest|scale2x ] [--phosphor|-p 'percent' ]" << std::endl;
    exit(EXIT_FAILURE);
 }
 
@@ -64,12 +155,20 @@ Options loadOptions(int argc, char** argv)
    {
       {"cpu-rate", required_argument,  0, 'c'},
       {"rom-file", required_argument,  0, 'r'},
+      {"library", required_argument,   0, 'l'},
+      {"database", required_argument,  0, 'd'},
+      {"state-file", required_argument, 0, 's'},
+      {"record",  required_argument,   0, 'm'},
+      {"trace",   required_argument,   0, 't'},
+      {"turbo",   required_argument,   0, 'u'},
+      {"scaler",  required_argument,   0, 'x'},
+      {"phosphor", required_argument,  0, 'p'},
       {"help",    no_argument,         0, 'h'},
       {0, 0, 0, 0}
    };
   
    int option_index = 0;
-   while ((opt = getopt_long (argc, argv, "r:ch", long_options, &option_index)) != -1)
+   while ((opt = getopt_long (argc, argv, "r:c:l:d:s:m:t:u:x:p:h", long_options, &option_index)) != -1)
    {
       switch (opt) 
       {
@@ -79,10 +178,42 @@ Options loadOptions(int argc, char** argv)
                throw std::invalid_argument("Invalid cpu rate");
             }
             options.cpu_rate = atoi(optarg);
+            if (options.cpu_rate < FrameRate)
+            {
+               throw std::invalid_argument("The cpu rate has to be at least one opcode per frame");
+            }
             break;
          case 'r':
             options.rom_file = optarg;
             break;
+         case 'l':
+            options.library_dir = optarg;
+            break;
+         case 'd':
+            options.database_file = optarg;
+            break;
+         case 's':
+            options.state_file = optarg;
+            break;
+         case 'm':
+            options.movie_file = optarg;
+            break;
+         case 't':
+            options.trace_file = optarg;
+            break;
+         case 'u':
+            options.turbo = atoi(optarg);
+            break;
+         case 'x':
+            options.scaler = PostProcess::parseScaler(optarg);
+            break;
+         case 'p':
+            options.phosphor = atoi(optarg);
+            if (options.phosphor > 100)
+            {
+               throw std::invalid_argument("Invalid phosphor percent");
+            }
+            break;
          case 'h':
             printUsage();
             break;
@@ -95,12 +226,91 @@ Options loadOptions(int argc, char** argv)
    return options;
 }
 
+// Whether any opcode the game can reach has the quirk
+bool runsQuirk(const ControlFlowGraph& graph, const Rom& rom, const RomSettings::Quirk& quirk)
+{
+   for (const auto& block : graph.getBlocks())
+   {
+      for (size_t address = block.start; address < block.end; address += 2)
+      {
+         auto offset = address - ProgramStart;
+         Opcode opcode = rom.data()[offset] << 8 | rom.data()[offset + 1];
+         if ((opcode & quirk.mask) == quirk.opcode)
+         {
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+// Finds the game in the library and applies its settings
+std::shared_ptr<const Rom> loadRom(Options& options)
+{
+   RomLibrary library;
+   if (not options.library_dir.empty())
+   {
+      library.scan(options.library_dir);
+      auto entry = library.find(options.rom_file);
+      if (entry)
+      {
+         options.rom_file = entry->file;
+      }
+   }
+   try
+   {
+      library.loadDatabase(options.database_file);
+   }
+   catch (const std::invalid_argument& e)
+   {
+      std::cerr << "No game settings: " << e.what() << std::endl;
+   }
+
+   auto rom = RomLibrary::load(options.rom_file);
+   auto graph = ControlFlowGraph::build(*rom);
+   options.leaders = graph.leaders();
+   auto settings = library.getSettings(RomLibrary::hash(*rom));
+   if (settings)
+   {
+      if (options.cpu_rate == 0)
+      {
+         options.cpu_rate = settings->instructionsPerFrame * FrameRate;
+      }
+      for (const auto& quirk : RomSettings::unemulatedQuirks(settings->quirks))
+      {
+         if (runsQuirk(graph, *rom, quirk))
+         {
+            std::cerr << settings->title << " was written for " << settings->quirks << ", where "
+                      << quirk.description << ", that is not emulated" << std::endl;
+         }
+      }
+      for (const auto& key : settings->keys)
+      {
+         if (not mapKey(key.first, key.second))
+         {
+            std::cerr << "Unknown key " << key.first << " in the settings of " << settings->title << std::endl;
+         }
+      }
+   }
+   if (options.cpu_rate == 0)
+   {
+      options.cpu_rate = DefaultCpuRate;
+   }
+   if (options.state_file.empty())
+   {
+      options.state_file = options.rom_file + ".state";
+   }
+   return rom;
+}
+
 int main(int argc, char **argv) 
 {
    Options options;
+   std::shared_ptr<const Rom> rom;
    try
    {
       options = loadOptions(argc, argv);
+      rom = loadRom(options);
    }
    catch (std::invalid_argument e)
    {
@@ -110,70 +320,192 @@ int main(int argc, char **argv)
 
 
    Display display;
+   display.setPostProcessing(options.scaler, std::min<uint32_t>(options.phosphor * 256 / 100, 255));
    setupInput();
 
    Chip8 chip8;
    
    chip8.setCpuRate(options.cpu_rate);
-   chip8.loadGame(options.rom_file);
+   chip8.loadGame(*rom);
+   chip8.predecode(options.leaders);
    
-   auto cycleCallback = [&]
+   // The Chip8 runs on its own thread, the display only presents its frames
+   EmulationThread emulation(chip8);
+
+   SquareWave sound;
+   emulation.setSound([&sound](bool toneOn)
+   {
+      sound.queueFrame(toneOn);
+   });
+
+   Movie movie;
+   if (not options.movie_file.empty())
+   {
+      std::random_device rd;
+      movie.seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+      movie.cpuRate = options.cpu_rate;
+      movie.romHash = RomLibrary::hash(*rom);
+      chip8.setSeed(movie.seed);
+      emulation.record(&movie);
+   }
+
+   if (not options.trace_file.empty())
+   {
+      chip8.setTrace(DefaultTraceEntries);
+      emulation.traceTo(options.trace_file);
+   }
+
+   // Tab runs it as fast as it can while held, F7 toggles the turbo
+   bool fastForward = false;
+   bool turbo = false;
+   bool turboHeld = false;
+   auto applySpeed = [&]
    {
-      chip8.emulateCycle();
-      return std::make_pair(chip8.drawNeeded(), chip8.beepNeeded());
+      emulation.setSpeed(fastForward ? EmulationThread::Uncapped : turbo ? options.turbo : 1);
    };
- 
-   auto drawCallback = [&]
+
+   // The speed reached is shown in the title, measured every second
+   using Clock = std::chrono::steady_clock;
+   auto measured = Clock::now();
+   auto framesMeasured = emulation.getFramesRun();
+   std::string title = Display::Title;
+   auto frameCallback = [&]
    {
-      for (size_t y = 0; y < ScreenYLimit; y++)
+      auto now = Clock::now();
+      if (now - measured >= std::chrono::seconds(1))
       {
-         size_t y_offset = y * ScreenXLimit;
-         for (size_t x = 0; x < ScreenXLimit; x++)
+         auto frames = emulation.getFramesRun();
+         auto speedup = (frames - framesMeasured) / (std::chrono::duration<double>(now - measured).count() * FrameRate);
+         std::ostringstream status;
+         status << Display::Title;
+         if (fastForward or turbo)
          {
-            auto bits = std::bitset<8>(chip8.getGraphics().at(y_offset + x));
-            for (size_t i = 0; i < 8; ++i)
-            {
-               if (bits[i])
-               {
-                  display.drawPixel(x, y);
-               }
-            }
+            auto uncapped = fastForward or options.turbo == EmulationThread::Uncapped;
+            status << (uncapped ? " - fast forward" : " - turbo x" + std::to_string(options.turbo))
+                   << ", " << std::fixed << std::setprecision(1) << speedup << "x";
+         }
+         if (status.str() != title)
+         {
+            title = status.str();
+            display.setTitle(title);
          }
+         measured = now;
+         framesMeasured = frames;
       }
+      return emulation.newFrame();
+   };
+ 
+   auto drawCallback = [&]
+   {
+      display.drawGraphics(emulation.getGraphics());
    };
    
    Display::KeyboardCallbacks keyboard;
    Display::TouchpadCallbacks touchpad;
    
+   // Key events are queued to the emulation thread, besides the keypad F5
+   // saves the state, F9 loads it, F12 dumps the trace, Backspace rewinds
+   // while held and Tab and F7 speed it up
    keyboard.keyPressed = [&]
    (sf::Keyboard::Key sfKey)
    {
-      try
+      Key key;
+      if (sfKey == sf::Keyboard::F5)
       {
-         auto key = sfmlToChip9Key.at(sfKey);
-         std::cout << "Pressing key " << key << std::endl;
-         chip8.pressKey(key);
+         emulation.saveState(options.state_file);
+      }
+      else if (sfKey == sf::Keyboard::F9)
+      {
+         emulation.loadState(options.state_file);
+      }
+      else if (sfKey == sf::Keyboard::F12)
+      {
+         emulation.dumpTrace();
+      }
+      else if (sfKey == sf::Keyboard::BackSpace)
+      {
+         emulation.setRewinding(true);
+      }
+      else if (sfKey == sf::Keyboard::Tab)
+      {
+         fastForward = true;
+         applySpeed();
+      }
+      else if (sfKey == sf::Keyboard::F7)
+      {
+         // Held keys repeat, it only toggles once per press
+         if (not turboHeld)
+         {
+            turbo = not turbo;
+            applySpeed();
+         }
+         turboHeld = true;
+      }
+      else if (toChip8Key(sfKey, key))
+      {
+         emulation.pressKey(key);
       }
-      catch(...)
-      {}
    };
  
    keyboard.keyReleased = [&]
    (sf::Keyboard::Key sfKey)
    {
-      try
+      Key key;
+      if (sfKey == sf::Keyboard::BackSpace)
+      {
+         emulation.setRewinding(false);
+      }
+      else if (sfKey == sf::Keyboard::Tab)
       {
-         auto key = sfmlToChip9Key.at(sfKey);
-         std::cout << "Releasing key " << key << std::endl;
-         chip8.releaseKey(key);
+         fastForward = false;
+         applySpeed();
+      }
+      else if (sfKey == sf::Keyboard::F7)
+      {
+         turboHeld = false;
+      }
+      else if (toChip8Key(sfKey, key))
+      {
+         emulation.releaseKey(key);
       }
-      catch(...)
-      {}
    };
    
 
 
-   display.loop(cycleCallback, drawCallback, keyboard, touchpad);
+   emulation.start();
+   sound.play();
+   display.loop(frameCallback, drawCallback, keyboard, touchpad);
+   emulation.stop();
+   sound.stop();
+
+   if (not options.movie_file.empty())
+   {
+      movie.finalHash = Movie::hash(chip8.saveState());
+      movie.save(options.movie_file);
+      std::cout << "Recorded " << movie.frames << " frames and " << movie.events.size()
+                << " key events to " << options.movie_file << std::endl;
+   }
+
+   const auto& rewind = emulation.getRewind();
+   if (rewind.frames() > 0)
+   {
+      auto minutes = rewind.frames() / (60.0 * FrameRate);
+      std::cout << "Rewind: " << rewind.frames() / FrameRate << " s of history in "
+                << rewind.memoryUsage() / 1024 << " KB, "
+                << static_cast<size_t>(rewind.memoryUsage() / 1024 / minutes) << " KB per minute, "
+                << rewind.nanosecondsPerSnapshot() / 1000 << " us per snapshot" << std::endl;
+   }
+
+   if (sound.getUnderruns() > 0 or sound.getDroppedFrames() > 0)
+   {
+      std::cout << "Sound: " << sound.getUnderruns() << " underruns, "
+                << sound.getDroppedFrames() << " frames dropped" << std::endl;
+   }
+
+   if (Chip8::statsEnabled())
+   {
+      std::cout << chip8.getStats();
+   }
 
    return 0;
 }
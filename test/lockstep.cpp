@@ -0,0 +1,251 @@
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include "Chip8.h"
+#include "Chip8Lockstep.h"
+#include "Rom.h"
+#include "RomLibrary.h"
+
+// Runs every ROM in a Chip8Lockstep and in a Chip8 per lane, with the same
+// seeds and keys, and fails when a lane and its Chip8 draw a different frame
+// or stop with a different error. The lanes run vectorized, when the host
+// can, and on their own, at a few cpu rates. Some programs made to hit the
+// edge cases of the opcodes are run as well as the ROMs given.
+//
+// The even lanes are never given keys, so there are always some running in
+// lockstep, the odd ones press a different key every few frames.
+
+struct Options
+{
+   uint64_t frames = 1200;
+   size_t lanes = 8;
+   std::vector<std::string> rom_files;
+};
+
+struct Program
+{
+   std::string name;
+   std::vector<uint8_t> bytes;
+};
+
+const std::vector<uint32_t> CpuRates = {FrameRate, DefaultCpuRate, 2000, 6000};
+
+// Frames a key is held
+const uint64_t KeyFrames = 20;
+
+const std::vector<Program> EdgeCases =
+{
+   // Fx55, Fx65, Fx33 and Dxyn around the end of memory and past it
+   {"wrap", {0x60, 0xAA, 0x61, 0x55, 0x62, 0xF0, 0x63, 0x0F, 0xAF, 0xFF, 0xF3, 0x55,
+             0xF3, 0x65, 0xAF, 0xFE, 0xF0, 0x33, 0x64, 0x08, 0x65, 0x04, 0xA0, 0x00,
+             0xD4, 0x55, 0xAF, 0xFE, 0xD5, 0x43, 0x6F, 0xFF, 0xAF, 0xF0, 0xFF, 0x1E,
+             0xF2, 0x55, 0xF2, 0x65, 0xA0, 0xEF, 0xD4, 0x53, 0x12, 0x2C}},
+   // Ex9E and ExA1 with a Vx past the keys
+   {"keys", {0x60, 0xF1, 0x61, 0x00, 0xE0, 0x9E, 0x61, 0x10, 0xA0, 0x00, 0xD1, 0x15,
+             0xE0, 0xA1, 0x61, 0x20, 0xD1, 0x15, 0x12, 0x00}},
+   {"stack overflow", {0x22, 0x00}},
+   {"stack underflow", {0x00, 0xEE}},
+   {"unknown opcode", {0x80, 0x08}},
+   // Bnnn out of memory
+   {"jump out", {0x60, 0xFF, 0xBF, 0xFF}},
+};
+
+void printUsage()
+{
+   std::cout << "Usage: lockstep [--frames|-f 'frames'] [--lanes|-l 'machines'] ROM..." << std::endl;
+   exit(EXIT_FAILURE);
+}
+
+Options loadOptions(int argc, char** argv)
+{
+   Options options;
+   int opt = 0;
+
+   static struct option long_options[] =
+   {
+      {"frames", required_argument,  0, 'f'},
+      {"lanes",  required_argument,  0, 'l'},
+      {"help",   no_argument,        0, 'h'},
+      {0, 0, 0, 0}
+   };
+
+   int option_index = 0;
+   while ((opt = getopt_long (argc, argv, "f:l:h", long_options, &option_index)) != -1)
+   {
+      switch (opt)
+      {
+         case 'f':
+            options.frames = std::stoull(optarg);
+            break;
+         case 'l':
+            options.lanes = std::stoul(optarg);
+            if (options.lanes == 0)
+            {
+               throw std::invalid_argument("No lanes");
+            }
+            break;
+         case 'h':
+            printUsage();
+            break;
+         default:
+            throw std::invalid_argument(std::string(1, static_cast<char>(opt)));
+      }
+   }
+
+   for (int i = optind; i < argc; ++i)
+   {
+      options.rom_files.push_back(argv[i]);
+   }
+   return options;
+}
+
+// The message of what it throws, empty if nothing
+std::string error(const std::function<void()>& run)
+{
+   try
+   {
+      run();
+   }
+   catch (const std::exception& e)
+   {
+      return e.what();
+   }
+   return std::string();
+}
+
+// Gives what differs, empty if nothing
+std::string compare(const Rom& rom, const Options& options, uint64_t frames, uint32_t cpuRate, bool vectorized)
+{
+   Chip8Lockstep lanes(options.lanes);
+   lanes.setCpuRate(cpuRate);
+   lanes.setVectorized(vectorized);
+   std::vector<std::unique_ptr<Chip8>> machines;
+   for (size_t lane = 0; lane < options.lanes; ++lane)
+   {
+      lanes.setSeed(lane, lane);
+      machines.emplace_back(new Chip8);
+      machines[lane]->setCpuRate(cpuRate);
+      machines[lane]->setSeed(lane);
+      machines[lane]->loadGame(rom);
+   }
+   lanes.loadGame(rom);
+
+   for (uint64_t frame = 0; frame < frames; ++frame)
+   {
+      if (frame % KeyFrames == 0)
+      {
+         for (size_t lane = 1; lane < options.lanes; lane += 2)
+         {
+            auto key = static_cast<Key>((frame / KeyFrames * 7 + lane) % 16);
+            auto previous = static_cast<Key>((frame / KeyFrames * 7 + lane + 9) % 16);
+            lanes.releaseKey(lane, previous);
+            machines[lane]->releaseKey(previous);
+            lanes.pressKey(lane, key);
+            machines[lane]->pressKey(key);
+         }
+      }
+
+      auto lanesError = error([&] { lanes.emulateFrame(); });
+      bool matched = lanesError.empty();
+      for (size_t lane = 0; lane < options.lanes; ++lane)
+      {
+         auto machineError = error([&] { machines[lane]->emulateFrame(); });
+         if (not machineError.empty() and lanesError.empty())
+         {
+            return "frame " + std::to_string(frame) + ", lane " + std::to_string(lane) +
+                   " stopped by " + machineError + " only in Chip8";
+         }
+         matched = matched or machineError == lanesError;
+      }
+      if (not matched)
+      {
+         return "frame " + std::to_string(frame) + ", " + lanesError + " only in the lanes";
+      }
+      if (not lanesError.empty())
+      {
+         // Both stopped, the lanes past the one that threw did not run
+         return std::string();
+      }
+      for (size_t lane = 0; lane < options.lanes; ++lane)
+      {
+         if (lanes.getGraphics(lane) != machines[lane]->getGraphics())
+         {
+            return "frame " + std::to_string(frame) + ", lane " + std::to_string(lane) + " draws differently";
+         }
+      }
+   }
+   return std::string();
+}
+
+int main(int argc, char **argv)
+{
+   Options options;
+   try
+   {
+      options = loadOptions(argc, argv);
+   }
+   catch (const std::exception& e)
+   {
+      std::cerr << "Invalid argument " << e.what() << std::endl;
+      printUsage();
+   }
+
+   struct Case
+   {
+      std::string name;
+      std::shared_ptr<const Rom> rom;
+      uint64_t frames;
+   };
+   std::vector<Case> roms;
+   // The edge cases are over in a few frames, even at one opcode a frame
+   for (const auto& program : EdgeCases)
+   {
+      roms.push_back(Case{program.name, Rom::view(program.bytes.data(), program.bytes.size()), 40});
+   }
+   for (const auto& rom_file : options.rom_files)
+   {
+      try
+      {
+         roms.push_back(Case{rom_file, RomLibrary::load(rom_file), options.frames});
+      }
+      catch (const std::exception& e)
+      {
+         std::cerr << rom_file << ": " << e.what() << std::endl;
+         return EXIT_FAILURE;
+      }
+   }
+
+   std::vector<bool> modes = {false};
+   if (Chip8Lockstep::vectorSupported())
+   {
+      modes.push_back(true);
+   }
+
+   size_t cases = 0;
+   size_t failures = 0;
+   for (const auto& rom : roms)
+   {
+      for (auto cpuRate : CpuRates)
+      {
+         for (auto vectorized : modes)
+         {
+            ++cases;
+            auto difference = compare(*rom.rom, options, rom.frames, cpuRate, vectorized);
+            if (not difference.empty())
+            {
+               ++failures;
+               std::cout << rom.name << " at " << cpuRate << (vectorized ? " vectorized" : " on their own")
+                         << ": " << difference << std::endl;
+            }
+         }
+      }
+   }
+   std::cout << cases - failures << " of " << cases << " runs of " << options.lanes
+             << " lanes the same as Chip8" << std::endl;
+   return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
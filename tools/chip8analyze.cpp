@@ -0,0 +1,88 @@
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <getopt.h>
+
+#include "ControlFlowGraph.h"
+#include "RomLibrary.h"
+
+// Finds the code of a ROM without running it and prints its basic blocks
+// with their disassembly and the data between them, or a Graphviz graph of
+// the blocks with --dot.
+
+struct Options
+{
+   bool dot = false;
+   std::string rom_file;
+};
+
+void printUsage()
+{
+   std::cout << "Usage: chip8analyze [--dot|-g] 'ROM file'" << std::endl;
+   exit(EXIT_FAILURE);
+}
+
+Options loadOptions(int argc, char** argv)
+{
+   Options options;
+   int opt = 0;
+
+   static struct option long_options[] =
+   {
+      {"dot",    no_argument,        0, 'g'},
+      {"help",   no_argument,        0, 'h'},
+      {0, 0, 0, 0}
+   };
+
+   int option_index = 0;
+   while ((opt = getopt_long (argc, argv, "gh", long_options, &option_index)) != -1)
+   {
+      switch (opt)
+      {
+         case 'g':
+            options.dot = true;
+            break;
+         case 'h':
+            printUsage();
+            break;
+         default:
+            throw std::invalid_argument(std::string(1, static_cast<char>(opt)));
+      }
+   }
+
+   if (optind + 1 != argc)
+   {
+      throw std::invalid_argument("One ROM file is needed");
+   }
+   options.rom_file = argv[optind];
+   return options;
+}
+
+int main(int argc, char **argv)
+{
+   Options options;
+   std::shared_ptr<const Rom> rom;
+   try
+   {
+      options = loadOptions(argc, argv);
+      rom = RomLibrary::load(options.rom_file);
+   }
+   catch (const std::exception& e)
+   {
+      std::cerr << "Invalid argument " << e.what() << std::endl;
+      printUsage();
+   }
+
+   auto graph = ControlFlowGraph::build(*rom);
+   if (options.dot)
+   {
+      graph.printDot(std::cout);
+      return EXIT_SUCCESS;
+   }
+
+   std::cout << options.rom_file << ": " << rom->size() << " bytes, " << graph.codeBytes() << " of code in "
+             << graph.getBlocks().size() << " blocks, " << graph.getData().size() << " data regions, "
+             << graph.indirectJumps() << " indirect jumps" << std::endl;
+   graph.printText(std::cout);
+   return EXIT_SUCCESS;
+}
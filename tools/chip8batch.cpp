@@ -0,0 +1,626 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <getopt.h>
+
+#include "Chip8.h"
+#include "Chip8Lockstep.h"
+#include "Movie.h"
+#include "Rewind.h"
+#include "Rom.h"
+#include "RomLibrary.h"
+
+// Runs many ROMs headless, one Chip8 per job, on a pool of worker threads.
+// Every ROM file is mapped once and all of its jobs load that image.
+//
+// Games run a frame at a time as they do in the emulator, the cycles are
+// rounded up to whole frames.
+//
+// The input script has one event per line: "<cycle> press|release <key>"
+// where key is the hexadecimal keypad value (0-F), empty lines and lines
+// starting with '#' are ignored. Events happen at the start of the frame
+// their cycle is in.
+//
+// With a checkpoint directory every job resumes from its save state there, if
+// there is one, and leaves its state there when it finishes. Jobs are named
+// by their position in the command line so the same command resumes them.
+//
+// With rewind seconds every frame is recorded as the emulator does, and the
+// memory it takes per minute and the time per snapshot are reported.
+//
+// A movie recorded by the emulator is replayed as fast as it runs instead of
+// the cycles and the input script, with its seed and cpu rate, and the job
+// fails if the ROM is not the one recorded or the final state differs.
+//
+// Every job is seeded with the base seed plus its position, so the same
+// command gives the same hashes, and the seed is printed with its result.
+//
+// With lanes every job runs that many machines of its ROM in lockstep, each
+// seeded with the job seed plus its index and all of them given the input
+// script, and the cycles of all of them are counted.
+//
+// The cycles are those the machines were given, a frame's worth for every
+// frame, even while they wait at Fx0A without running them.
+//
+// With a trace directory every job keeps the last opcodes it ran, and the
+// ones that fail leave them there, named as checkpoints are, for chip8trace.
+//
+// Built with CHIP8_STATS the counters of every job are printed at the end.
+
+struct Options
+{
+   uint64_t cycles = 1000000;
+   uint32_t cpu_rate = DefaultCpuRate;
+   uint32_t repeat = 1;
+   uint32_t jobs = std::max(1u, std::thread::hardware_concurrency());
+   Engine engine = Engine::Interpreter;
+   std::string input_file;
+   std::string checkpoint_dir;
+   uint32_t rewind_seconds = 0;
+   std::string movie_file;
+   uint32_t lanes = 0;
+   std::string trace_dir;
+   uint64_t seed = 0;
+   std::vector<std::string> rom_files;
+};
+
+struct InputEvent
+{
+   uint64_t cycle;
+   KeyState state;
+   Key key;
+};
+
+using InputScript = std::vector<InputEvent>;
+
+struct Job
+{
+   std::string rom_file;
+   std::shared_ptr<const Rom> rom;
+   std::string state_file;
+   std::string trace_file;
+   uint64_t seed = 0;
+   uint64_t cycles = 0;
+   uint64_t hash = 0;
+   double seconds = 0;
+   std::string error;
+   size_t rewindFrames = 0;
+   size_t rewindBytes = 0;
+   double snapshotNanoseconds = 0;
+   // With lanes, the instructions they did run and how many in lockstep
+   uint64_t laneInstructions = 0;
+   uint64_t lockstepInstructions = 0;
+   Stats stats;
+};
+
+void printUsage()
+{
+   std::cout << "Usage: chip8batch [--cycles|-n 'cycles'] [--cpu-rate|-c 'rate'] "
+                "[--jobs|-j 'threads'] "
+                "[--repeat|-R 'times'] [--input|-i 'script'] "
+                "[--engine|-e interpreter|recompiler] [--checkpoint|-k 'dir'] "
+                "[--rewind|-w 'seconds'] [--movie|-m 'movie'] [--lanes|-l 'machines'] "
+                "[--trace|-t 'dir'] [--seed|-s 'seed'] ROM..." << std::endl;
+   exit(EXIT_FAILURE);
+}
+
+Engine parseEngine(const std::string& name)
+{
+   if (name == "interpreter")
+   {
+      return Engine::Interpreter;
+   }
+   if (name == "recompiler")
+   {
+      return Engine::Recompiler;
+   }
+   throw std::invalid_argument(std::string("Unknown engine ") + name);
+}
+
+Options loadOptions(int argc, char** argv)
+{
+   Options options;
+   int opt = 0;
+
+   static struct option long_options[] =
+   {
+      {"cycles", required_argument,  0, 'n'},
+      {"cpu-rate", required_argument, 0, 'c'},
+      {"jobs",   required_argument,  0, 'j'},
+      {"repeat", required_argument,  0, 'R'},
+      {"input",  required_argument,  0, 'i'},
+      {"engine", required_argument,  0, 'e'},
+      {"checkpoint", required_argument, 0, 'k'},
+      {"rewind", required_argument,  0, 'w'},
+      {"movie",  required_argument,  0, 'm'},
+      {"lanes",  required_argument,  0, 'l'},
+      {"trace",  required_argument,  0, 't'},
+      {"seed",   required_argument,  0, 's'},
+      {"help",   no_argument,        0, 'h'},
+      {0, 0, 0, 0}
+   };
+
+   int option_index = 0;
+   while ((opt = getopt_long (argc, argv, "n:c:j:R:i:e:k:w:m:l:t:s:h", long_options, &option_index)) != -1)
+   {
+      switch (opt)
+      {
+         case 'n':
+            options.cycles = std::stoull(optarg);
+            break;
+         case 'c':
+            options.cpu_rate = std::stoul(optarg);
+            if (options.cpu_rate < FrameRate)
+            {
+               throw std::invalid_argument("The cpu rate has to be at least one opcode per frame");
+            }
+            break;
+         case 'j':
+            options.jobs = std::max(1, std::stoi(optarg));
+            break;
+         case 'R':
+            options.repeat = std::max(1, std::stoi(optarg));
+            break;
+         case 'i':
+            options.input_file = optarg;
+            break;
+         case 'e':
+            options.engine = parseEngine(optarg);
+            break;
+         case 'k':
+            options.checkpoint_dir = optarg;
+            break;
+         case 'w':
+            options.rewind_seconds = std::stoul(optarg);
+            break;
+         case 'm':
+            options.movie_file = optarg;
+            break;
+         case 'l':
+            options.lanes = std::stoul(optarg);
+            break;
+         case 't':
+            options.trace_dir = optarg;
+            break;
+         case 's':
+            options.seed = std::stoull(optarg);
+            break;
+         case 'h':
+            printUsage();
+            break;
+         default:
+            throw std::invalid_argument(std::string(1, static_cast<char>(opt)));
+      }
+   }
+
+   for (int i = optind; i < argc; ++i)
+   {
+      options.rom_files.push_back(argv[i]);
+   }
+   if (options.rom_files.empty())
+   {
+      throw std::invalid_argument("No ROM files");
+   }
+   if (not options.movie_file.empty() and (not options.input_file.empty() or not options.checkpoint_dir.empty()))
+   {
+      throw std::invalid_argument("A movie is replayed from the start with its own input");
+   }
+   if (options.lanes > 0 and (not options.movie_file.empty() or not options.checkpoint_dir.empty() or
+                              options.rewind_seconds > 0 or options.engine != Engine::Interpreter or
+                              not options.trace_dir.empty()))
+   {
+      throw std::invalid_argument("Lanes only run an input script with their own engine");
+   }
+   return options;
+}
+
+InputScript loadInputScript(const std::string& name)
+{
+   InputScript script;
+   if (name.empty())
+   {
+      return script;
+   }
+
+   std::ifstream file(name);
+   if (not file.is_open())
+   {
+      throw std::invalid_argument(std::string("Cannot open input script ") + name);
+   }
+
+   std::string line;
+   while (std::getline(file, line))
+   {
+      if (line.empty() or line[0] == '#')
+      {
+         continue;
+      }
+      std::istringstream fields(line);
+      InputEvent event;
+      std::string action;
+      unsigned key = 0;
+      if (not (fields >> event.cycle >> action >> std::hex >> key) or key > 0xF or
+          (action != "press" and action != "release"))
+      {
+         throw std::invalid_argument(std::string("Invalid input event ") + line);
+      }
+      event.state = action == "press" ? KeyState::Pressed : KeyState::Released;
+      // The keypad is indexed by the key value
+      event.key = static_cast<Key>(key);
+      script.push_back(event);
+   }
+
+   std::stable_sort(script.begin(), script.end(),
+      [](const InputEvent& lhs, const InputEvent& rhs)
+      {
+         return lhs.cycle < rhs.cycle;
+      });
+   return script;
+}
+
+// FNV-1a over the rows, good enough to compare final framebuffers between runs
+uint64_t hashGraphics(const Graphics& graphics)
+{
+   uint64_t hash = 0xcbf29ce484222325ULL;
+   for (auto row : graphics)
+   {
+      hash ^= row;
+      hash *= 0x100000001b3ULL;
+   }
+   return hash;
+}
+
+void applyEvent(Chip8& chip8, Key key, KeyState state)
+{
+   if (state == KeyState::Pressed)
+   {
+      chip8.pressKey(key);
+   }
+   else
+   {
+      chip8.releaseKey(key);
+   }
+}
+
+// The opcodes that led to the error, when tracing
+void dumpTrace(Job& job, const Chip8& chip8)
+{
+   if (job.trace_file.empty() or job.error.empty())
+   {
+      return;
+   }
+   try
+   {
+      chip8.getTrace().save(job.trace_file);
+   }
+   catch (const std::exception& e)
+   {
+      job.error += std::string(", ") + e.what();
+   }
+}
+
+void replayMovie(Job& job, const Options& options, const Movie& movie)
+{
+   if (Movie::hash(job.rom->data(), job.rom->size()) != movie.romHash)
+   {
+      throw std::invalid_argument("The movie was not recorded with this ROM");
+   }
+   Chip8 chip8;
+   chip8.setCpuRate(movie.cpuRate);
+   chip8.setEngine(options.engine);
+   chip8.setSeed(movie.seed);
+   chip8.loadGame(*job.rom);
+   if (not job.trace_file.empty())
+   {
+      chip8.setTrace(DefaultTraceEntries);
+   }
+
+   auto event = movie.events.begin();
+   auto start = std::chrono::steady_clock::now();
+   try
+   {
+      for (uint64_t frame = 0; frame < movie.frames; ++frame)
+      {
+         for (; event != movie.events.end() and event->frame == frame; ++event)
+         {
+            applyEvent(chip8, event->key, event->state);
+         }
+         chip8.emulateFrame();
+         job.cycles += chip8.getCyclesPerFrame();
+      }
+      if (Movie::hash(chip8.saveState()) != movie.finalHash)
+      {
+         job.error = "Replay desynced";
+      }
+   }
+   catch (const std::exception& e)
+   {
+      job.error = e.what();
+   }
+   job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   job.hash = hashGraphics(chip8.getGraphics());
+   job.stats = chip8.getStats();
+   dumpTrace(job, chip8);
+}
+
+void runLanes(Job& job, const Options& options, const InputScript& script)
+{
+   Chip8Lockstep lanes(options.lanes);
+   lanes.setCpuRate(options.cpu_rate);
+   for (size_t lane = 0; lane < options.lanes; ++lane)
+   {
+      lanes.setSeed(lane, job.seed + lane);
+   }
+   lanes.loadGame(*job.rom);
+
+   auto event = script.begin();
+   auto start = std::chrono::steady_clock::now();
+   uint64_t cycles = 0;
+   try
+   {
+      for (; cycles < options.cycles; cycles += lanes.getCyclesPerFrame())
+      {
+         auto frameEnd = cycles + lanes.getCyclesPerFrame();
+         for (; event != script.end() and event->cycle < frameEnd; ++event)
+         {
+            for (size_t lane = 0; lane < options.lanes; ++lane)
+            {
+               if (event->state == KeyState::Pressed)
+               {
+                  lanes.pressKey(lane, event->key);
+               }
+               else
+               {
+                  lanes.releaseKey(lane, event->key);
+               }
+            }
+         }
+         lanes.emulateFrame();
+      }
+   }
+   catch (const std::exception& e)
+   {
+      job.error = e.what();
+   }
+   job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   // Counted as a job of a single machine counts them
+   job.cycles = cycles * options.lanes;
+   job.laneInstructions = lanes.getInstructions();
+   job.lockstepInstructions = lanes.getLockstepInstructions();
+   for (size_t lane = 0; lane < options.lanes; ++lane)
+   {
+      job.hash = (job.hash ^ hashGraphics(lanes.getGraphics(lane))) * 0x100000001b3ULL;
+   }
+}
+
+void runJob(Job& job, const Options& options, const InputScript& script)
+{
+   auto cycles = options.cycles;
+   Chip8 chip8;
+   chip8.setCpuRate(options.cpu_rate);
+   chip8.setEngine(options.engine);
+   chip8.setSeed(job.seed);
+   chip8.loadGame(*job.rom);
+   if (not job.trace_file.empty())
+   {
+      chip8.setTrace(DefaultTraceEntries);
+   }
+   if (not job.state_file.empty())
+   {
+      std::ifstream file(job.state_file, std::ios::binary);
+      if (file.is_open())
+      {
+         chip8.loadState(SaveState(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()));
+      }
+   }
+
+   Rewind rewind(options.rewind_seconds * FrameRate);
+   auto event = script.begin();
+   auto start = std::chrono::steady_clock::now();
+   try
+   {
+      while (job.cycles < cycles)
+      {
+         auto frameEnd = job.cycles + chip8.getCyclesPerFrame();
+         for (; event != script.end() and event->cycle < frameEnd; ++event)
+         {
+            applyEvent(chip8, event->key, event->state);
+         }
+         chip8.emulateFrame();
+         job.cycles = frameEnd;
+         if (options.rewind_seconds > 0)
+         {
+            rewind.push(chip8.saveState());
+         }
+      }
+   }
+   catch (const std::exception& e)
+   {
+      job.error = e.what();
+   }
+   job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   job.hash = hashGraphics(chip8.getGraphics());
+   job.stats = chip8.getStats();
+   job.rewindFrames = rewind.frames();
+   job.rewindBytes = rewind.memoryUsage();
+   job.snapshotNanoseconds = rewind.nanosecondsPerSnapshot();
+   dumpTrace(job, chip8);
+
+   if (not job.state_file.empty() and job.error.empty())
+   {
+      auto state = chip8.saveState();
+      std::ofstream file(job.state_file, std::ios::binary);
+      if (not file.write(reinterpret_cast<const char*>(state.data()), state.size()))
+      {
+         job.error = std::string("Cannot write ") + job.state_file;
+      }
+   }
+}
+
+int main(int argc, char **argv)
+{
+   Options options;
+   InputScript script;
+   Movie movie;
+   try
+   {
+      options = loadOptions(argc, argv);
+      script = loadInputScript(options.input_file);
+      if (not options.movie_file.empty())
+      {
+         movie = Movie::load(options.movie_file);
+      }
+   }
+   catch (const std::exception& e)
+   {
+      std::cerr << "Invalid argument " << e.what() << std::endl;
+      printUsage();
+   }
+
+   std::map<std::string, std::shared_ptr<const Rom>> roms;
+   std::map<std::string, std::string> romErrors;
+   for (const auto& rom_file : options.rom_files)
+   {
+      try
+      {
+         roms[rom_file] = RomLibrary::load(rom_file);
+      }
+      catch (const std::exception& e)
+      {
+         romErrors[rom_file] = e.what();
+      }
+   }
+
+   std::vector<Job> jobs;
+   for (uint32_t i = 0; i < options.repeat; ++i)
+   {
+      for (const auto& rom_file : options.rom_files)
+      {
+         Job job;
+         job.rom_file = rom_file;
+         job.rom = roms[rom_file];
+         job.error = romErrors[rom_file];
+         job.seed = options.seed + jobs.size();
+         if (not options.checkpoint_dir.empty())
+         {
+            job.state_file = options.checkpoint_dir + "/" + std::to_string(jobs.size()) + ".state";
+         }
+         if (not options.trace_dir.empty())
+         {
+            job.trace_file = options.trace_dir + "/" + std::to_string(jobs.size()) + ".trace";
+         }
+         jobs.push_back(job);
+      }
+   }
+
+   // Every worker takes the next pending job until there are none left
+   std::atomic<size_t> next(0);
+   auto worker = [&]
+   {
+      for (auto i = next++; i < jobs.size(); i = next++)
+      {
+         if (not jobs[i].rom)
+         {
+            continue;
+         }
+         try
+         {
+            if (not options.movie_file.empty())
+            {
+               replayMovie(jobs[i], options, movie);
+            }
+            else if (options.lanes > 0)
+            {
+               runLanes(jobs[i], options, script);
+            }
+            else
+            {
+               runJob(jobs[i], options, script);
+            }
+         }
+         catch (const std::exception& e)
+         {
+            jobs[i].error = e.what();
+         }
+      }
+   };
+
+   auto start = std::chrono::steady_clock::now();
+   std::vector<std::thread> workers;
+   auto threads = std::min<size_t>(options.jobs, jobs.size());
+   for (size_t i = 0; i < threads; ++i)
+   {
+      workers.emplace_back(worker);
+   }
+   for (auto& thread : workers)
+   {
+      thread.join();
+   }
+   auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+   int status = EXIT_SUCCESS;
+   uint64_t totalCycles = 0;
+   std::cout << std::left << std::setw(24) << "rom" << std::right
+             << std::setw(12) << "cycles" << std::setw(18) << "hash"
+             << std::setw(22) << "seed"
+             << std::setw(12) << "Minstr/s" << std::endl;
+   for (const auto& job : jobs)
+   {
+      totalCycles += job.cycles;
+      std::cout << std::left << std::setw(24) << job.rom_file << std::right
+                << std::dec << std::setw(12) << job.cycles
+                << "  " << std::hex << std::setfill('0') << std::setw(16) << job.hash
+                << std::setfill(' ') << std::dec << std::setw(22) << job.seed << std::fixed << std::setprecision(2)
+                << std::setw(12) << (job.seconds > 0 ? job.cycles / job.seconds / 1e6 : 0.0);
+      if (not job.error.empty())
+      {
+         std::cout << "  error: " << job.error;
+         status = EXIT_FAILURE;
+      }
+      std::cout << std::endl;
+   }
+   for (const auto& job : jobs)
+   {
+      if (job.rewindFrames > 0)
+      {
+         auto minutes = job.rewindFrames / (60.0 * FrameRate);
+         std::cout << "rewind " << job.rom_file << ": " << job.rewindFrames / FrameRate << " s in "
+                   << job.rewindBytes / 1024 << " KB, "
+                   << static_cast<size_t>(job.rewindBytes / 1024 / minutes) << " KB per minute, "
+                   << std::setprecision(2) << job.snapshotNanoseconds / 1000 << " us per snapshot" << std::endl;
+      }
+   }
+   for (const auto& job : jobs)
+   {
+      if (options.lanes > 0 and job.cycles > 0 and job.laneInstructions > 0)
+      {
+         std::cout << "lanes " << job.rom_file << ": " << options.lanes << " machines, "
+                   << job.laneInstructions << " instructions run, " << std::setprecision(1)
+                   << 100.0 * job.lockstepInstructions / job.laneInstructions
+                   << "% of them in lockstep" << std::setprecision(2) << std::endl;
+      }
+   }
+   if (Chip8::statsEnabled() and options.lanes == 0)
+   {
+      for (const auto& job : jobs)
+      {
+         std::cout << "stats " << job.rom_file << ":" << std::endl << job.stats;
+      }
+   }
+   std::cout << jobs.size() << " jobs on " << threads << " threads, "
+             << totalCycles << " instructions in " << seconds << " s, "
+             << totalCycles / seconds / 1e6 << " Minstr/s" << std::endl;
+
+   return status;
+}
@@ -0,0 +1,110 @@
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include "RomLibrary.h"
+
+// Indexes ROM directories, as the emulator does with --library, and lists
+// their games with their hashes and the settings the database has for them,
+// so new games can be added to it.
+
+struct Options
+{
+   std::string database = "roms.db";
+   std::vector<std::string> directories;
+};
+
+void printUsage()
+{
+   std::cout << "Usage: chip8library [--database|-d 'settings file'] 'directory'..." << std::endl;
+   exit(EXIT_FAILURE);
+}
+
+Options loadOptions(int argc, char** argv)
+{
+   Options options;
+   int opt = 0;
+
+   static struct option long_options[] =
+   {
+      {"database",  required_argument,  0, 'd'},
+      {"help",      no_argument,        0, 'h'},
+      {0, 0, 0, 0}
+   };
+
+   int option_index = 0;
+   while ((opt = getopt_long (argc, argv, "d:h", long_options, &option_index)) != -1)
+   {
+      switch (opt)
+      {
+         case 'd':
+            options.database = optarg;
+            break;
+         case 'h':
+            printUsage();
+            break;
+         default:
+            throw std::invalid_argument(std::string(1, static_cast<char>(opt)));
+      }
+   }
+
+   if (optind == argc)
+   {
+      throw std::invalid_argument("A directory is needed");
+   }
+   options.directories.assign(argv + optind, argv + argc);
+   return options;
+}
+
+int main(int argc, char **argv)
+{
+   Options options;
+   RomLibrary library;
+   try
+   {
+      options = loadOptions(argc, argv);
+      library.loadDatabase(options.database);
+      for (const auto& directory : options.directories)
+      {
+         library.scan(directory);
+      }
+   }
+   catch (const std::exception& e)
+   {
+      std::cerr << "Invalid argument " << e.what() << std::endl;
+      printUsage();
+   }
+
+   std::cout << library.getEntries().size() << " games, " << library.getFilesRead() << " of them read again"
+             << std::endl;
+   for (const auto& entry : library.getEntries())
+   {
+      std::cout << std::hex << std::setfill('0') << std::setw(16) << entry.hash << std::dec << std::setfill(' ')
+                << "  " << std::left << std::setw(4) << entry.format << "  " << std::setw(40) << entry.file
+                << std::right;
+      auto settings = library.getSettings(entry.hash);
+      if (settings)
+      {
+         std::cout << "  " << settings->title << " ipf=" << settings->instructionsPerFrame;
+         if (not settings->quirks.empty())
+         {
+            std::cout << " quirks=" << settings->quirks;
+         }
+         for (const auto& key : settings->keys)
+         {
+            std::cout << " " << key.first << "=" << std::hex << std::uppercase << int(key.second)
+                      << std::nouppercase << std::dec;
+         }
+      }
+      else
+      {
+         std::cout << "  unknown";
+      }
+      std::cout << std::endl;
+   }
+
+   return EXIT_SUCCESS;
+}
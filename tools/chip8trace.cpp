@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <getopt.h>
+
+#include "Disassembler.h"
+#include "Trace.h"
+
+// Decodes a trace written by the emulator or chip8batch into a disassembly
+// of the opcodes, oldest first, with the frame they ran in and the registers
+// they may have touched as they left them.
+
+struct Options
+{
+   // Only the newest ones, all of them when 0
+   uint64_t last = 0;
+   std::string trace_file;
+};
+
+void printUsage()
+{
+   std::cout << "Usage: chip8trace [--last|-n 'opcodes'] 'trace file'" << std::endl;
+   exit(EXIT_FAILURE);
+}
+
+Options loadOptions(int argc, char** argv)
+{
+   Options options;
+   int opt = 0;
+
+   static struct option long_options[] =
+   {
+      {"last",   required_argument,  0, 'n'},
+      {"help",   no_argument,        0, 'h'},
+      {0, 0, 0, 0}
+   };
+
+   int option_index = 0;
+   while ((opt = getopt_long (argc, argv, "n:h", long_options, &option_index)) != -1)
+   {
+      switch (opt)
+      {
+         case 'n':
+            options.last = std::stoull(optarg);
+            break;
+         case 'h':
+            printUsage();
+            break;
+         default:
+            throw std::invalid_argument(std::string(1, static_cast<char>(opt)));
+      }
+   }
+
+   if (optind + 1 != argc)
+   {
+      throw std::invalid_argument("One trace file is needed");
+   }
+   options.trace_file = argv[optind];
+   return options;
+}
+
+int main(int argc, char **argv)
+{
+   Options options;
+   Trace trace;
+   try
+   {
+      options = loadOptions(argc, argv);
+      trace = Trace::load(options.trace_file);
+   }
+   catch (const std::exception& e)
+   {
+      std::cerr << "Invalid argument " << e.what() << std::endl;
+      printUsage();
+   }
+
+   auto count = trace.entries.size();
+   if (options.last > 0)
+   {
+      count = std::min<uint64_t>(count, options.last);
+   }
+   std::cout << "The last " << count << " of " << trace.total << " opcodes, oldest first" << std::endl;
+   std::cout << std::setw(10) << "frame" << std::setw(7) << "pc" << "  opcode  "
+             << std::left << std::setw(18) << "instruction" << std::right
+             << "  Vx  Vy  VF       I  DT" << std::endl;
+
+   std::cout << std::hex << std::uppercase << std::setfill('0');
+   for (auto entry = trace.entries.end() - count; entry != trace.entries.end(); ++entry)
+   {
+      std::cout << std::dec << std::setfill(' ') << std::setw(10) << entry->frame
+                << std::hex << std::setfill('0')
+                << "  0x" << std::setw(3) << entry->pc
+                << "  " << std::setw(4) << entry->opcode << "    "
+                << std::left << std::setfill(' ') << std::setw(18) << disassemble(entry->opcode) << std::right
+                << std::setfill('0')
+                << "  " << std::setw(2) << unsigned(entry->Vx)
+                << "  " << std::setw(2) << unsigned(entry->Vy)
+                << "  " << std::setw(2) << unsigned(entry->VF)
+                << "  0x" << std::setw(4) << entry->I
+                << "  " << std::setw(2) << unsigned(entry->delayTimer) << std::endl;
+   }
+
+   return EXIT_SUCCESS;
+}